@@ -0,0 +1,244 @@
+#include "../libraries/autofrotz.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+using std::printf;
+using std::fprintf;
+using autofrotz::Vm;
+using autofrotz::VmOptions;
+using autofrotz::State;
+using core::u8string;
+using std::vector;
+using std::sort;
+using std::exception;
+using std::chrono::steady_clock;
+using std::chrono::duration;
+
+/* -----------------------------------------------------------------------------
+   Runs a story through a script of commands a number of times, reporting (as
+   JSON) how fast the actions went and how long VM construction, saving,
+   restoring and undoing took.
+
+   Usage: autofrotz_benchmark STORY SCRIPT [-w WARMUPS] [-r REPETITIONS]
+            [-s SAVE-COMMAND] [-l RESTORE-COMMAND] [-u UNDO-COMMAND]
+
+   The script has one command per line; blank lines and lines starting with #
+   are skipped. Saving and restoring go through the Vm's states (by answering
+   the story's filename prompt with U+0001), so the save and restore commands
+   must be ones that prompt for a filename.
+----------------------------------------------------------------------------- */
+#define WIDTH 70
+#define HEIGHT 128
+
+class Samples {
+  prv vector<double> micros;
+  prv double total = 0;
+
+  pub void add (steady_clock::duration d);
+  pub size_t size () const noexcept;
+  pub double getTotalSecs () const noexcept;
+  pub void print (const char *name, const char *extra, bool last);
+};
+
+void Samples::add (steady_clock::duration d) {
+  double m = duration<double, std::micro>(d).count();
+  micros.push_back(m);
+  total += m;
+}
+
+size_t Samples::size () const noexcept {
+  return micros.size();
+}
+
+double Samples::getTotalSecs () const noexcept {
+  return total / 1000000;
+}
+
+void Samples::print (const char *name, const char *extra, bool last) {
+  sort(micros.begin(), micros.end());
+  auto percentile = [this] (double p) -> double {
+    if (micros.empty()) {
+      return 0;
+    }
+    // Nearest rank
+    size_t i = static_cast<size_t>(p / 100 * static_cast<double>(micros.size()) + 0.999999);
+    return micros[i == 0 ? 0 : i - 1];
+  };
+
+  printf("  \"%s\": {\"count\": %zu, %s", name, micros.size(), extra);
+  printf("\"latencyMicros\": {\"min\": %.3f, \"mean\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f}}%s\n",
+    micros.empty() ? 0 : micros.front(), micros.empty() ? 0 : total / static_cast<double>(micros.size()),
+    percentile(50), percentile(90), percentile(99), micros.empty() ? 0 : micros.back(),
+    last ? "" : ",");
+}
+
+static void printJsonString (const char *s) {
+  putchar('"');
+  for (; *s; ++s) {
+    if (*s == '"' || *s == '\\') {
+      putchar('\\');
+      putchar(*s);
+    } else if (static_cast<unsigned char>(*s) < 0x20) {
+      printf("\\u%04x", static_cast<unsigned char>(*s));
+    } else {
+      putchar(*s);
+    }
+  }
+  putchar('"');
+}
+
+static bool readScript (const char *fileName, vector<u8string> &r_commands) {
+  FILE *f = fopen(fileName, "r");
+  if (!f) {
+    return false;
+  }
+
+  char b[512];
+  while (fgets(b, sizeof(b), f)) {
+    size_t l = strlen(b);
+    while (l > 0 && (b[l - 1] == '\n' || b[l - 1] == '\r')) {
+      b[--l] = '\0';
+    }
+    if (l == 0 || b[0] == '#') {
+      continue;
+    }
+    u8string command(reinterpret_cast<const char8_t *>(b), l);
+    command.push_back(u8'\n');
+    r_commands.push_back(command);
+  }
+  fclose(f);
+  return true;
+}
+
+static u8string withFilename (const char *command) {
+  u8string in(reinterpret_cast<const char8_t *>(command));
+  in.append(u8"\n\1\n");
+  return in;
+}
+
+int main (int argc, char *argv[]) {
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s STORY SCRIPT [-w WARMUPS] [-r REPETITIONS] [-s SAVE-COMMAND] [-l RESTORE-COMMAND] [-u UNDO-COMMAND]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  const char *storyFileName = argv[1];
+  const char *scriptFileName = argv[2];
+  iu warmups = 1;
+  iu repetitions = 10;
+  const char *saveCommand = "save";
+  const char *restoreCommand = "restore";
+  const char *undoCommand = "undo";
+  for (int i = 3; i + 1 < argc; i += 2) {
+    if (strcmp(argv[i], "-w") == 0) {
+      warmups = static_cast<iu>(atoi(argv[i + 1]));
+    } else if (strcmp(argv[i], "-r") == 0) {
+      repetitions = static_cast<iu>(atoi(argv[i + 1]));
+    } else if (strcmp(argv[i], "-s") == 0) {
+      saveCommand = argv[i + 1];
+    } else if (strcmp(argv[i], "-l") == 0) {
+      restoreCommand = argv[i + 1];
+    } else if (strcmp(argv[i], "-u") == 0) {
+      undoCommand = argv[i + 1];
+    } else {
+      fprintf(stderr, "unknown option %s\n", argv[i]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  vector<u8string> commands;
+  if (!readScript(scriptFileName, commands)) {
+    fprintf(stderr, "could not read script %s\n", scriptFileName);
+    return EXIT_FAILURE;
+  }
+  const u8string saveInput = withFilename(saveCommand);
+  const u8string restoreInput = withFilename(restoreCommand);
+  u8string undoInput(reinterpret_cast<const char8_t *>(undoCommand));
+  undoInput.push_back(u8'\n');
+
+  Samples construction, actions, saves, restores, undos;
+  iu64 instructions = 0;
+  try {
+    for (iu rep = 0; rep < warmups + repetitions; ++rep) {
+      const bool measured = rep >= warmups;
+      u8string output;
+
+      auto st = steady_clock::now();
+      Vm vm(storyFileName, WIDTH, HEIGHT, 1, VmOptions(), output);
+      auto d = steady_clock::now() - st;
+      if (measured) {
+        construction.add(d);
+      }
+
+      for (const u8string &command : commands) {
+        st = steady_clock::now();
+        vm.doAction(command);
+        d = steady_clock::now() - st;
+        if (!vm.isAlive()) {
+          fprintf(stderr, "Z-machine terminated during the script\n");
+          return EXIT_FAILURE;
+        }
+        if (measured) {
+          actions.add(d);
+          instructions += vm.getActionStats().instructions;
+        }
+      }
+
+      State state;
+      vm.setSaveState(&state);
+      st = steady_clock::now();
+      vm.doAction(saveInput);
+      d = steady_clock::now() - st;
+      vm.setSaveState(nullptr);
+      if (vm.getSaveCount() == 1) {
+        if (measured) {
+          saves.add(d);
+        }
+
+        vm.setRestoreState(&state);
+        st = steady_clock::now();
+        vm.doAction(restoreInput);
+        d = steady_clock::now() - st;
+        vm.setRestoreState(nullptr);
+        if (measured && vm.getRestoreCount() == 1) {
+          restores.add(d);
+        }
+      }
+
+      if (vm.isAlive()) {
+        st = steady_clock::now();
+        vm.doAction(undoInput);
+        d = steady_clock::now() - st;
+        if (measured) {
+          undos.add(d);
+        }
+      }
+    }
+  } catch (exception &e) {
+    fprintf(stderr, "benchmark failed (%s)\n", e.what());
+    return EXIT_FAILURE;
+  }
+
+  double actionSecs = actions.getTotalSecs();
+  char rates[128];
+  snprintf(rates, sizeof(rates), "\"actionsPerSec\": %.1f, \"instructionsPerSec\": %.1f, ",
+    actionSecs > 0 ? static_cast<double>(actions.size()) / actionSecs : 0,
+    actionSecs > 0 ? static_cast<double>(instructions) / actionSecs : 0);
+
+  printf("{\n  \"story\": ");
+  printJsonString(storyFileName);
+  printf(",\n  \"script\": ");
+  printJsonString(scriptFileName);
+  printf(",\n  \"warmups\": %u,\n  \"repetitions\": %u,\n", warmups, repetitions);
+  construction.print("construction", "", false);
+  actions.print("actions", rates, false);
+  saves.print("save", "", false);
+  restores.print("restore", "", false);
+  undos.print("undo", "", true);
+  printf("}\n");
+
+  return EXIT_SUCCESS;
+}
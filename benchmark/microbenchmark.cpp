@@ -0,0 +1,257 @@
+#include "../libraries/autofrotz.hpp"
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+// from Frotz (included last, since it defines macros such as hi and lo)
+#include "../libraries/autofrotz_vm/common/frotz.h"
+
+extern int save_undo (void);
+extern int restore_undo (void);
+extern void tokenise_line (zword, zword, zword, bool);
+extern zword auto_save_quetzal ();
+extern zword auto_restore_quetzal ();
+extern void dumb_show_screen (bool);
+
+using std::printf;
+using std::fprintf;
+using autofrotz::Vm;
+using autofrotz::VmOptions;
+using autofrotz::State;
+using autofrotz::vmlink::VmLink;
+using core::u8string;
+using std::vector;
+using std::thread;
+using std::exception;
+using std::chrono::steady_clock;
+using std::chrono::duration;
+
+/* -----------------------------------------------------------------------------
+   Times the interpreter's subsystems in isolation, driving them directly
+   against a loaded story image (while the Z-machine sits waiting for input)
+   and reporting (as JSON) the nanoseconds per operation over a number of
+   batches.
+
+   Usage: autofrotz_microbenchmark STORY [-b BATCHES]
+----------------------------------------------------------------------------- */
+#define WIDTH 70
+#define HEIGHT 128
+#define MIN_BATCH_SECS 0.002
+
+static iu batches = 15;
+static bool first = true;
+
+template<typename _F> static void measure (const char *name, _F &&f) {
+  // Find a batch size that takes long enough to time
+  iu64 ops = 1;
+  for (;;) {
+    auto st = steady_clock::now();
+    f(ops);
+    if (duration<double>(steady_clock::now() - st).count() >= MIN_BATCH_SECS) {
+      break;
+    }
+    ops *= 2;
+  }
+
+  vector<double> nsPerOp;
+  for (iu b = 0; b < batches; ++b) {
+    auto st = steady_clock::now();
+    f(ops);
+    nsPerOp.push_back(duration<double, std::nano>(steady_clock::now() - st).count() / static_cast<double>(ops));
+  }
+
+  double mean = 0, min = nsPerOp[0], max = nsPerOp[0];
+  for (double n : nsPerOp) {
+    mean += n;
+    min = n < min ? n : min;
+    max = n > max ? n : max;
+  }
+  mean /= static_cast<double>(nsPerOp.size());
+  double variance = 0;
+  for (double n : nsPerOp) {
+    variance += (n - mean) * (n - mean);
+  }
+  variance /= static_cast<double>(nsPerOp.size());
+
+  printf("%s\n  {\"name\": \"%s\", \"opsPerBatch\": %llu, \"batches\": %u, \"nsPerOp\": {\"mean\": %.2f, \"stddev\": %.2f, \"min\": %.2f, \"max\": %.2f}}",
+    first ? "" : ",", name, static_cast<unsigned long long>(ops), batches, mean, sqrt(variance), min, max);
+  first = false;
+}
+
+static iu countObjects () {
+  zword objects = static_cast<zword>(h_objects + (h_version <= V3 ? 62 : 126));
+  zword size = (h_version <= V3) ? 9 : 14;
+  zword props;
+  LOW_WORD (objects + (h_version <= V3 ? 7 : 12), props)
+  return (props > objects) ? (props - objects) / size : 0;
+}
+
+/* Put a line of text and a parse buffer for it at the top of dynamic memory
+   (where they will clobber whatever the story kept there). */
+static void setUpTokenising (zword &r_text, zword &r_token) {
+  static const char line[] = "take the lamp and open the mailbox then go north and look at the leaflet";
+  const zword length = sizeof(line) - 1;
+  r_token = static_cast<zword>(h_dynamic_size - 2 - 4 * 32);
+  r_text = static_cast<zword>(r_token - length - 3);
+
+  zmp[r_text] = static_cast<zbyte>(length + 1);
+  zword t = static_cast<zword>(r_text + 1);
+  if (h_version >= V5) {
+    zmp[t++] = static_cast<zbyte>(length);
+  }
+  for (zword i = 0; i < length; ++i) {
+    zmp[t + i] = static_cast<zbyte>(line[i]);
+  }
+  zmp[t + length] = 0;
+  zmp[r_token] = 32;
+}
+
+static void runStoryBenchmarks (const char *storyFileName) {
+  u8string output;
+  Vm vm(storyFileName, WIDTH, HEIGHT, 1, VmOptions(), output);
+  if (!vm.isAlive()) {
+    fprintf(stderr, "Z-machine terminated on startup\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // The interpreter's globals belong to the Z-machine's thread, so drive it
+  // from there
+  vm.runOnVmThread([&vm, &output] () {
+    // Printing goes nowhere, so that only the decoding is timed
+    bool screen = ostream_screen;
+    ostream_screen = FALSE;
+    iu objectCount = countObjects();
+    if (objectCount != 0) {
+      measure("decode_text (object names)", [objectCount] (iu64 ops) {
+        for (iu64 i = 0; i < ops; ++i) {
+          print_object(static_cast<zword>(1 + i % objectCount));
+        }
+        flush_buffer();
+      });
+    }
+    if (h_version >= V2) {
+      const iu abbreviationCount = (h_version == V2) ? 32 : 96;
+      measure("decode_text (abbreviations)", [abbreviationCount] (iu64 ops) {
+        for (iu64 i = 0; i < ops; ++i) {
+          zword addr;
+          LOW_WORD (h_abbreviations + 2 * (i % abbreviationCount), addr)
+          zargs[0] = static_cast<zword>(addr * 2);
+          z_print_addr();
+        }
+        flush_buffer();
+      });
+    }
+    ostream_screen = screen;
+
+    zword text, token;
+    setUpTokenising(text, token);
+    measure("tokenise_line (lookup_text)", [text, token] (iu64 ops) {
+      for (iu64 i = 0; i < ops; ++i) {
+        tokenise_line(text, token, 0, FALSE);
+      }
+    });
+
+    measure("save_undo + restore_undo (mem_diff/mem_undiff)", [] (iu64 ops) {
+      for (iu64 i = 0; i < ops; ++i) {
+        zmp[h_dynamic_size - 1] ^= 1;
+        save_undo();
+        restore_undo();
+      }
+    });
+
+    State state;
+    vm.setSaveState(&state);
+    measure("auto_save_quetzal", [] (iu64 ops) {
+      for (iu64 i = 0; i < ops; ++i) {
+        auto_save_quetzal();
+      }
+    });
+    vm.setSaveState(nullptr);
+    vm.setRestoreState(&state);
+    measure("auto_restore_quetzal", [] (iu64 ops) {
+      for (iu64 i = 0; i < ops; ++i) {
+        auto_restore_quetzal();
+      }
+    });
+    vm.setRestoreState(nullptr);
+
+    measure("dumb_show_screen (unchanged)", [&output] (iu64 ops) {
+      for (iu64 i = 0; i < ops; ++i) {
+        dumb_show_screen(FALSE);
+      }
+      output.clear();
+    });
+    measure("dumb_show_screen (one row changed)", [&output] (iu64 ops) {
+      static const zchar rows[2][16] = {
+        {'T', 'h', 'e', ' ', 'q', 'u', 'i', 'c', 'k', ' ', 'f', 'o', 'x', '.', 0},
+        {'A', ' ', 'l', 'a', 'z', 'y', ' ', 'd', 'o', 'g', '.', 0}
+      };
+      for (iu64 i = 0; i < ops; ++i) {
+        os_set_cursor(HEIGHT / 2, 1);
+        os_display_string(rows[i & 1]);
+        dumb_show_screen(FALSE);
+      }
+      output.clear();
+    });
+  });
+}
+
+static void runHandoffBenchmark () {
+  u8string output;
+  VmLink link("", WIDTH, HEIGHT, 0, false, false, false);
+  thread t([&link, &output] () {
+    link.setOutput(&output);
+    try {
+      for (;;) {
+        link.readInput();
+      }
+    } catch (...) {
+    }
+    link.completed(nullptr);
+  });
+  link.waitForInputExhaustion();
+
+  const u8string in(u8"\n");
+  measure("VmLink handoff round trip", [&link, &in] (iu64 ops) {
+    for (iu64 i = 0; i < ops; ++i) {
+      link.supplyInput(in.begin(), in.end());
+    }
+  });
+
+  link.kill();
+  t.join();
+}
+
+int main (int argc, char *argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s STORY [-b BATCHES]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  for (int i = 2; i + 1 < argc; i += 2) {
+    if (strcmp(argv[i], "-b") == 0) {
+      batches = static_cast<iu>(atoi(argv[i + 1]));
+    } else {
+      fprintf(stderr, "unknown option %s\n", argv[i]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (batches == 0) {
+    batches = 1;
+  }
+
+  printf("[");
+  try {
+    runStoryBenchmarks(argv[1]);
+    runHandoffBenchmark();
+  } catch (exception &e) {
+    fprintf(stderr, "microbenchmark failed (%s)\n", e.what());
+    return EXIT_FAILURE;
+  }
+  printf("\n]\n");
+
+  return EXIT_SUCCESS;
+}
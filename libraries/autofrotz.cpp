@@ -1,6 +1,15 @@
 #include "autofrotz.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <memory>
 // from Frotz
 extern int common_main (autofrotz::vmlink::VmLink *vmLink);
+extern void release_memory ();
+extern bool is_snapshot (const core::string<autofrotz::vmlink::zbyte> &snapshot);
+extern bool snapshots_await_same_read (const core::string<autofrotz::vmlink::zbyte> &a, const core::string<autofrotz::vmlink::zbyte> &b);
+extern void snapshot_layout (size_t *random, size_t *random_size, size_t *screen, size_t *screen_size, size_t *memory, size_t *memory_size);
+extern bool snapshot_parts (const core::string<autofrotz::vmlink::zbyte> &snapshot, size_t *header, long *pc, size_t *rest, size_t *memory, size_t *memory_size, size_t *stack, size_t *stack_size);
 
 LIB_DEPENDENCIES
 
@@ -10,19 +19,170 @@ using std::exception_ptr;
 using std::exception;
 using std::current_exception;
 using std::thread;
+using std::chrono::steady_clock;
+using std::vector;
 using core::u8string;
+using std::u8string_view;
 using bitset::Bitset;
+using std::atomic;
+using std::ptrdiff_t;
+using std::min;
+using std::move;
+using std::to_address;
+using std::equal;
+using std::memcmp;
+using std::memcpy;
+using core::string;
+using std::function;
+using std::unique_ptr;
+using std::mutex;
+using std::unique_lock;
+using std::rethrow_exception;
+using std::max;
+using std::shared_ptr;
+using std::make_shared;
+using std::push_heap;
+using std::pop_heap;
+using std::reverse;
+using std::chrono::duration;
+using std::chrono::milliseconds;
+using std::pair;
 
 /* -----------------------------------------------------------------------------
 ----------------------------------------------------------------------------- */
 DC();
 
-Vm::Vm (const char *zcodeFileName, iu screenWidth, iu screenHeight, iu undoDepth, bool enableWordSet, u8string &r_output) :
-  vmLink(zcodeFileName, screenWidth, screenHeight, undoDepth, enableWordSet), vmThread(new thread([this, &r_output] () {
+static atomic<AllocationHook> allocationHook(nullptr);
+
+// Every slot of the cache's index also costs (roughly) a node and a bucket
+static const size_t INDEX_ENTRY_SIZE = sizeof(iu64) + sizeof(size_t) + 3 * sizeof(void *);
+
+// Differences separated by fewer equal bytes than this share a run
+static const size_t DELTA_GAP = 8;
+
+static iu64 mix (iu64 h) noexcept {
+  h ^= h >> 31;
+  h *= 0x7FB5D329728EA185ULL;
+  h ^= h >> 27;
+  h *= 0x81DADEF4BC2DD44DULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static iu64 hashBytes (const void *b, size_t n, iu64 seed) noexcept {
+  const char *p = static_cast<const char *>(b);
+  iu64 h = seed ^ (n * 0x9E3779B97F4A7C15ULL);
+  for (; n >= 8; p += 8, n -= 8) {
+    iu64 w;
+    memcpy(&w, p, 8);
+    h = (h ^ w) * 0xBF58476D1CE4E5B9ULL;
+    h ^= h >> 29;
+  }
+  iu64 w = 0;
+  memcpy(&w, p, n);
+  return mix(h ^ w);
+}
+
+static iu64 hashInput (iu64 stateHash, u8string::const_iterator inputBegin, u8string::const_iterator inputEnd) noexcept {
+  return hashBytes(to_address(inputBegin), static_cast<size_t>(inputEnd - inputBegin), stateHash);
+}
+
+static void diffBytes (const zbyte *b0, const zbyte *b1, size_t size, const RangeCallback &f) {
+  // Calls f(begin, end) for each run of offsets at which the bytes differ,
+  // comparing a block of words at a time (which the compiler can vectorise)
+  // and looking at single bytes only in blocks that differ
+  static const size_t BLOCK_SIZE = 32;
+  bool inRun = false;
+  size_t begin = 0;
+  auto step = [&] (size_t i) {
+    if (b0[i] != b1[i]) {
+      if (!inRun) {
+        begin = i;
+        inRun = true;
+      }
+    } else if (inRun) {
+      f(static_cast<iu32>(begin), static_cast<iu32>(i));
+      inRun = false;
+    }
+  };
+
+  size_t i = 0;
+  for (; i + BLOCK_SIZE <= size; i += BLOCK_SIZE) {
+    iu64 d = 0;
+    for (size_t j = i; j != i + BLOCK_SIZE; j += sizeof(iu64)) {
+      iu64 w0, w1;
+      memcpy(&w0, b0 + j, sizeof(iu64));
+      memcpy(&w1, b1 + j, sizeof(iu64));
+      d |= w0 ^ w1;
+    }
+    if (d == 0) {
+      if (inRun) {
+        f(static_cast<iu32>(begin), static_cast<iu32>(i));
+        inRun = false;
+      }
+      continue;
+    }
+    for (size_t j = i; j != i + BLOCK_SIZE; ++j) {
+      step(j);
+    }
+  }
+  for (; i != size; ++i) {
+    step(i);
+  }
+  if (inRun) {
+    f(static_cast<iu32>(begin), static_cast<iu32>(size));
+  }
+}
+
+static void putVarint (string<zbyte> &r_b, size_t v) {
+  while (v >= 0x80) {
+    r_b.push_back(static_cast<zbyte>(v | 0x80));
+    v >>= 7;
+  }
+  r_b.push_back(static_cast<zbyte>(v));
+}
+
+static size_t getVarint (const zbyte *&r_i) noexcept {
+  size_t v = 0;
+  for (iu shift = 0;; shift += 7) {
+    zbyte b = *(r_i++);
+    v |= static_cast<size_t>(b & 0x7F) << shift;
+    if (!(b & 0x80)) {
+      return v;
+    }
+  }
+}
+
+// Adds the dynamic memory addresses whose values differ between two snapshots
+// (of the same story with the same settings) to the write set
+static void markChangedMemory (const string<zbyte> &from, const string<zbyte> &to, AddressSet &r_writeSet) {
+  size_t header, rest, memory0, memory1, memorySize, stack, stackSize;
+  long pc;
+  snapshot_parts(from, &header, &pc, &rest, &memory0, &memorySize, &stack, &stackSize);
+  snapshot_parts(to, &header, &pc, &rest, &memory1, &memorySize, &stack, &stackSize);
+
+  iu64 *words = r_writeSet.getWords();
+  diffBytes(from.data() + memory0, to.data() + memory1, memorySize, [words] (iu32 begin, iu32 end) {
+    for (iu32 a = begin; a != end; ++a) {
+      words[a >> 6] |= static_cast<iu64>(1) << (a & 63);
+    }
+  });
+}
+
+static void forwardAllocation (void *context, ptrdiff_t bytes) {
+  AllocationHook hook = allocationHook.load(std::memory_order_relaxed);
+  if (hook) {
+    hook(*static_cast<const Vm *>(context), bytes);
+  }
+}
+
+Vm::Vm (const char *zcodeFileName, iu screenWidth, iu screenHeight, iu undoDepth, const VmOptions &options, u8string &r_output) :
+  vmLink(zcodeFileName, screenWidth, screenHeight, undoDepth, options.enableWordSet, options.streamOutput, options.captureStatus), actionCache(nullptr), replayLog(nullptr), vmThread(new thread([this, &r_output] () {
     exception_ptr failureException;
     try {
       DW(, "started thread");
       vmLink.setOutput(&r_output);
+      vmLink.setAllocationContext(this);
       common_main(&vmLink);
     } catch (exception &e) {
       DW(, "exception with msg **", e.what(), "** came out of thread");
@@ -33,12 +193,19 @@ Vm::Vm (const char *zcodeFileName, iu screenWidth, iu screenHeight, iu undoDepth
     }
     DW(, "vm thread over - failed? ", static_cast<bool>(failureException));
 
+    // The Z-machine's globals go with the thread, so free what they point to
+    release_memory();
     vmLink.completed(failureException);
   }))
 {
   vmLink.waitForInputExhaustion();
 }
 
+Vm::Vm (const char *zcodeFileName, iu screenWidth, iu screenHeight, iu undoDepth, bool enableWordSet, u8string &r_output) :
+  Vm(zcodeFileName, screenWidth, screenHeight, undoDepth, VmOptions{enableWordSet}, r_output)
+{
+}
+
 Vm::~Vm () noexcept {
   try {
     DW(, "destructing VM, so asking it do die");
@@ -73,28 +240,178 @@ Bitset *Vm::getWordSet () noexcept {
   return vmLink.getWordSet();
 }
 
+const AddressSet &Vm::getWriteSet () const noexcept {
+  return vmLink.getWriteSet();
+}
+
+void Vm::setReadTracking (bool enabled) {
+  DPRE(isAlive(), "VM must be alive");
+
+  vmLink.setReadTracking(enabled);
+}
+
+const ReadSet *Vm::getReadSet () const noexcept {
+  return vmLink.getReadSet();
+}
+
+const StatusLine &Vm::getStatusLine () const noexcept {
+  return vmLink.getStatusLine();
+}
+
+const vector<u8string> &Vm::getUpperWindow () const noexcept {
+  return vmLink.getUpperWindow();
+}
+
 bool Vm::isAlive () const noexcept {
   return vmLink.isAlive();
 }
 
+void Vm::setInstructionBudget (iu64 budget) noexcept {
+  vmLink.setInstructionBudget(budget);
+}
+
+void Vm::setTimeLimit (steady_clock::duration limit) noexcept {
+  vmLink.setTimeLimit(limit);
+}
+
 void Vm::doAction (u8string::const_iterator inputBegin, u8string::const_iterator inputEnd, u8string &r_output) {
   DW(, "doing action **", u8string(inputBegin, inputEnd).c_str(), "**");
-  vmLink.setOutput(&r_output);
-  vmLink.resetSaveCount();
-  vmLink.resetRestoreCount();
+  beginAction(r_output);
+
+  // An action repeated from the cache runs no Z-code, so it would draw no
+  // random numbers, read nothing, save no undo state and mark no words; the
+  // cache is only used where none of that is being kept track of
+  ActionCache *cache = isAlive() && !replayLog && !vmLink.getReadSet() && vmLink.getUndoDepth() == 0 && !vmLink.getWordSet() ? actionCache : nullptr;
+  iu64 stateHash = 0;
+  if (cache) {
+    vmLink.takeSnapshot(snapshot);
+    stateHash = hashBytes(snapshot.data(), snapshot.size(), 0);
+    const ActionCache::Entry *entry = cache->find(stateHash, inputBegin, inputEnd);
+    if (entry) {
+      DW(, "repeating action from cache");
+      ActionCache::applyDelta(snapshot, entry->delta, nextSnapshot);
+      vmLink.applySnapshot(nextSnapshot);
+      markChangedMemory(snapshot, nextSnapshot, vmLink.getWriteSet());
+      if (vmLink.isCapturingStatus()) {
+        vmLink.setCapture(entry->statusLine, entry->upperWindow);
+      }
+      r_output.append(entry->output);
+      vmLink.getActionStats().outputBytes = entry->output.size();
+      return;
+    }
+  }
+  auto outputStart = r_output.size();
 
   DW(, "giving input to VM...");
   vmLink.supplyInput(inputBegin, inputEnd);
   DW(, "... VM has consumed input");
   DW(, "output was **", r_output.c_str(), "**");
 
+  if (replayLog) {
+    replayLog->add(inputBegin, inputEnd, false, randomEvents);
+  }
   vmLink.checkForFailure();
+
+  if (cache) {
+    // The snapshot only stands for the state that the action leads to if
+    // nothing outside it was involved and if the VM is left in the same read
+    if (isAlive() && vmLink.getSaveCount() == 0 && vmLink.getRestoreCount() == 0 && vmLink.canResumeSnapshot(snapshot)) {
+      vmLink.takeSnapshot(nextSnapshot);
+      cache->add(stateHash, inputBegin, inputEnd, u8string_view(r_output).substr(outputStart), snapshot, nextSnapshot, vmLink.getStatusLine(), vmLink.getUpperWindow());
+    } else {
+      ++cache->rejections;
+    }
+  }
 }
 
 void Vm::doAction (const u8string &input, u8string &r_output) {
   doAction(input.begin(), input.end(), r_output);
 }
 
+u8string_view Vm::doAction (u8string::const_iterator inputBegin, u8string::const_iterator inputEnd) {
+  actionOutput.clear();
+  doAction(inputBegin, inputEnd, actionOutput);
+  return u8string_view(actionOutput);
+}
+
+u8string_view Vm::doAction (const u8string &input) {
+  return doAction(input.begin(), input.end());
+}
+
+void Vm::doActionSilent (u8string::const_iterator inputBegin, u8string::const_iterator inputEnd) {
+  DW(, "doing action **", u8string(inputBegin, inputEnd).c_str(), "** silently");
+  actionOutput.clear();
+  beginAction(actionOutput);
+
+  // (The screen is left differently, so the cache isn't used)
+  vmLink.setSilent(true);
+  vmLink.setDiscardingOutput(true);
+  try {
+    vmLink.supplyInput(inputBegin, inputEnd);
+  } catch (...) {
+    vmLink.setSilent(false);
+    vmLink.setDiscardingOutput(false);
+    throw;
+  }
+  vmLink.setSilent(false);
+  vmLink.setDiscardingOutput(false);
+
+  if (replayLog) {
+    replayLog->add(inputBegin, inputEnd, true, randomEvents);
+  }
+  vmLink.checkForFailure();
+}
+
+void Vm::doActionSilent (const u8string &input) {
+  doActionSilent(input.begin(), input.end());
+}
+
+void Vm::doActionDeferred (u8string::const_iterator inputBegin, u8string::const_iterator inputEnd) {
+  DPRE(vmLink.isStreamingOutput(), "VM must stream its output");
+  DW(, "doing action **", u8string(inputBegin, inputEnd).c_str(), "** with output deferred");
+  actionOutput.clear();
+  beginAction(actionOutput);
+
+  // (The Z-machine is left as by a silent action, so the cache isn't used)
+  vmLink.setSilent(true);
+  vmLink.setDeferringOutput(true);
+  try {
+    vmLink.supplyInput(inputBegin, inputEnd);
+  } catch (...) {
+    vmLink.setSilent(false);
+    vmLink.setDeferringOutput(false);
+    throw;
+  }
+  vmLink.setSilent(false);
+  vmLink.setDeferringOutput(false);
+
+  if (replayLog) {
+    replayLog->add(inputBegin, inputEnd, true, randomEvents);
+  }
+  vmLink.checkForFailure();
+}
+
+void Vm::doActionDeferred (const u8string &input) {
+  doActionDeferred(input.begin(), input.end());
+}
+
+void Vm::writeDeferredOutput (u8string &r_output) {
+  vmLink.writeDeferredOutput(r_output);
+}
+
+void Vm::beginAction (u8string &r_output) {
+  vmLink.setOutput(&r_output);
+  vmLink.clearDeferredOutput();
+  vmLink.resetSaveCount();
+  vmLink.resetRestoreCount();
+  vmLink.resetActionStats();
+  vmLink.getWriteSet().clear();
+  if (vmLink.getReadSet()) {
+    vmLink.getReadSet()->clear();
+  }
+  randomEvents.clear();
+}
+
 iu Vm::getSaveCount () const noexcept {
   return vmLink.getSaveCount();
 }
@@ -103,14 +420,198 @@ iu Vm::getRestoreCount () const noexcept {
   return vmLink.getRestoreCount();
 }
 
+const ActionStats &Vm::getActionStats () const noexcept {
+  return vmLink.getActionStats();
+}
+
+const PhaseHistograms &Vm::getPhaseHistograms () const noexcept {
+  return vmLink.getPhaseHistograms();
+}
+
+void Vm::clearPhaseHistograms () noexcept {
+  vmLink.clearPhaseHistograms();
+}
+
+void Vm::setTracing (bool tracing) noexcept {
+  vmLink.setTracing(tracing);
+}
+
+void Vm::clearTrace () noexcept {
+  vmLink.clearTrace();
+}
+
+void Vm::writeChromeTrace (u8string &r_out) const {
+  vmLink.writeChromeTrace(r_out);
+}
+
+void Vm::setProfiling (bool enabled) noexcept {
+  vmLink.getProfiler().setEnabled(enabled);
+}
+
+void Vm::clearProfile () {
+  vmLink.getProfiler().clear();
+}
+
+void Vm::writeProfileReport (u8string &r_out) const {
+  vmLink.getProfiler().writeReport(r_out);
+}
+
+void Vm::writeProfileFoldedStacks (u8string &r_out) const {
+  vmLink.getProfiler().writeFoldedStacks(r_out);
+}
+
+MemoryUsage Vm::getMemoryUsage () const {
+  MemoryUsage u = vmLink.getMemoryUsage();
+  u.output += actionOutput.capacity();
+  return u;
+}
+
+void Vm::setAllocationHook (AllocationHook hook) noexcept {
+  allocationHook.store(hook);
+  vmlink::VmLink::setAllocationHook(hook ? forwardAllocation : nullptr);
+}
+
 void Vm::setSaveState (State *state) noexcept {
   vmLink.setSaveState(state ? &state->body : nullptr);
 }
 
 void Vm::setRestoreState (const State *state) noexcept {
+  DPRE(!state || !state->isSnapshot(), "snapshots can only be restored with restoreSnapshot()");
+
   vmLink.setRestoreState(state ? &state->body : nullptr);
 }
 
+void Vm::setActionCache (ActionCache *cache) noexcept {
+  actionCache = cache;
+}
+
+void Vm::setReplayLog (ReplayLog *log) {
+  if (replayLog) {
+    State end;
+    if (isAlive()) {
+      saveSnapshot(end);
+    }
+    replayLog->endHash = end.getHash();
+    replayLog->isEnded = true;
+  }
+
+  replayLog = log;
+  vmLink.setRandomLog(log ? &randomEvents : nullptr);
+  if (log) {
+    DPRE(isAlive(), "VM must be alive");
+    State start;
+    saveSnapshot(start);
+    log->restart(start);
+  }
+}
+
+void Vm::replay (const ReplayLog &log) {
+  DPRE(!replayLog, "VM must not be recording a replay log");
+  DPRE(log.isEnded, "log must have ended");
+  DW(, "replaying ", log.actionCount, " actions");
+
+  vmLink.applySnapshot(log.start.body);
+  vmLink.setDiscardingOutput(true);
+  vmLink.setRandomLog(&randomEvents);
+  try {
+    const zbyte *i = log.actions.data();
+    u8string input;
+    for (size_t a = 0; a != log.actionCount; ++a) {
+      if (!isAlive()) {
+        throw core::PlainException(u8"replay diverged (the Z-machine ended early)");
+      }
+      size_t inputSize = getVarint(i);
+      bool silent = inputSize & 1;
+      inputSize >>= 1;
+      input.assign(reinterpret_cast<const char8_t *>(i), inputSize);
+      i += inputSize;
+
+      actionOutput.clear();
+      beginAction(actionOutput);
+      vmLink.setSilent(silent);
+      vmLink.supplyInput(input.begin(), input.end());
+      vmLink.setSilent(false);
+      vmLink.checkForFailure();
+
+      size_t eventCount = getVarint(i);
+      bool same = eventCount == randomEvents.size();
+      for (size_t e = 0; e != eventCount; ++e) {
+        size_t event = getVarint(i);
+        same = same && event == randomEvents[e];
+      }
+      if (!same) {
+        throw core::PlainException(u8"replay diverged (different random numbers were drawn)");
+      }
+    }
+
+    State end;
+    if (isAlive()) {
+      saveSnapshot(end);
+    }
+    if (end.getHash() != log.endHash) {
+      throw core::PlainException(u8"replay diverged (a different state was reached)");
+    }
+  } catch (...) {
+    vmLink.setSilent(false);
+    vmLink.setDiscardingOutput(false);
+    vmLink.setRandomLog(nullptr);
+    throw;
+  }
+  vmLink.setDiscardingOutput(false);
+  vmLink.setRandomLog(nullptr);
+}
+
+void Vm::saveSnapshot (State &r_state) const {
+  DPRE(isAlive(), "VM must be alive");
+
+  vmLink.takeSnapshot(r_state.body);
+}
+
+void Vm::restoreSnapshot (const State &state) {
+  DPRE(isAlive(), "VM must be alive");
+  DPRE(state.isSnapshot(), "state must be a snapshot");
+
+  vmLink.applySnapshot(state.body);
+  vmLink.clearDeferredOutput();
+  if (replayLog) {
+    replayLog->restart(state);
+  }
+}
+
+StateDifference Vm::diffAgainst (const State &state, const RangeCallback &f) const {
+  DPRE(isAlive(), "VM must be alive");
+  DPRE(state.isSnapshot(), "state must be a snapshot");
+
+  State current;
+  saveSnapshot(current);
+  return current.diff(state, f);
+}
+
+void Vm::doActionFrom (const State &state, u8string::const_iterator inputBegin, u8string::const_iterator inputEnd, u8string &r_output, State &r_state) {
+  DPRE(state.isSnapshot(), "state must be a snapshot");
+  DW(, "doing action **", u8string(inputBegin, inputEnd).c_str(), "** from snapshot");
+  beginAction(r_output);
+  r_state.clear();
+
+  vmLink.supplyInput(inputBegin, inputEnd, &state.body, &r_state.body);
+  if (replayLog) {
+    replayLog->restart(state);
+    replayLog->add(inputBegin, inputEnd, false, randomEvents);
+  }
+  vmLink.checkForFailure();
+  if (!isAlive()) {
+    r_state.clear();
+  }
+}
+
+void Vm::doActionFrom (const State &state, const u8string &input, u8string &r_output, State &r_state) {
+  doActionFrom(state, input.begin(), input.end(), r_output, r_state);
+}
+
+void Vm::runOnVmThread (const function<void ()> &f) const {
+  vmLink.runOnVmThread(f);
+}
+
 void State::clear () noexcept {
   body.clear();
 }
@@ -119,10 +620,954 @@ bool State::isEmpty () noexcept {
   return body.empty();
 }
 
+bool State::isSnapshot () const noexcept {
+  return is_snapshot(body);
+}
+
+bool State::awaitsSameInput (const State &state) const noexcept {
+  return snapshots_await_same_read(body, state.body);
+}
+
+iu64 State::getHash () const noexcept {
+  return hashBytes(body.data(), body.size(), 0);
+}
+
+iu64 State::getHash (const StateMask &mask) const noexcept {
+  if (!mask.appliesTo(body)) {
+    return getHash();
+  }
+
+  iu64 h = 0;
+  size_t i = 0;
+  for (const auto &gap : mask.gaps) {
+    h = hashBytes(body.data() + i, gap.first - i, h);
+    i = gap.second;
+  }
+  return hashBytes(body.data() + i, body.size() - i, h);
+}
+
+bool State::equals (const State &state) const noexcept {
+  return body.size() == state.body.size() && memcmp(body.data(), state.body.data(), body.size()) == 0;
+}
+
+bool State::equals (const State &state, const StateMask &mask) const noexcept {
+  if (body.size() != state.body.size()) {
+    return false;
+  }
+  if (!mask.appliesTo(body)) {
+    return equals(state);
+  }
+
+  size_t i = 0;
+  for (const auto &gap : mask.gaps) {
+    if (memcmp(body.data() + i, state.body.data() + i, gap.first - i) != 0) {
+      return false;
+    }
+    i = gap.second;
+  }
+  return memcmp(body.data() + i, state.body.data() + i, body.size() - i) == 0;
+}
+
+StateDifference State::diff (const State &state, const RangeCallback &f) const {
+  DPRE(isSnapshot(), "state must be a snapshot");
+  DPRE(state.isSnapshot(), "state must be a snapshot");
+
+  size_t header0, rest0, memory0, memorySize0, stack0, stackSize0;
+  size_t header1, rest1, memory1, memorySize1, stack1, stackSize1;
+  long pc0, pc1;
+  if (
+    !snapshot_parts(body, &header0, &pc0, &rest0, &memory0, &memorySize0, &stack0, &stackSize0) ||
+    !snapshot_parts(state.body, &header1, &pc1, &rest1, &memory1, &memorySize1, &stack1, &stackSize1) ||
+    memory0 != memory1 || memorySize0 != memorySize1 ||
+    memcmp(body.data(), state.body.data(), header0) != 0
+  ) {
+    throw core::PlainException(u8"snapshots are not of the same story with the same settings");
+  }
+
+  diffBytes(body.data() + memory0, state.body.data() + memory1, memorySize0, f);
+
+  StateDifference d;
+  d.pc = static_cast<iu32>(pc0);
+  d.otherPc = static_cast<iu32>(pc1);
+  d.stackSize = stackSize0;
+  d.otherStackSize = stackSize1;
+  // The stack grows down, so its bottom is at the end
+  const zbyte *end0 = body.data() + body.size();
+  const zbyte *end1 = state.body.data() + state.body.size();
+  size_t n = min(stackSize0, stackSize1);
+  for (; d.commonStackSize != n; ++d.commonStackSize) {
+    size_t o = (d.commonStackSize + 1) * sizeof(zword);
+    if (memcmp(end0 - o, end1 - o, sizeof(zword)) != 0) {
+      break;
+    }
+  }
+  d.isRestDifferent = memcmp(body.data() + rest0, state.body.data() + rest1, memory0 - rest0) != 0;
+  return d;
+}
+
 void State::compact () {
   body.shrink_to_fit();
 }
 
+size_t State::getMemoryUsage () const noexcept {
+  return body.capacity() * sizeof(zbyte);
+}
+
+StateMask::StateMask (const Vm &vm) :
+  randomOffset(0), randomSize(0), screenOffset(0), screenSize(0), memoryOffset(0), memorySize(0), globalsAddress(0)
+{
+  vm.runOnVmThread([this] () {
+    snapshot_layout(&randomOffset, &randomSize, &screenOffset, &screenSize, &memoryOffset, &memorySize);
+  });
+  const zbyte *memory = vm.getDynamicMemory();
+  globalsAddress = static_cast<zword>((memory[0x0C] << 8) | memory[0x0D]);
+}
+
+void StateMask::ignoreRange (iu32 begin, iu32 end) {
+  end = min(end, static_cast<iu32>(memorySize));
+  if (begin < end) {
+    ignore(memoryOffset + begin, memoryOffset + end);
+  }
+}
+
+void StateMask::ignoreGlobal (zbyte global) {
+  DPRE(global < 240);
+
+  iu32 addr = globalsAddress + 2 * static_cast<iu32>(global);
+  ignoreRange(addr, addr + 2);
+}
+
+void StateMask::ignoreRandom () {
+  ignore(randomOffset, randomOffset + randomSize);
+}
+
+void StateMask::ignoreScreen () {
+  ignore(screenOffset, screenOffset + screenSize);
+}
+
+bool StateMask::isEmpty () const noexcept {
+  return gaps.empty();
+}
+
+void StateMask::ignore (size_t begin, size_t end) {
+  // Merge the new gap with any that it overlaps or touches
+  auto i = gaps.begin();
+  for (; i != gaps.end() && i->second < begin; ++i) {
+  }
+  auto j = i;
+  for (; j != gaps.end() && j->first <= end; ++j) {
+    begin = min(begin, j->first);
+    end = max(end, j->second);
+  }
+  i = gaps.erase(i, j);
+  gaps.insert(i, pair<size_t, size_t>(begin, end));
+}
+
+bool StateMask::appliesTo (const string<zbyte> &body) const noexcept {
+  return !gaps.empty() && is_snapshot(body) && body.size() >= memoryOffset + memorySize;
+}
+
+ReplayLog::ReplayLog () noexcept :
+  actionCount(0), isEnded(false), endHash(0)
+{
+}
+
+void ReplayLog::clear () noexcept {
+  start.clear();
+  actions.clear();
+  actionCount = 0;
+  isEnded = false;
+  endHash = 0;
+}
+
+const State &ReplayLog::getStart () const noexcept {
+  return start;
+}
+
+size_t ReplayLog::getActionCount () const noexcept {
+  return actionCount;
+}
+
+bool ReplayLog::hasEnded () const noexcept {
+  return isEnded;
+}
+
+iu64 ReplayLog::getEndHash () const noexcept {
+  return endHash;
+}
+
+size_t ReplayLog::getMemoryUsage () const noexcept {
+  return start.getMemoryUsage() + actions.capacity() * sizeof(zbyte);
+}
+
+void ReplayLog::restart (const State &state) {
+  clear();
+  start = state;
+}
+
+void ReplayLog::add (u8string::const_iterator inputBegin, u8string::const_iterator inputEnd, bool silent, const vector<iu32> &randomEvents) {
+  // Each action is its input (with its size, shifted up over a bit saying
+  // whether or not the action was silent, first) and then its random events
+  // (with their count first), all sizes and events being varints
+  putVarint(actions, (static_cast<size_t>(inputEnd - inputBegin) << 1) | (silent ? 1 : 0));
+  for (auto i = inputBegin; i != inputEnd; ++i) {
+    actions.push_back(static_cast<zbyte>(*i));
+  }
+  putVarint(actions, randomEvents.size());
+  for (iu32 event : randomEvents) {
+    putVarint(actions, event);
+  }
+  ++actionCount;
+}
+
+ActionCache::ActionCache (size_t capacity) :
+  capacity(capacity), size(0), hand(0), hits(0), misses(0), rejections(0), evictions(0)
+{
+}
+
+void ActionCache::clear () noexcept {
+  entries.clear();
+  freeEntries.clear();
+  index.clear();
+  size = 0;
+  hand = 0;
+}
+
+iu64 ActionCache::getHits () const noexcept {
+  return hits;
+}
+
+iu64 ActionCache::getMisses () const noexcept {
+  return misses;
+}
+
+iu64 ActionCache::getRejections () const noexcept {
+  return rejections;
+}
+
+iu64 ActionCache::getEvictions () const noexcept {
+  return evictions;
+}
+
+void ActionCache::resetCounts () noexcept {
+  hits = 0;
+  misses = 0;
+  rejections = 0;
+  evictions = 0;
+}
+
+size_t ActionCache::getEntryCount () const noexcept {
+  return index.size();
+}
+
+size_t ActionCache::getMemoryUsage () const noexcept {
+  return size;
+}
+
+size_t ActionCache::getEntrySize (const Entry &entry) noexcept {
+  size_t s = sizeof(Entry) + INDEX_ENTRY_SIZE + entry.input.capacity() + entry.output.capacity() + entry.delta.capacity() + entry.statusLine.objectName.capacity();
+  for (const u8string &row : entry.upperWindow) {
+    s += sizeof(u8string) + row.capacity();
+  }
+  return s;
+}
+
+const ActionCache::Entry *ActionCache::find (iu64 stateHash, u8string::const_iterator inputBegin, u8string::const_iterator inputEnd) {
+  iu64 key = hashInput(stateHash, inputBegin, inputEnd);
+  auto i = index.find(key);
+  if (i != index.end()) {
+    Entry &entry = entries[i->second];
+    if (entry.stateHash == stateHash && equal(inputBegin, inputEnd, entry.input.begin(), entry.input.end())) {
+      entry.isReferenced = true;
+      ++hits;
+      return &entry;
+    }
+  }
+  ++misses;
+  return nullptr;
+}
+
+void ActionCache::add (iu64 stateHash, u8string::const_iterator inputBegin, u8string::const_iterator inputEnd, u8string_view output, const string<zbyte> &from, const string<zbyte> &to, const StatusLine &statusLine, const vector<u8string> &upperWindow) {
+  Entry entry;
+  entry.isUsed = true;
+  entry.isReferenced = false;
+  entry.key = hashInput(stateHash, inputBegin, inputEnd);
+  entry.stateHash = stateHash;
+  entry.input.assign(inputBegin, inputEnd);
+  entry.output.assign(output);
+  makeDelta(from, to, entry.delta);
+  entry.delta.shrink_to_fit();
+  entry.statusLine = statusLine;
+  entry.upperWindow = upperWindow;
+  size_t entrySize = getEntrySize(entry);
+  if (entrySize > capacity) {
+    ++rejections;
+    return;
+  }
+
+  // Replace any entry with the same key (which can only be for another state
+  // or input whose hash collides)
+  auto i = index.find(entry.key);
+  if (i != index.end()) {
+    Entry &old = entries[i->second];
+    size -= getEntrySize(old);
+    old.isUsed = false;
+    freeEntries.push_back(i->second);
+    index.erase(i);
+  }
+  while (size + entrySize > capacity) {
+    evictOne();
+  }
+
+  size_t slot;
+  if (freeEntries.empty()) {
+    slot = entries.size();
+    entries.push_back(move(entry));
+  } else {
+    slot = freeEntries.back();
+    freeEntries.pop_back();
+    entries[slot] = move(entry);
+  }
+  index.emplace(entries[slot].key, slot);
+  size += entrySize;
+}
+
+void ActionCache::evictOne () {
+  DPRE(!index.empty());
+
+  // Sweep round, giving each recently used entry a second chance
+  for (;; hand = (hand + 1) % entries.size()) {
+    Entry &entry = entries[hand];
+    if (!entry.isUsed) {
+      continue;
+    }
+    if (entry.isReferenced) {
+      entry.isReferenced = false;
+      continue;
+    }
+
+    size -= getEntrySize(entry);
+    index.erase(entry.key);
+    entry = Entry();
+    entry.isUsed = false;
+    freeEntries.push_back(hand);
+    ++evictions;
+    hand = (hand + 1) % entries.size();
+    return;
+  }
+}
+
+void ActionCache::makeDelta (const string<zbyte> &from, const string<zbyte> &to, string<zbyte> &r_delta) {
+  // The new size, then runs of changed bytes (each given as the number of
+  // bytes skipped since the last run, its length and its bytes, with a
+  // zero-length run ending them), then whatever the new state has past the
+  // end of the old
+  r_delta.clear();
+  putVarint(r_delta, to.size());
+  const size_t n = min(from.size(), to.size());
+  const zbyte *f = from.data();
+  const zbyte *t = to.data();
+  size_t i = 0;
+  for (;;) {
+    size_t j = i;
+    while (j + 8 <= n && memcmp(f + j, t + j, 8) == 0) {
+      j += 8;
+    }
+    while (j != n && f[j] == t[j]) {
+      ++j;
+    }
+    if (j == n) {
+      break;
+    }
+
+    size_t k = j;
+    for (;;) {
+      while (k != n && f[k] != t[k]) {
+        ++k;
+      }
+      size_t g = k;
+      while (g != n && g - k < DELTA_GAP && f[g] == t[g]) {
+        ++g;
+      }
+      if (g == n || g - k == DELTA_GAP) {
+        break;
+      }
+      k = g;
+    }
+
+    putVarint(r_delta, j - i);
+    putVarint(r_delta, k - j);
+    r_delta.append(t + j, k - j);
+    i = k;
+  }
+  putVarint(r_delta, 0);
+  putVarint(r_delta, 0);
+  r_delta.append(t + n, to.size() - n);
+}
+
+void ActionCache::applyDelta (const string<zbyte> &from, const string<zbyte> &delta, string<zbyte> &r_to) {
+  const zbyte *d = delta.data();
+  const size_t size = getVarint(d);
+  const size_t n = min(from.size(), size);
+  r_to.resize(size);
+  zbyte *t = r_to.data();
+  memcpy(t, from.data(), n);
+
+  size_t i = 0;
+  for (;;) {
+    i += getVarint(d);
+    size_t length = getVarint(d);
+    if (length == 0) {
+      break;
+    }
+    memcpy(t + i, d, length);
+    d += length;
+    i += length;
+  }
+  memcpy(t + n, d, size - n);
+}
+
+VmPool::VmPool (const char *zcodeFileName, iu screenWidth, iu screenHeight, iu undoDepth, const VmOptions &options, iu size) :
+  zcodeFileName(zcodeFileName), screenWidth(screenWidth), screenHeight(screenHeight), undoDepth(undoDepth), options(options), isStopping(false), batch(0), readyWorkers(0), busyWorkers(0), batchState(nullptr), batchInputs(nullptr), batchOutputs(nullptr), batchStates(nullptr), nextInput(0)
+{
+  this->options.enableWordSet = false;
+  if (size == 0) {
+    size = max(thread::hardware_concurrency(), 1U);
+  }
+  DW(, "starting pool of ", size, " VMs");
+
+  // The Vms are started on their workers' threads, so that they start at once
+  for (iu i = 0; i < size; ++i) {
+    workers.emplace_back([this] () {
+      work();
+    });
+  }
+  unique_lock<mutex> l(lock);
+  condVar.wait(l, [this] () {
+    return readyWorkers == workers.size();
+  });
+  if (failureException) {
+    exception_ptr e = failureException;
+    l.unlock();
+    stop();
+    rethrow_exception(e);
+  }
+}
+
+VmPool::~VmPool () noexcept {
+  stop();
+}
+
+void VmPool::stop () noexcept {
+  {
+    unique_lock<mutex> l(lock);
+    isStopping = true;
+    condVar.notify_all();
+  }
+  for (thread &worker : workers) {
+    if (worker.joinable()) {
+      worker.join();
+    }
+  }
+}
+
+iu VmPool::getSize () const noexcept {
+  return static_cast<iu>(workers.size());
+}
+
+void VmPool::doActions (const State &state, const vector<u8string> &inputs, vector<u8string> &r_outputs, vector<State> &r_states) {
+  DPRE(state.isSnapshot(), "state must be a snapshot");
+  DW(, "doing batch of ", inputs.size(), " actions");
+
+  r_outputs.resize(inputs.size());
+  r_states.resize(inputs.size());
+
+  unique_lock<mutex> l(lock);
+  batchState = &state;
+  batchInputs = &inputs;
+  batchOutputs = &r_outputs;
+  batchStates = &r_states;
+  nextInput = 0;
+  failureException = nullptr;
+  busyWorkers = static_cast<iu>(workers.size());
+  ++batch;
+  condVar.notify_all();
+  condVar.wait(l, [this] () {
+    return busyWorkers == 0;
+  });
+  batchState = nullptr;
+  batchInputs = nullptr;
+  batchOutputs = nullptr;
+  batchStates = nullptr;
+
+  if (failureException) {
+    rethrow_exception(failureException);
+  }
+  if (nextInput != inputs.size()) {
+    throw core::PlainException(u8"no VM in the pool could perform the actions");
+  }
+}
+
+unique_ptr<Vm> VmPool::startVm (u8string &r_output) {
+  unique_ptr<Vm> vm(new Vm(zcodeFileName.c_str(), screenWidth, screenHeight, undoDepth, options, r_output));
+  if (!vm->isAlive()) {
+    throw core::PlainException(u8"Z-machine terminated on startup");
+  }
+  return vm;
+}
+
+void VmPool::work () {
+  // The Vm writes here whenever it is not performing one of the batch's
+  // actions
+  u8string idleOutput;
+  unique_ptr<Vm> vm;
+  try {
+    vm = startVm(idleOutput);
+  } catch (...) {
+    unique_lock<mutex> l(lock);
+    failureException = current_exception();
+  }
+
+  unique_lock<mutex> l(lock);
+  ++readyWorkers;
+  condVar.notify_all();
+
+  iu64 doneBatch = 0;
+  for (;;) {
+    condVar.wait(l, [this, doneBatch] () {
+      return isStopping || batch != doneBatch;
+    });
+    if (isStopping) {
+      break;
+    }
+    doneBatch = batch;
+
+    // A Vm that could not be replaced last time gets another try
+    if (!vm) {
+      l.unlock();
+      exception_ptr e;
+      try {
+        vm = startVm(idleOutput);
+      } catch (...) {
+        e = current_exception();
+      }
+      l.lock();
+      if (e && !failureException) {
+        failureException = e;
+      }
+    }
+
+    // Take the batch's inputs one at a time until there are none left
+    while (vm && nextInput != batchInputs->size()) {
+      size_t i = nextInput++;
+      l.unlock();
+
+      const u8string &input = (*batchInputs)[i];
+      u8string &output = (*batchOutputs)[i];
+      State &state = (*batchStates)[i];
+      output.clear();
+      exception_ptr e;
+      try {
+        vm->doActionFrom(*batchState, input, output, state);
+        if (vm->isAlive() && !state.awaitsSameInput(*batchState)) {
+          // The Z-machine is (say) asking for a filename, so cannot be put
+          // into the next action's state
+          vm.reset();
+        }
+      } catch (...) {
+        // A failed action leaves the Z-machine dead; otherwise, it could not
+        // be put into the state
+        DW(, "action failed in pool");
+        state.clear();
+        if (vm->isAlive()) {
+          e = current_exception();
+        }
+      }
+      if (!vm || !vm->isAlive()) {
+        DW(, "replacing dead VM in pool");
+        vm.reset();
+        try {
+          vm = startVm(idleOutput);
+        } catch (...) {
+          e = current_exception();
+        }
+      }
+
+      l.lock();
+      if (e && !failureException) {
+        failureException = e;
+      }
+    }
+
+    if (--busyWorkers == 0) {
+      condVar.notify_all();
+    }
+  }
+}
+
+vector<u8string> Explorer::Node::getPath () const {
+  vector<u8string> path;
+  for (const Node *node = this; node->parent; node = node->parent.get()) {
+    path.push_back(node->input);
+  }
+  reverse(path.begin(), path.end());
+  return path;
+}
+
+// The frontiers are max-heaps of score (with the shallower of equally-scored
+// nodes coming first)
+static bool isLessPromising (const shared_ptr<Explorer::Node> &o0, const shared_ptr<Explorer::Node> &o1) noexcept {
+  return o0->score < o1->score || (o0->score == o1->score && o0->depth > o1->depth);
+}
+
+Explorer::Explorer (const char *zcodeFileName, iu screenWidth, iu screenHeight, iu undoDepth, const VmOptions &options, iu size, ActionGenerator generator, Scorer scorer) :
+  zcodeFileName(zcodeFileName), screenWidth(screenWidth), screenHeight(screenHeight), undoDepth(undoDepth), options(options), generator(move(generator)), scorer(move(scorer)), expansionLimit(0), depthLimit(0), isStopping(false), run(0), readyWorkers(0), busyWorkers(0), isHalting(false), pendingNodes(0), idleWorkers(0), expansions(0), reached(0), duplicates(0), deadEnds(0), steals(0), time(steady_clock::duration::zero())
+{
+  this->options.enableWordSet = false;
+  if (size == 0) {
+    size = max(thread::hardware_concurrency(), 1U);
+  }
+  DW(, "starting explorer with ", size, " workers");
+
+  frontiers.reset(new Frontier[size]);
+  table.reset(new TableShard[TABLE_SHARDS]);
+  for (iu i = 0; i < size; ++i) {
+    workers.emplace_back([this, i] () {
+      work(i);
+    });
+  }
+  unique_lock<mutex> l(lock);
+  condVar.wait(l, [this] () {
+    return readyWorkers == workers.size();
+  });
+  if (failureException) {
+    exception_ptr e = failureException;
+    l.unlock();
+    stop();
+    rethrow_exception(e);
+  }
+}
+
+Explorer::~Explorer () noexcept {
+  stop();
+}
+
+void Explorer::stop () noexcept {
+  {
+    unique_lock<mutex> l(lock);
+    isStopping = true;
+    condVar.notify_all();
+  }
+  for (thread &worker : workers) {
+    if (worker.joinable()) {
+      worker.join();
+    }
+  }
+}
+
+iu Explorer::getSize () const noexcept {
+  return static_cast<iu>(workers.size());
+}
+
+void Explorer::setExpansionLimit (iu64 limit) noexcept {
+  expansionLimit = limit;
+}
+
+void Explorer::setDepthLimit (iu32 limit) noexcept {
+  depthLimit = limit;
+}
+
+void Explorer::setStateMask (const StateMask &mask) {
+  stateMask.reset(new StateMask(mask));
+}
+
+void Explorer::explore (const State &root) {
+  DPRE(root.isSnapshot(), "root must be a snapshot");
+  DW(, "exploring with ", workers.size(), " workers");
+
+  for (size_t i = 0; i != TABLE_SHARDS; ++i) {
+    table[i].hashes.clear();
+  }
+  expansions = 0;
+  reached = 0;
+  duplicates = 0;
+  deadEnds = 0;
+  steals = 0;
+  best.reset();
+  bestState.clear();
+  isHalting = false;
+
+  // The root is scored by whichever worker expands it
+  shared_ptr<Node> node = make_shared<Node>();
+  node->state = root;
+  node->hash = stateMask ? root.getHash(*stateMask) : root.getHash();
+  node->depth = 0;
+  node->score = 0;
+  addToTable(node->hash);
+  give(0, move(node));
+
+  auto st = steady_clock::now();
+  unique_lock<mutex> l(lock);
+  failureException = nullptr;
+  busyWorkers = static_cast<iu>(workers.size());
+  ++run;
+  condVar.notify_all();
+  condVar.wait(l, [this] () {
+    return busyWorkers == 0;
+  });
+  time = steady_clock::now() - st;
+  DW(, "explored ", expansions.load(), " nodes in ", duration<double>(time).count(), " secs");
+
+  // Anything left unexpanded (after a halt) is of no more use
+  for (iu i = 0; i != workers.size(); ++i) {
+    frontiers[i].heap.clear();
+  }
+  pendingNodes = 0;
+
+  if (failureException) {
+    rethrow_exception(failureException);
+  }
+}
+
+void Explorer::halt () noexcept {
+  isHalting = true;
+}
+
+shared_ptr<const Explorer::Node> Explorer::getBest () const {
+  unique_lock<mutex> l(bestLock);
+  return best;
+}
+
+const State &Explorer::getBestState () const noexcept {
+  return bestState;
+}
+
+iu64 Explorer::getExpansions () const noexcept {
+  return expansions;
+}
+
+iu64 Explorer::getReached () const noexcept {
+  return reached;
+}
+
+iu64 Explorer::getDuplicates () const noexcept {
+  return duplicates;
+}
+
+iu64 Explorer::getDeadEnds () const noexcept {
+  return deadEnds;
+}
+
+iu64 Explorer::getSteals () const noexcept {
+  return steals;
+}
+
+size_t Explorer::getTranspositionCount () const {
+  size_t count = 0;
+  for (size_t i = 0; i != TABLE_SHARDS; ++i) {
+    unique_lock<mutex> l(table[i].lock);
+    count += table[i].hashes.size();
+  }
+  return count;
+}
+
+steady_clock::duration Explorer::getTime () const noexcept {
+  return time;
+}
+
+double Explorer::getExpansionsPerSecond () const noexcept {
+  double secs = duration<double>(time).count();
+  return secs > 0 ? static_cast<double>(expansions) / secs : 0;
+}
+
+unique_ptr<Vm> Explorer::startVm (u8string &r_output) {
+  unique_ptr<Vm> vm(new Vm(zcodeFileName.c_str(), screenWidth, screenHeight, undoDepth, options, r_output));
+  if (!vm->isAlive()) {
+    throw core::PlainException(u8"Z-machine terminated on startup");
+  }
+  return vm;
+}
+
+void Explorer::work (iu worker) {
+  // The Vm writes here whenever it is not performing one of the explorer's
+  // actions
+  u8string idleOutput;
+  unique_ptr<Vm> vm;
+  try {
+    vm = startVm(idleOutput);
+  } catch (...) {
+    unique_lock<mutex> l(lock);
+    failureException = current_exception();
+  }
+
+  unique_lock<mutex> l(lock);
+  ++readyWorkers;
+  condVar.notify_all();
+
+  iu64 doneRun = 0;
+  for (;;) {
+    condVar.wait(l, [this, doneRun] () {
+      return isStopping || run != doneRun;
+    });
+    if (isStopping) {
+      break;
+    }
+    doneRun = run;
+    l.unlock();
+
+    exception_ptr e;
+    try {
+      explore(worker, vm, idleOutput);
+    } catch (...) {
+      DW(, "exploration failed");
+      e = current_exception();
+      isHalting = true;
+    }
+
+    l.lock();
+    if (e && !failureException) {
+      failureException = e;
+    }
+    if (--busyWorkers == 0) {
+      condVar.notify_all();
+    }
+  }
+}
+
+void Explorer::explore (iu worker, unique_ptr<Vm> &vm, u8string &idleOutput) {
+  if (!vm) {
+    vm = startVm(idleOutput);
+  }
+
+  while (!isHalting) {
+    shared_ptr<Node> node = take(worker);
+    if (!node) {
+      if (pendingNodes == 0) {
+        break;
+      }
+      // Wait for the busy workers to give out more nodes (with a timeout,
+      // in case the notification came before the wait)
+      unique_lock<mutex> l(idleLock);
+      ++idleWorkers;
+      idleCondVar.wait_for(l, milliseconds(1));
+      --idleWorkers;
+      continue;
+    }
+
+    if (++expansions > expansionLimit && expansionLimit != 0) {
+      --expansions;
+      isHalting = true;
+      break;
+    }
+    expand(worker, vm, idleOutput, node);
+
+    if (--pendingNodes == 0) {
+      idleCondVar.notify_all();
+    }
+  }
+}
+
+void Explorer::expand (iu worker, unique_ptr<Vm> &vm, u8string &idleOutput, const shared_ptr<Node> &node) {
+  vm->restoreSnapshot(node->state);
+  if (!node->parent) {
+    node->score = scorer(*vm, *node);
+    considerBest(node);
+  }
+  vector<u8string> inputs;
+  generator(*vm, *node, inputs);
+
+  for (u8string &input : inputs) {
+    shared_ptr<Node> child = make_shared<Node>();
+    child->parent = node;
+    child->input = move(input);
+    child->depth = node->depth + 1;
+    ++reached;
+    try {
+      vm->doActionFrom(node->state, child->input, child->output, child->state);
+      if (vm->isAlive() && !child->state.awaitsSameInput(node->state)) {
+        // The Z-machine is (say) asking for a filename, so cannot be put
+        // into the next action's state
+        vm.reset();
+      }
+    } catch (...) {
+      // A failed action leaves the Z-machine dead; otherwise, it could not
+      // be put into the node's state
+      if (vm->isAlive()) {
+        throw;
+      }
+    }
+    if (!vm || !vm->isAlive()) {
+      DW(, "replacing VM after dead end in explorer");
+      ++deadEnds;
+      vm.reset();
+      vm = startVm(idleOutput);
+      continue;
+    }
+
+    child->hash = stateMask ? child->state.getHash(*stateMask) : child->state.getHash();
+    if (!addToTable(child->hash)) {
+      ++duplicates;
+      continue;
+    }
+    child->score = scorer(*vm, *child);
+    considerBest(child);
+    if (depthLimit == 0 || child->depth < depthLimit) {
+      give(worker, move(child));
+    }
+  }
+
+  // Only the path to the node is needed from now on
+  node->state.clear();
+  node->state.compact();
+}
+
+shared_ptr<Explorer::Node> Explorer::take (iu worker) {
+  // Take from this worker's own frontier if possible; otherwise, steal from
+  // the others'
+  iu size = getSize();
+  for (iu i = 0; i != size; ++i) {
+    Frontier &frontier = frontiers[(worker + i) % size];
+    unique_lock<mutex> l(frontier.lock);
+    if (!frontier.heap.empty()) {
+      pop_heap(frontier.heap.begin(), frontier.heap.end(), isLessPromising);
+      shared_ptr<Node> node = move(frontier.heap.back());
+      frontier.heap.pop_back();
+      if (i != 0) {
+        ++steals;
+      }
+      return node;
+    }
+  }
+  return nullptr;
+}
+
+void Explorer::give (iu worker, shared_ptr<Node> &&node) {
+  ++pendingNodes;
+  Frontier &frontier = frontiers[worker];
+  {
+    unique_lock<mutex> l(frontier.lock);
+    frontier.heap.push_back(move(node));
+    push_heap(frontier.heap.begin(), frontier.heap.end(), isLessPromising);
+  }
+  if (idleWorkers != 0) {
+    idleCondVar.notify_one();
+  }
+}
+
+bool Explorer::addToTable (iu64 hash) {
+  TableShard &shard = table[hash % TABLE_SHARDS];
+  unique_lock<mutex> l(shard.lock);
+  return shard.hashes.insert(hash).second;
+}
+
+void Explorer::considerBest (const shared_ptr<Node> &node) {
+  unique_lock<mutex> l(bestLock);
+  if (!best || node->score > best->score) {
+    best = node;
+    bestState = node->state;
+  }
+}
+
 /* -----------------------------------------------------------------------------
 ----------------------------------------------------------------------------- */
 }
@@ -7,7 +7,11 @@
 #define AUTOFROTZ_ALREADYINCLUDED
 
 #include "autofrotz_vmlink.hpp"
+#include <atomic>
+#include <memory>
+#include <string_view>
 #include <thread>
+#include <unordered_set>
 
 namespace autofrotz {
 
@@ -17,11 +21,55 @@ extern DC();
 
 using vmlink::zbyte;
 using vmlink::zword;
+using vmlink::StatusLine;
+using vmlink::ActionStats;
+using vmlink::LatencyHistogram;
+using vmlink::PhaseHistograms;
+using vmlink::MemoryUsage;
+using vmlink::AddressSet;
+using vmlink::ReadSet;
+using vmlink::ActionLimitException;
 
+class Vm;
 class State;
+class StateDifference;
+class StateMask;
+class ReplayLog;
+class ActionCache;
+
+typedef void (*AllocationHook) (const Vm &vm, std::ptrdiff_t bytes);
+/**
+  Receives a range of dynamic memory addresses, from {@c begin} up to (but not
+  including) {@c end}.
+*/
+typedef std::function<void (iu32 begin, iu32 end)> RangeCallback;
+
+/**
+  Chooses what a Vm does beyond running its Z-code file (each option being off
+  unless set).
+*/
+class VmOptions {
+  // Whether or not the VM tracks which addresses are written to as words
+  pub bool enableWordSet = false;
+  // Whether or not the lower window's text is appended straight to the output
+  // as it is printed (rather than being rendered onto the screen and then read
+  // back off it when the VM next waits for input); changes to the upper window
+  // are still rendered and read back
+  pub bool streamOutput = false;
+  // Whether or not the status line and the upper window are kept out of the
+  // output and made available through Vm::getStatusLine() and
+  // Vm::getUpperWindow() instead
+  pub bool captureStatus = false;
+};
 
 class Vm {
   prv vmlink::VmLink vmLink;
+  prv core::u8string actionOutput;
+  prv ActionCache *actionCache;
+  prv ReplayLog *replayLog;
+  prv std::vector<iu32> randomEvents;
+  prv core::string<zbyte> snapshot;
+  prv core::string<zbyte> nextSnapshot;
   prv std::unique_ptr<std::thread> vmThread;
 
   /**
@@ -29,10 +77,14 @@ class Vm {
 
     @param zcodeFileName the Z-code file (giving the VM's initial memory) to
     run.
-    @param enableWordSet whether ot not the VM will track which addresses are
-    written to as words.
+    @param options the VM's settings.
     @param r_output buffer for the VM's initial output.
   */
+  pub Vm (const char *zcodeFileName, iu screenWidth, iu screenHeight, iu undoDepth, const VmOptions &options, core::u8string &r_output);
+  /**
+    Starts a new Z-machine with only (if {@c enableWordSet}) the word set
+    enabled.
+  */
   pub Vm (const char *zcodeFileName, iu screenWidth, iu screenHeight, iu undoDepth, bool enableWordSet, core::u8string &r_output);
   Vm (const Vm &) = delete;
   Vm &operator= (const Vm &) = delete;
@@ -63,17 +115,136 @@ class Vm {
     the Z-machine sets bit {@c a}.
   */
   pub bitset::Bitset *getWordSet () noexcept;
+  /**
+    Gets the write set (valid until destruction): the dynamic memory addresses
+    that the Z-machine wrote to (as bytes or words) during the last action.
+    Restoring, undoing or restarting counts as writing to the whole of dynamic
+    memory. The set is emptied at the start of each action. For an action
+    repeated from an ActionCache, it holds the addresses whose values the
+    action changed.
+  */
+  pub const AddressSet &getWriteSet () const noexcept;
+  /**
+    Sets whether or not the Z-machine records what each action reads (off by
+    default). Recording slows the Z-machine down, since the interpreter's own
+    caches of the object tree, dictionaries and decoded strings are bypassed
+    (so that every read reaches memory), as is any ActionCache.
+  */
+  pub void setReadTracking (bool enabled);
+  /**
+    Gets the read set (valid until the next call to ::setReadTracking() or
+    destruction) or {@c nullptr}, if reads are not being recorded: the
+    addresses below 64K that the Z-machine read (as bytes or words, other than
+    as code) during the last action, including those of the globals, and
+    whether or not it consulted the random number generator. Saving counts as
+    reading the whole of dynamic memory. The set is emptied at the start of
+    each action, so it is left empty by an action repeated from an
+    ActionCache.
+
+    An action's result depends on dynamic memory only through its read set;
+    ReadSet::isUnchangedBetween() compares two dynamic memories there. (The
+    rest of the state, such as the stack, the program counter and the screen,
+    must still match.)
+  */
+  pub const ReadSet *getReadSet () const noexcept;
+  /**
+    Gets the status line as a V1-3 Z-machine last showed it (valid until
+    destruction), if the Vm was constructed to capture it. The object name is
+    that of the location (global variable 0); the score and moves or the hours
+    and minutes come from global variables 1 and 2, as the header's time flag
+    dictates.
+  */
+  pub const StatusLine &getStatusLine () const noexcept;
+  /**
+    Gets the rows above the lower window (valid until destruction), with
+    trailing blanks removed, as they stood when the Z-machine last requested
+    input, if the Vm was constructed to capture them. In V1-3, the first row
+    is the status line's, which is left blank.
+  */
+  pub const std::vector<core::u8string> &getUpperWindow () const noexcept;
   /**
     Returns whether or not the Z-machine is alive.
   */
   pub bool isAlive () const noexcept;
+  /**
+    Sets the maximum number of instructions that the Z-machine may run during
+    each action (from the next call to ::doAction()) or removes the limit, if
+    {@c 0}. An action that would exceed it fails with an ActionLimitException,
+    after which the Z-machine is dead.
+  */
+  pub void setInstructionBudget (iu64 budget) noexcept;
+  /**
+    Sets the maximum wall-clock time that the Z-machine may spend running
+    during each action (from the next call to ::doAction()) or removes the
+    limit, if zero. An action that exceeds it fails with an
+    ActionLimitException, after which the Z-machine is dead. The clock is
+    checked every few thousand instructions, so the limit may be overrun
+    slightly.
+  */
+  pub void setTimeLimit (std::chrono::steady_clock::duration limit) noexcept;
   /**
     Passes input to the Z-machine and waits until it next requests input.
 
-    @throw if the Z-machine failed while performing the action.
+    @throw if the Z-machine failed while performing the action (or exceeded
+    one of its limits).
   */
   pub void doAction (core::u8string::const_iterator inputBegin, core::u8string::const_iterator inputEnd, core::u8string &r_output);
   pub void doAction (const core::u8string &input, core::u8string &r_output);
+  /**
+    Passes input to the Z-machine and waits until it next requests input,
+    returning the output in a buffer owned by the Vm (valid until the next
+    action, replay or destruction). The buffer is reused from action to
+    action, so no allocation is needed once it has grown to fit.
+
+    @throw if the Z-machine failed while performing the action (or exceeded
+    one of its limits).
+  */
+  pub std::u8string_view doAction (core::u8string::const_iterator inputBegin, core::u8string::const_iterator inputEnd);
+  pub std::u8string_view doAction (const core::u8string &input);
+  /**
+    Passes input to the Z-machine and waits until it next requests input, as
+    ::doAction() does, but without output: text that would only reach the
+    lower window is dropped as soon as it is printed (before it is buffered,
+    wrapped or put on the screen) and nothing is rendered. Text printed to
+    memory (through output stream 3) and everything else that the Z-machine
+    can see are unaffected, but for the lower window's cursor (which only
+    @get_cursor would show). The screen is left as it would not have been by
+    ::doAction() (which a StateMask ignoring the screen overlooks), so the
+    ActionCache is not used.
+
+    @throw if the Z-machine failed while performing the action (or exceeded
+    one of its limits).
+  */
+  pub void doActionSilent (core::u8string::const_iterator inputBegin, core::u8string::const_iterator inputEnd);
+  pub void doActionSilent (const core::u8string &input);
+  /**
+    Passes input to the Z-machine and waits until it next requests input, as
+    ::doActionSilent() does (leaving the Z-machine just as that would), but
+    with each print operation whose text would only reach the lower window
+    (printing a character, a newline, a number or a string from static or
+    high memory, by address) recorded instead of carried out, so that the
+    action's output need only be decoded, wrapped and rendered if it is
+    fetched with ::writeDeferredOutput(). Strings that could change before
+    then (those in dynamic memory, including most object names) are decoded
+    straight away, as is everything while reads are recorded. The Vm must
+    stream its output.
+
+    @throw if the Z-machine failed while performing the action (or exceeded
+    one of its limits).
+  */
+  pub void doActionDeferred (core::u8string::const_iterator inputBegin, core::u8string::const_iterator inputEnd);
+  pub void doActionDeferred (const core::u8string &input);
+  /**
+    Appends the output of the last action, if it was done by
+    ::doActionDeferred(), to the given string (carrying out the recorded print
+    operations, with the lower window as it stands, so that the text is what
+    ::doAction() would have given from the same state). The output can be
+    fetched any number of times until the next action, replay or restoration;
+    fetching it leaves the Z-machine as it was.
+
+    @throw if the Z-machine failed while printing the output.
+  */
+  pub void writeDeferredOutput (core::u8string &r_output);
   /**
     Gets the number of successful saves into the current save state during the
     last action.
@@ -84,6 +255,85 @@ class Vm {
     during the last action.
   */
   pub iu getRestoreCount () const noexcept;
+  /**
+    Gets what the last action cost (valid until the next call to ::doAction()
+    or destruction): the instructions run, the routines called, the deepest
+    the stack got (in words, as seen on entry to each routine), the bytes and
+    words written (each word write also counting as two byte writes), the
+    Z-characters decoded, the bytes of output produced, the time that the
+    Z-machine spent running (and how much of that went on rendering the screen)
+    and the rest of the action's time (spent handing over between threads).
+  */
+  pub const ActionStats &getActionStats () const noexcept;
+  /**
+    Gets the latency histograms (valid until destruction) for the phases of
+    every action so far: waking the Z-machine, interpreting, rendering the
+    screen, returning to the caller and the whole action. Each histogram keeps
+    values to within about 6%.
+  */
+  pub const PhaseHistograms &getPhaseHistograms () const noexcept;
+  /**
+    Empties the phase histograms.
+  */
+  pub void clearPhaseHistograms () noexcept;
+  /**
+    Sets whether or not the phases of each action (from the next call to
+    ::doAction()) are recorded for ::writeChromeTrace().
+  */
+  pub void setTracing (bool tracing) noexcept;
+  /**
+    Discards the recorded phases.
+  */
+  pub void clearTrace () noexcept;
+  /**
+    Appends the recorded phases in Chrome's trace event format (as complete
+    events, with the caller's thread as thread 1 and the Z-machine's as thread
+    2).
+  */
+  pub void writeChromeTrace (core::u8string &r_out) const;
+  /**
+    Sets whether or not the Z-machine profiles the Z-code that it runs
+    (counting instructions by opcode and by routine call path). This has no
+    effect unless the Z-machine was built with {@c AUTOFROTZ_PROFILE} defined;
+    otherwise, the profiling hooks are compiled out.
+  */
+  pub void setProfiling (bool enabled) noexcept;
+  /**
+    Discards everything profiled so far.
+  */
+  pub void clearProfile ();
+  /**
+    Appends a report of everything profiled so far: instruction counts per
+    opcode, calls and exclusive and inclusive instruction counts per routine
+    and call counts per caller-to-callee edge. Routines are given by byte
+    address, with {@c ?} standing for frames that appeared without being
+    called (through restoration).
+  */
+  pub void writeProfileReport (core::u8string &r_out) const;
+  /**
+    Appends everything profiled so far as instruction counts per call path, in
+    the folded-stack format that flame graph tools take.
+  */
+  pub void writeProfileFoldedStacks (core::u8string &r_out) const;
+  /**
+    Gets the memory that the Vm holds, in bytes: the story file, the copy of
+    dynamic memory taken on loading it, the undo states, the screen, the rest
+    of the Z-machine's heap (its caches and indices, such as the string cache,
+    the property indices and the copy of the object tree), the word set, the
+    Z-machine thread's stack (where the platform reports it), the Vm's own
+    output buffers (including deferred output) and the records kept of the
+    Z-machine (its status line, upper window, profile and trace). The peak
+    size that the Z-machine's heap has reached is also given. The word set's
+    size is estimated at a bit per byte of dynamic memory.
+  */
+  pub MemoryUsage getMemoryUsage () const;
+  /**
+    Sets the function (or none, if {@c nullptr}) that, for every Vm, is told
+    each time its Z-machine allocates (a positive number of bytes) or frees (a
+    negative number) heap memory. The function is called on the Z-machine's
+    thread.
+  */
+  pub static void setAllocationHook (AllocationHook hook) noexcept;
   /**
     Sets the State (valid until the next call to ::setSaveState() or
     destruction) into which the Z-machine will save when given the filename of
@@ -96,6 +346,108 @@ class Vm {
     of character U+0001 or sets such restoration to fail, if {@c nullptr}.
   */
   pub void setRestoreState (const State *state) noexcept;
+  /**
+    Sets the ActionCache (valid until the next call to ::setActionCache() or
+    destruction) through which actions are performed or sets actions to be
+    performed directly, if {@c nullptr}. When an action is found in the cache,
+    the Z-machine is put straight into the resulting state and the output is
+    given without running any Z-code. Actions that save or restore, that leave
+    the Z-machine waiting on a different sort of read or that end it are never
+    cached. The ActionCache is not used by a Vm that keeps undo states (one
+    with a non-zero undo depth) or a word set, since an action repeated from it
+    would leave them differently, nor while reads are being recorded.
+  */
+  pub void setActionCache (ActionCache *cache) noexcept;
+  /**
+    Starts recording the actions performed into a ReplayLog (valid until the
+    next call to ::setReplayLog() or destruction), from the Z-machine's current
+    state, or stops recording, if {@c nullptr}. The log that recording stops on
+    is ended with a hash of the state reached. While recording, the
+    ActionCache is not used (since an action repeated from it draws no random
+    numbers), and restoring a snapshot or performing an action from one starts
+    the log again from the snapshot's state.
+  */
+  pub void setReplayLog (ReplayLog *log);
+  /**
+    Replays an ended ReplayLog: puts the Z-machine into the state that the log
+    starts from and performs the log's actions again, discarding their output
+    (which is never rendered), checking that each draws the same random numbers
+    as before and that they lead to the same state. The undo states are
+    forgotten. Actions that saved or restored are only replayed faithfully if
+    the same save and restore States are set.
+
+    @throw if the Z-machine is not waiting on the same sort of input as the
+    log's starting state, failed or diverged from the log.
+  */
+  pub void replay (const ReplayLog &log);
+  /**
+    Saves the Z-machine's whole state (as it waits for input) into a snapshot
+    State directly, without running any Z-code. Unlike a State saved by the
+    Z-machine itself, a snapshot covers the screen and the interpreter's own
+    state as well and can only be restored with ::restoreSnapshot(), by a Vm
+    in this process running the same story with the same settings.
+  */
+  pub void saveSnapshot (State &r_state) const;
+  /**
+    Puts the Z-machine straight into the state of a snapshot State (taken by
+    ::saveSnapshot() of this or another Vm), without running any Z-code. The
+    undo states are forgotten, and the status line and upper window are left
+    as they were until the next action.
+
+    @throw if the Z-machine is dead or is not waiting on the same sort of
+    input as the snapshot's.
+  */
+  pub void restoreSnapshot (const State &state);
+  /**
+    Compares the Z-machine's state (as it waits for input) with a snapshot
+    State, as State::diff() does (the Z-machine's state being the first of the
+    two).
+
+    @throw if the snapshot is not of this story or was taken by a Vm with
+    other settings.
+  */
+  pub StateDifference diffAgainst (const State &state, const RangeCallback &f) const;
+  /**
+    Puts the Z-machine straight into the state of a snapshot State (as
+    ::restoreSnapshot() does), passes input to it, waits until it next
+    requests input and saves a snapshot of the state that it was left in (as
+    ::saveSnapshot() does), all in a single handover to the Z-machine's
+    thread. The ActionCache is not used. {@c r_state} is left empty if the
+    Z-machine ends.
+
+    @throw if the Z-machine is not waiting on the same sort of input as the
+    snapshot's (in which case the input is not performed) or failed while
+    performing the action.
+  */
+  pub void doActionFrom (const State &state, core::u8string::const_iterator inputBegin, core::u8string::const_iterator inputEnd, core::u8string &r_output, State &r_state);
+  pub void doActionFrom (const State &state, const core::u8string &input, core::u8string &r_output, State &r_state);
+  /**
+    Runs a function on the Z-machine's thread while the Z-machine waits for
+    input, for code that works on the interpreter directly (since the
+    interpreter's globals belong to that thread).
+
+    @throw if the Z-machine is dead or the function throws.
+  */
+  pub void runOnVmThread (const std::function<void ()> &f) const;
+
+  prv void beginAction (core::u8string &r_output);
+};
+
+/**
+  Sums up how two snapshots differ, other than in dynamic memory.
+*/
+class StateDifference {
+  pub iu32 pc = 0;
+  pub iu32 otherPc = 0;
+  // (in words)
+  pub size_t stackSize = 0;
+  pub size_t otherStackSize = 0;
+  // The number of words, from the bottom of the stack up, that are the same in
+  // both
+  pub size_t commonStackSize = 0;
+  // Whether or not anything else (the other registers, the random number
+  // generator, the screen or the interpreter's own state) differs
+  pub bool isRestDifferent = false;
 };
 
 /**
@@ -112,14 +464,508 @@ class State {
     Checks whether or not this contains a saved Z-machine state.
   */
   pub bool isEmpty () noexcept;
+  /**
+    Checks whether or not this contains a snapshot (saved by
+    Vm::saveSnapshot()).
+  */
+  pub bool isSnapshot () const noexcept;
+  /**
+    Checks whether or not this and another snapshot are of the same story and
+    are waiting on the same sort of input (so that a Vm that can restore one
+    can restore the other).
+  */
+  pub bool awaitsSameInput (const State &state) const noexcept;
+  /**
+    Gets a hash of the state's contents.
+  */
+  pub iu64 getHash () const noexcept;
+  /**
+    Gets a hash of the state's contents, less the parts that the mask ignores
+    (so that states that the mask deems equal hash alike).
+  */
+  pub iu64 getHash (const StateMask &mask) const noexcept;
+  /**
+    Checks whether or not this and another state have the same contents.
+  */
+  pub bool equals (const State &state) const noexcept;
+  /**
+    Checks whether or not this and another state have the same contents, less
+    the parts that the mask ignores.
+  */
+  pub bool equals (const State &state, const StateMask &mask) const noexcept;
+  /**
+    Compares this snapshot with another of the same story (taken by Vms with
+    the same settings), without decoding either: calls {@c f} for each run of
+    dynamic memory addresses whose contents differ, in order, and sums up the
+    other differences.
+
+    @throw if the snapshots are of different stories or were taken by Vms with
+    different settings.
+  */
+  pub StateDifference diff (const State &state, const RangeCallback &f) const;
   /**
     Minimises the memory usage.
   */
   pub void compact ();
+  /**
+    Gets the memory that the state holds, in bytes.
+  */
+  pub size_t getMemoryUsage () const noexcept;
+
+  friend class Vm;
+};
+
+/**
+  Picks out parts of the Z-machine's state (say, a turn counter or the random
+  number generator) that are to be ignored when hashing and comparing the
+  snapshots of Vms running some story with some settings, so that states that
+  differ only there are deemed the same. States that aren't such snapshots are
+  hashed and compared whole. (The ActionCache always keys on the whole state,
+  since what an action does can depend on the parts ignored.)
+*/
+class StateMask {
+  prv size_t randomOffset;
+  prv size_t randomSize;
+  prv size_t screenOffset;
+  prv size_t screenSize;
+  prv size_t memoryOffset;
+  prv size_t memorySize;
+  prv zword globalsAddress;
+  // The sorted, disjoint ranges of snapshot bytes ignored
+  prv std::vector<std::pair<size_t, size_t>> gaps;
+
+  /**
+    Creates a mask (initially ignoring nothing) for the snapshots of Vms
+    running the same story with the same settings as the given one.
+
+    @throw if the Vm's Z-machine has terminated.
+  */
+  pub explicit StateMask (const Vm &vm);
+
+  /**
+    Ignores the dynamic memory from address {@c begin} up to (but not
+    including) address {@c end}.
+  */
+  pub void ignoreRange (iu32 begin, iu32 end);
+  /**
+    Ignores global variable {@c global} (which is variable 16 +
+    {@c global}).
+  */
+  pub void ignoreGlobal (zbyte global);
+  /**
+    Ignores the state of the random number generator.
+  */
+  pub void ignoreRandom ();
+  /**
+    Ignores the state of the screen (the windows and what's on them).
+  */
+  pub void ignoreScreen ();
+  /**
+    Checks whether or not the mask ignores nothing.
+  */
+  pub bool isEmpty () const noexcept;
+
+  prv void ignore (size_t begin, size_t end);
+  prv bool appliesTo (const core::string<zbyte> &body) const noexcept;
+
+  friend class State;
+};
+
+/**
+  Records the actions performed by a Vm (see Vm::setReplayLog()): the state
+  that they start from, their input and, for each, the seeds that the story
+  gave the random number generator and the numbers that it drew. The actions
+  are kept compactly, so that long runs of them can be kept cheaply and
+  replayed (by Vm::replay()) to rebuild the state that they led to.
+*/
+class ReplayLog {
+  prv State start;
+  prv core::string<zbyte> actions;
+  prv size_t actionCount;
+  prv bool isEnded;
+  prv iu64 endHash;
+
+  pub ReplayLog () noexcept;
+
+  /**
+    Clears the log.
+  */
+  pub void clear () noexcept;
+  /**
+    Gets the state that the actions start from.
+  */
+  pub const State &getStart () const noexcept;
+  /**
+    Gets the number of actions recorded.
+  */
+  pub size_t getActionCount () const noexcept;
+  /**
+    Checks whether or not recording into the log has stopped (so that it can
+    be replayed).
+  */
+  pub bool hasEnded () const noexcept;
+  /**
+    Gets the hash (as State::getHash() gives) of the state that the actions led
+    to, once the log has ended.
+  */
+  pub iu64 getEndHash () const noexcept;
+  /**
+    Gets the memory that the log holds, in bytes.
+  */
+  pub size_t getMemoryUsage () const noexcept;
+
+  prv void restart (const State &state);
+  prv void add (core::u8string::const_iterator inputBegin, core::u8string::const_iterator inputEnd, bool silent, const std::vector<iu32> &randomEvents);
 
   friend class Vm;
 };
 
+/**
+  Remembers the results of actions, so that an action that has already been
+  performed from some state can be repeated without running the Z-machine. An
+  action is keyed by a hash of the Z-machine's whole state (memory, stack,
+  screen and the interpreter's own state) and its input; the cache keeps its
+  output and the changes that it made to the state. Memory is bounded, with
+  entries that have not been used recently evicted first (by the CLOCK
+  algorithm). A cache should only be used with Vms running the same story
+  with the same settings.
+*/
+class ActionCache {
+  prv class Entry {
+    pub bool isUsed;
+    pub bool isReferenced;
+    pub iu64 key;
+    pub iu64 stateHash;
+    pub core::u8string input;
+    pub core::u8string output;
+    pub core::string<zbyte> delta;
+    pub StatusLine statusLine;
+    pub std::vector<core::u8string> upperWindow;
+  };
+
+  prv size_t capacity;
+  prv size_t size;
+  prv std::vector<Entry> entries;
+  prv std::vector<size_t> freeEntries;
+  prv std::unordered_map<iu64, size_t> index;
+  prv size_t hand;
+  prv iu64 hits;
+  prv iu64 misses;
+  prv iu64 rejections;
+  prv iu64 evictions;
+
+  /**
+    Creates an empty cache that will hold no more than (approximately)
+    {@c capacity} bytes.
+  */
+  pub explicit ActionCache (size_t capacity);
+  ActionCache (const ActionCache &) = delete;
+  ActionCache &operator= (const ActionCache &) = delete;
+  ActionCache (ActionCache &&) = delete;
+  ActionCache &operator= (ActionCache &&) = delete;
+
+  /**
+    Discards all entries (but not the counts).
+  */
+  pub void clear () noexcept;
+  /**
+    Gets the number of actions that were repeated from the cache.
+  */
+  pub iu64 getHits () const noexcept;
+  /**
+    Gets the number of actions that were looked for in the cache without
+    being found.
+  */
+  pub iu64 getMisses () const noexcept;
+  /**
+    Gets the number of missed actions that could not be cached.
+  */
+  pub iu64 getRejections () const noexcept;
+  /**
+    Gets the number of entries that have been evicted to make room.
+  */
+  pub iu64 getEvictions () const noexcept;
+  /**
+    Sets all of the counts to zero.
+  */
+  pub void resetCounts () noexcept;
+  /**
+    Gets the number of entries held.
+  */
+  pub size_t getEntryCount () const noexcept;
+  /**
+    Gets the memory that the entries hold, in bytes.
+  */
+  pub size_t getMemoryUsage () const noexcept;
+
+  prv static size_t getEntrySize (const Entry &entry) noexcept;
+  prv const Entry *find (iu64 stateHash, core::u8string::const_iterator inputBegin, core::u8string::const_iterator inputEnd);
+  prv void add (iu64 stateHash, core::u8string::const_iterator inputBegin, core::u8string::const_iterator inputEnd, std::u8string_view output, const core::string<zbyte> &from, const core::string<zbyte> &to, const StatusLine &statusLine, const std::vector<core::u8string> &upperWindow);
+  prv void evictOne ();
+  prv static void makeDelta (const core::string<zbyte> &from, const core::string<zbyte> &to, core::string<zbyte> &r_delta);
+  prv static void applyDelta (const core::string<zbyte> &from, const core::string<zbyte> &delta, core::string<zbyte> &r_to);
+
+  friend class Vm;
+};
+
+/**
+  Runs a number of Vms on threads of their own, so that many actions can be
+  tried from one state at once (on as many cores as there are Vms). The Vms are
+  started once, when the pool is constructed, and reused from batch to batch.
+*/
+class VmPool {
+  prv core::string<char> zcodeFileName;
+  prv iu screenWidth;
+  prv iu screenHeight;
+  prv iu undoDepth;
+  prv VmOptions options;
+  prv std::mutex lock;
+  prv std::condition_variable condVar;
+  prv bool isStopping;
+  prv iu64 batch;
+  prv iu readyWorkers;
+  prv iu busyWorkers;
+  prv const State *batchState;
+  prv const std::vector<core::u8string> *batchInputs;
+  prv std::vector<core::u8string> *batchOutputs;
+  prv std::vector<State> *batchStates;
+  prv size_t nextInput;
+  prv std::exception_ptr failureException;
+  prv std::vector<std::thread> workers;
+
+  /**
+    Starts {@c size} Vms (or one per hardware thread, if {@c 0}), with the
+    given settings (as for Vm's constructor, except that the Vms never have word
+    sets). Their initial output is discarded.
+
+    @throw if a Vm's Z-machine terminated on startup.
+  */
+  pub VmPool (const char *zcodeFileName, iu screenWidth, iu screenHeight, iu undoDepth, const VmOptions &options, iu size);
+  VmPool (const VmPool &) = delete;
+  VmPool &operator= (const VmPool &) = delete;
+  VmPool (VmPool &&) = delete;
+  VmPool &operator= (VmPool &&) = delete;
+  pub ~VmPool () noexcept;
+
+  /**
+    Gets the number of Vms.
+  */
+  pub iu getSize () const noexcept;
+  /**
+    Performs each of the inputs from the state of a snapshot State (taken by
+    Vm::saveSnapshot() of a Vm running the same story with the same
+    settings), spread across the Vms, and waits for them all to finish. The
+    output of each action and a snapshot of the state that it led to are put
+    into {@c r_outputs} and {@c r_states} at the input's position. An action
+    that fails or ends the Z-machine gives an empty State. Its Vm is then
+    replaced by a fresh one, as is that of an action that leaves the Z-machine
+    waiting on a different sort of input from the snapshot's.
+
+    @throw if the Vms could not be put into the snapshot's state.
+  */
+  pub void doActions (const State &state, const std::vector<core::u8string> &inputs, std::vector<core::u8string> &r_outputs, std::vector<State> &r_states);
+
+  prv void stop () noexcept;
+  prv void work ();
+  prv std::unique_ptr<Vm> startVm (core::u8string &r_output);
+};
+
+/**
+  Searches the states that a story can reach, most promising first. Each of a
+  number of workers runs a Vm on a thread of its own and keeps a frontier of
+  its own, from which it takes the highest-scoring state to expand next; a
+  worker whose frontier is empty steals the best state from another's (so the
+  search is only approximately best-first). States that have already been
+  reached are recognised by a hash of their snapshot (kept in a transposition
+  table) and are not expanded again. Since the whole state is hashed, screen
+  and all, the Vms are best run with streamed output (or a StateMask set to
+  ignore the parts of the state that don't matter).
+*/
+class Explorer {
+  /**
+    A state reached by the explorer, with the action that led to it from its
+    parent.
+  */
+  pub class Node {
+    pub std::shared_ptr<const Node> parent;
+    pub core::u8string input;
+    pub core::u8string output;
+    // (emptied once the node has been expanded)
+    pub State state;
+    pub iu64 hash;
+    pub iu32 depth;
+    pub double score;
+
+    /**
+      Gets the inputs that lead from the root to this node.
+    */
+    pub std::vector<core::u8string> getPath () const;
+  };
+  /**
+    Appends to {@c r_inputs} the inputs to try from a node. The Vm is in the
+    node's state and may be examined (but not changed). Called on the workers'
+    threads, so must be thread-safe.
+  */
+  pub typedef std::function<void (const Vm &vm, const Node &node, std::vector<core::u8string> &r_inputs)> ActionGenerator;
+  /**
+    Scores a newly reached node (higher scores being expanded sooner). The Vm
+    is in the node's state and may be examined (but not changed). Called on the
+    workers' threads, so must be thread-safe.
+  */
+  pub typedef std::function<double (const Vm &vm, const Node &node)> Scorer;
+
+  prv class Frontier {
+    pub std::mutex lock;
+    pub std::vector<std::shared_ptr<Node>> heap;
+  };
+  prv class TableShard {
+    pub std::mutex lock;
+    pub std::unordered_set<iu64> hashes;
+  };
+  prv static const size_t TABLE_SHARDS = 64;
+
+  prv core::string<char> zcodeFileName;
+  prv iu screenWidth;
+  prv iu screenHeight;
+  prv iu undoDepth;
+  prv VmOptions options;
+  prv ActionGenerator generator;
+  prv Scorer scorer;
+  prv iu64 expansionLimit;
+  prv iu32 depthLimit;
+  prv std::unique_ptr<StateMask> stateMask;
+  prv std::mutex lock;
+  prv std::condition_variable condVar;
+  prv bool isStopping;
+  prv iu64 run;
+  prv iu readyWorkers;
+  prv iu busyWorkers;
+  prv std::exception_ptr failureException;
+  prv std::vector<std::thread> workers;
+  prv std::unique_ptr<Frontier []> frontiers;
+  prv std::unique_ptr<TableShard []> table;
+  prv std::atomic<bool> isHalting;
+  prv std::atomic<iu64> pendingNodes;
+  prv std::atomic<iu> idleWorkers;
+  prv std::mutex idleLock;
+  prv std::condition_variable idleCondVar;
+  prv std::atomic<iu64> expansions;
+  prv std::atomic<iu64> reached;
+  prv std::atomic<iu64> duplicates;
+  prv std::atomic<iu64> deadEnds;
+  prv std::atomic<iu64> steals;
+  prv std::chrono::steady_clock::duration time;
+  prv mutable std::mutex bestLock;
+  prv std::shared_ptr<const Node> best;
+  prv State bestState;
+
+  /**
+    Starts {@c size} workers (or one per hardware thread, if {@c 0}), whose Vms
+    have the given settings (as for Vm's constructor, except that the Vms never
+    have word sets). Their initial output is discarded.
+
+    @throw if a Vm's Z-machine terminated on startup.
+  */
+  pub Explorer (const char *zcodeFileName, iu screenWidth, iu screenHeight, iu undoDepth, const VmOptions &options, iu size, ActionGenerator generator, Scorer scorer);
+  Explorer (const Explorer &) = delete;
+  Explorer &operator= (const Explorer &) = delete;
+  Explorer (Explorer &&) = delete;
+  Explorer &operator= (Explorer &&) = delete;
+  pub ~Explorer () noexcept;
+
+  /**
+    Gets the number of workers.
+  */
+  pub iu getSize () const noexcept;
+  /**
+    Sets the number of nodes to expand before ::explore() gives up (or no
+    limit, if {@c 0}, the default).
+  */
+  pub void setExpansionLimit (iu64 limit) noexcept;
+  /**
+    Sets the depth (in actions from the root) beyond which nodes are not
+    reached (or no limit, if {@c 0}, the default).
+  */
+  pub void setDepthLimit (iu32 limit) noexcept;
+  /**
+    Sets the mask applied to states when recognising those already reached
+    (which must be for Vms running the same story with the same settings as
+    the explorer's).
+  */
+  pub void setStateMask (const StateMask &mask);
+  /**
+    Explores from the state of a snapshot State (taken by Vm::saveSnapshot() of
+    a Vm running the same story with the same settings), until every reachable
+    node has been expanded, the expansion limit is reached or ::halt() is
+    called. The transposition table, the best node and the counts are reset
+    first. A node whose action fails, ends the Z-machine or leaves it waiting
+    on a different sort of input from the root's is a dead end (and its Vm is
+    replaced by a fresh one).
+
+    @throw if the Vms could not be put into the snapshot's state or a callback
+    threw.
+  */
+  pub void explore (const State &root);
+  /**
+    Makes ::explore() return as soon as the nodes being expanded are done.
+    May be called from the callbacks.
+  */
+  pub void halt () noexcept;
+  /**
+    Gets the highest-scoring node reached by the last exploration (the first
+    reached, of equals) or {@c nullptr}, if none.
+  */
+  pub std::shared_ptr<const Node> getBest () const;
+  /**
+    Gets the state of the best node (which is kept, even once the node has been
+    expanded).
+  */
+  pub const State &getBestState () const noexcept;
+  /**
+    Gets the number of nodes expanded.
+  */
+  pub iu64 getExpansions () const noexcept;
+  /**
+    Gets the number of states reached (including duplicates and dead ends).
+  */
+  pub iu64 getReached () const noexcept;
+  /**
+    Gets the number of states reached that were already in the transposition
+    table.
+  */
+  pub iu64 getDuplicates () const noexcept;
+  /**
+    Gets the number of actions that led to dead ends.
+  */
+  pub iu64 getDeadEnds () const noexcept;
+  /**
+    Gets the number of nodes taken from another worker's frontier.
+  */
+  pub iu64 getSteals () const noexcept;
+  /**
+    Gets the number of states in the transposition table.
+  */
+  pub size_t getTranspositionCount () const;
+  /**
+    Gets how long the last exploration took.
+  */
+  pub std::chrono::steady_clock::duration getTime () const noexcept;
+  /**
+    Gets the number of nodes expanded per second by the last exploration.
+  */
+  pub double getExpansionsPerSecond () const noexcept;
+
+  prv void stop () noexcept;
+  prv void work (iu worker);
+  prv std::unique_ptr<Vm> startVm (core::u8string &r_output);
+  prv void explore (iu worker, std::unique_ptr<Vm> &vm, core::u8string &idleOutput);
+  prv void expand (iu worker, std::unique_ptr<Vm> &vm, core::u8string &idleOutput, const std::shared_ptr<Node> &node);
+  prv std::shared_ptr<Node> take (iu worker);
+  prv void give (iu worker, std::shared_ptr<Node> &&node);
+  prv bool addToTable (iu64 hash);
+  prv void considerBest (const std::shared_ptr<Node> &node);
+};
+
 /* -----------------------------------------------------------------------------
 ----------------------------------------------------------------------------- */
 }
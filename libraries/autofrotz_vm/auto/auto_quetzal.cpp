@@ -26,7 +26,7 @@ using autofrotz::vmlink::ZbyteWriter;
 
 typedef unsigned long zlong;
 
-vmlocal extern zword frames[];
+extern vmlocal zword frames[];
 
 unsigned int random_statesize (void);
 void random_savestate (unsigned char *buffer);
@@ -0,0 +1,312 @@
+/* auto_snapshot.c - Snapshots of the whole Z-machine between reads.
+ *
+ * This file is part of Frotz.
+ *
+ * Frotz is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Frotz is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+/*
+ * Unlike a Quetzal save, a snapshot holds everything that decides what
+ * the Z-machine does next (the screen, the state of the interpreter's
+ * own modules and the read that it is waiting on, as well as memory
+ * and the stack), so that a Z-machine put into a snapshot's state
+ * carries on exactly as the Z-machine that the snapshot was taken of
+ * would have. Snapshots are only meaningful within one process (where
+ * they can be moved between Z-machines running the same story with the
+ * same settings).
+ */
+
+#include <string.h>
+#include "../common/frotz.h"
+
+unsigned int random_statesize (void);
+void random_savestate (unsigned char *buffer);
+void random_restorestate (unsigned char *buffer);
+unsigned int buffer_statesize (void);
+void buffer_savestate (unsigned char *buffer);
+void buffer_restorestate (unsigned char *buffer);
+unsigned int redirect_statesize (void);
+void redirect_savestate (unsigned char *buffer);
+void redirect_restorestate (unsigned char *buffer);
+unsigned int screen_statesize (void);
+void screen_savestate (unsigned char *buffer);
+void screen_restorestate (unsigned char *buffer);
+unsigned int dumb_input_statesize (void);
+void dumb_input_savestate (unsigned char *buffer);
+void dumb_input_restorestate (unsigned char *buffer);
+unsigned int dumb_input_readsize (void);
+bool dumb_input_is_resumable (const unsigned char *);
+unsigned int dumb_output_statesize (void);
+void dumb_output_savestate (unsigned char *buffer);
+void dumb_output_restorestate (unsigned char *buffer);
+
+extern void reset_undo (void);
+extern void reset_object_tree (void);
+extern void reset_dictionaries (void);
+extern void recheck_string_cache (void);
+
+/*
+ * The snapshot starts with a header identifying it and its story, then
+ * the registers (with the size of dynamic memory, so that
+ * snapshot_parts can find it) and the read being waited on (so that
+ * can_resume_snapshot can find it) and ends with dynamic memory and
+ * the live part of the stack (the only part whose size varies).
+ */
+
+static const zbyte tag[4] = {'A', 'F', 'S', 'n'};
+
+#define HEADER_SIZE (sizeof (tag) + sizeof (h_release) + sizeof (h_serial) \
+	+ sizeof (h_checksum))
+#define REGISTERS_SIZE (sizeof (long) + 2 * sizeof (zword) + sizeof (long) \
+	+ sizeof (int) + sizeof (zargs) + 6 * sizeof (bool) + sizeof (zword))
+
+static unsigned int fixed_size (void)
+{
+
+    return HEADER_SIZE + REGISTERS_SIZE + dumb_input_statesize () + random_statesize ()
+	+ buffer_statesize () + redirect_statesize () + screen_statesize ()
+	+ dumb_output_statesize () + h_dynamic_size;
+
+}/* fixed_size */
+
+/*
+ * take_snapshot
+ *
+ * Store the state of the Z-machine (which must be waiting for input).
+ *
+ */
+
+void take_snapshot (core::string<zbyte> &snapshot)
+{
+    zword stack_size = stack + STACK_SIZE - sp;
+    unsigned char *b;
+    long pc;
+
+    snapshot.resize (fixed_size () + stack_size * sizeof (zword));
+    b = snapshot.data ();
+
+    memcpy (b, tag, sizeof (tag)); b += sizeof (tag);
+    core::set(b, h_release); b += sizeof (h_release);
+    memcpy (b, h_serial, sizeof (h_serial)); b += sizeof (h_serial);
+    core::set(b, h_checksum); b += sizeof (h_checksum);
+
+    GET_PC (pc)
+    core::set(b, pc); b += sizeof (pc);
+    core::set(b, stack_size); b += sizeof (stack_size);
+    core::set(b, frame_count); b += sizeof (frame_count);
+    core::set(b, (long) (fp - stack)); b += sizeof (long);
+    core::set(b, zargc); b += sizeof (zargc);
+    memcpy (b, zargs, sizeof (zargs)); b += sizeof (zargs);
+    core::set(b, ostream_screen); b += sizeof (bool);
+    core::set(b, ostream_script); b += sizeof (bool);
+    core::set(b, ostream_memory); b += sizeof (bool);
+    core::set(b, ostream_record); b += sizeof (bool);
+    core::set(b, istream_replay); b += sizeof (bool);
+    core::set(b, message); b += sizeof (bool);
+    core::set(b, h_dynamic_size); b += sizeof (h_dynamic_size);
+
+    dumb_input_savestate (b); b += dumb_input_statesize ();
+    random_savestate (b); b += random_statesize ();
+    buffer_savestate (b); b += buffer_statesize ();
+    redirect_savestate (b); b += redirect_statesize ();
+    screen_savestate (b); b += screen_statesize ();
+    dumb_output_savestate (b); b += dumb_output_statesize ();
+    memcpy (b, zmp, h_dynamic_size); b += h_dynamic_size;
+    memcpy (b, sp, stack_size * sizeof (zword));
+
+}/* take_snapshot */
+
+/*
+ * snapshot_layout
+ *
+ * Find where the random number generator's state, the screen's state
+ * (the windows and the dumb interface's grid) and dynamic memory lie
+ * in the snapshots that the Z-machine takes (which are laid out alike,
+ * but for the live part of the stack at the end).
+ *
+ */
+
+void snapshot_layout (size_t *random, size_t *random_size, size_t *screen,
+		      size_t *screen_size, size_t *memory, size_t *memory_size)
+{
+
+    *random = HEADER_SIZE + REGISTERS_SIZE + dumb_input_statesize ();
+    *random_size = random_statesize ();
+    *screen = *random + *random_size + buffer_statesize () + redirect_statesize ();
+    *screen_size = screen_statesize () + dumb_output_statesize ();
+    *memory = *screen + *screen_size;
+    *memory_size = h_dynamic_size;
+
+}/* snapshot_layout */
+
+/*
+ * is_snapshot
+ *
+ * Return whether or not the given bytes are a snapshot (rather than,
+ * say, a Quetzal save). This looks at nothing but the bytes, so it can
+ * be called from any thread.
+ *
+ */
+
+bool is_snapshot (const core::string<zbyte> &snapshot)
+{
+
+    return snapshot.size () >= HEADER_SIZE
+	&& memcmp (snapshot.data (), tag, sizeof (tag)) == 0;
+
+}/* is_snapshot */
+
+/*
+ * snapshot_parts
+ *
+ * Find the size of a snapshot's header, its program counter, where the
+ * rest of its registers and the interpreter's state start (running up
+ * to dynamic memory) and where its dynamic memory and the live part of
+ * its stack (in words) lie. Return FALSE if the bytes are not a
+ * snapshot. This looks at nothing but the bytes, so it can be called
+ * from any thread.
+ *
+ */
+
+bool snapshot_parts (const core::string<zbyte> &snapshot, size_t *header,
+		     long *pc, size_t *rest, size_t *memory,
+		     size_t *memory_size, size_t *stack, size_t *stack_size)
+{
+    const unsigned char *b;
+
+    if (!is_snapshot (snapshot) || snapshot.size () < HEADER_SIZE + REGISTERS_SIZE)
+	return FALSE;
+
+    b = snapshot.data () + HEADER_SIZE;
+    *header = HEADER_SIZE;
+    *pc = core::get<long>(b);
+    *rest = HEADER_SIZE + sizeof (long) + sizeof (zword);
+    *stack_size = core::get<zword>(b + sizeof (long));
+    *memory_size = core::get<zword>(b + REGISTERS_SIZE - sizeof (zword));
+    if (snapshot.size () < HEADER_SIZE + REGISTERS_SIZE + *memory_size
+	+ *stack_size * sizeof (zword))
+	return FALSE;
+    *stack = snapshot.size () - *stack_size * sizeof (zword);
+    *memory = *stack - *memory_size;
+    return TRUE;
+
+}/* snapshot_parts */
+
+/*
+ * snapshots_await_same_read
+ *
+ * Return whether or not two snapshots are of the same story and are
+ * waiting on the very same read (so that a Z-machine that could be put
+ * into the state of one could be put into the state of the other).
+ * This looks at nothing but the bytes, so it can be called from any
+ * thread.
+ *
+ */
+
+bool snapshots_await_same_read (const core::string<zbyte> &a, const core::string<zbyte> &b)
+{
+    const size_t read = HEADER_SIZE + REGISTERS_SIZE;
+    const size_t read_size = dumb_input_readsize ();
+
+    if (!is_snapshot (a) || !is_snapshot (b)
+	|| a.size () < read + read_size || b.size () < read + read_size)
+	return FALSE;
+    return memcmp (a.data (), b.data (), HEADER_SIZE) == 0
+	&& memcmp (a.data () + read, b.data () + read, read_size) == 0;
+
+}/* snapshots_await_same_read */
+
+/*
+ * can_resume_snapshot
+ *
+ * Return whether or not the Z-machine could be put into the state of
+ * the given snapshot: it must be of the same story and the same screen
+ * and be waiting on the very same sort of read (since the read's C
+ * stack frames are not part of the snapshot).
+ *
+ */
+
+bool can_resume_snapshot (const core::string<zbyte> &snapshot)
+{
+    const unsigned char *b = snapshot.data ();
+    zword stack_size;
+
+    if (!is_snapshot (snapshot) || snapshot.size () < fixed_size ())
+	return FALSE;
+    b += sizeof (tag);
+    if (core::get<zword>(b) != h_release)
+	return FALSE;
+    b += sizeof (h_release);
+    if (memcmp (b, h_serial, sizeof (h_serial)) != 0)
+	return FALSE;
+    b += sizeof (h_serial);
+    if (core::get<zword>(b) != h_checksum)
+	return FALSE;
+    b += sizeof (h_checksum);
+    stack_size = core::get<zword>(b + sizeof (long));
+    if (snapshot.size () != fixed_size () + stack_size * sizeof (zword))
+	return FALSE;
+
+    return dumb_input_is_resumable (b + REGISTERS_SIZE);
+
+}/* can_resume_snapshot */
+
+/*
+ * apply_snapshot
+ *
+ * Put the Z-machine (which must be waiting for input) into the state
+ * of the given snapshot. Undo states are forgotten, since they belong
+ * to the Z-machine's old history.
+ *
+ */
+
+void apply_snapshot (const core::string<zbyte> &snapshot)
+{
+    unsigned char *b = (unsigned char *) snapshot.data () + HEADER_SIZE;
+    zword stack_size;
+    long pc;
+
+    pc = core::get<long>(b); b += sizeof (pc);
+    stack_size = core::get<zword>(b); b += sizeof (stack_size);
+    frame_count = core::get<zword>(b); b += sizeof (frame_count);
+    fp = stack + core::get<long>(b); b += sizeof (long);
+    zargc = core::get<int>(b); b += sizeof (zargc);
+    memcpy (zargs, b, sizeof (zargs)); b += sizeof (zargs);
+    ostream_screen = core::get<bool>(b); b += sizeof (bool);
+    ostream_script = core::get<bool>(b); b += sizeof (bool);
+    ostream_memory = core::get<bool>(b); b += sizeof (bool);
+    ostream_record = core::get<bool>(b); b += sizeof (bool);
+    istream_replay = core::get<bool>(b); b += sizeof (bool);
+    message = core::get<bool>(b); b += sizeof (bool);
+    b += sizeof (h_dynamic_size);
+
+    dumb_input_restorestate (b); b += dumb_input_statesize ();
+    random_restorestate (b); b += random_statesize ();
+    buffer_restorestate (b); b += buffer_statesize ();
+    redirect_restorestate (b); b += redirect_statesize ();
+    screen_restorestate (b); b += screen_statesize ();
+    dumb_output_restorestate (b); b += dumb_output_statesize ();
+    memcpy (zmp, b, h_dynamic_size); b += h_dynamic_size;
+    sp = stack + STACK_SIZE - stack_size;
+    memcpy (sp, b, stack_size * sizeof (zword));
+    SET_PC (pc)
+
+    reset_undo ();
+    reset_object_tree ();
+    reset_dictionaries ();
+    recheck_string_cache ();
+    PROFILE_FRAMES (frame_count)
+
+}/* apply_snapshot */
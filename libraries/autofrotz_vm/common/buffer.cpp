@@ -24,11 +24,15 @@
 extern void stream_char (zchar);
 extern void stream_word (const zchar *);
 extern void stream_new_line (void);
+#ifdef AUTOFROTZ
+extern bool stream_silenced (void);
+extern void stream_defer (int, long);
+#endif
 
-vmlocal static zchar buffer[TEXT_BUFFER_SIZE];
-vmlocal static int bufpos = 0;
+static vmlocal zchar buffer[TEXT_BUFFER_SIZE];
+static vmlocal int bufpos = 0;
 
-vmlocal static zchar prev_c = 0;
+static vmlocal zchar prev_c = 0;
 
 /*
  * flush_buffer
@@ -39,7 +43,12 @@ vmlocal static zchar prev_c = 0;
 
 void flush_buffer (void)
 {
-    vmlocal static bool locked = FALSE;
+    static vmlocal bool locked = FALSE;
+
+#ifdef AUTOFROTZ
+    if (stream_silenced ())
+	stream_defer (DEFERRED_FLUSH, 0);
+#endif
 
     /* Make sure we stop when flush_buffer is called from flush_buffer.
        Note that this is difficult to avoid as we might print a newline
@@ -80,7 +89,12 @@ void flush_buffer (void)
 
 void print_char (zchar c)
 {
-    vmlocal static bool flag = FALSE;
+    static vmlocal bool flag = FALSE;
+
+#ifdef AUTOFROTZ
+    if (stream_silenced ())
+	{ stream_defer (DEFERRED_CHAR, c); return; }
+#endif
 
     if (message || ostream_memory || enable_buffering) {
 
@@ -132,6 +146,11 @@ void print_char (zchar c)
 void new_line (void)
 {
 
+#ifdef AUTOFROTZ
+    if (stream_silenced ())
+	{ stream_defer (DEFERRED_NEW_LINE, 0); return; }
+#endif
+
     flush_buffer (); stream_new_line ();
 
 }/* new_line */
@@ -151,3 +170,58 @@ void init_buffer(void)
     prev_c = 0;
 }
 
+
+#ifdef AUTOFROTZ
+
+/*
+ * buffer_statesize
+ *
+ * Returns the number of unsigned chars needed to store the text
+ * buffer's state.
+ *
+ */
+
+unsigned int buffer_statesize (void)
+{
+
+    return sizeof (buffer) + sizeof (bufpos) + sizeof (prev_c);
+
+}/* buffer_statesize */
+
+/*
+ * buffer_savestate
+ *
+ * Saves the text buffer's state to the given buffer (of size at least
+ * buffer_statesize()). Unused space is saved as zeros, so that equal
+ * states save equally.
+ *
+ */
+
+void buffer_savestate (unsigned char *b)
+{
+
+    memset (b, 0, sizeof (buffer));
+    memcpy (b, buffer, bufpos * sizeof (zchar)); b += sizeof (buffer);
+    core::set(b, bufpos); b += sizeof (bufpos);
+    core::set(b, prev_c); b += sizeof (prev_c);
+
+}/* buffer_savestate */
+
+/*
+ * buffer_restorestate
+ *
+ * Restores the text buffer's state from the given buffer (filled with
+ * buffer_savestate() from this process).
+ *
+ */
+
+void buffer_restorestate (unsigned char *b)
+{
+
+    memcpy (buffer, b, sizeof (buffer)); b += sizeof (buffer);
+    bufpos = core::get<decltype(bufpos)>(b); b += sizeof (bufpos);
+    prev_c = core::get<decltype(prev_c)>(b); b += sizeof (prev_c);
+
+}/* buffer_restorestate */
+
+#endif
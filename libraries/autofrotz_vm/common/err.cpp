@@ -27,7 +27,7 @@
 
 /* vmlocal int err_report_mode = ERR_DEFAULT_REPORT_MODE; */
 
-vmlocal static int error_count[ERR_NUM_ERRORS];
+static vmlocal int error_count[ERR_NUM_ERRORS];
 
 static const char *const err_messages[] = {
     "Text buffer overflow",
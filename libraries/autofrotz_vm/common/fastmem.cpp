@@ -64,10 +64,21 @@ extern zword restore_quetzal (FILE *, FILE *);
 
 extern void erase_window (zword);
 
-vmlocal extern void (*op0_opcodes[]) (void);
-vmlocal extern void (*op1_opcodes[]) (void);
-vmlocal extern void (*op2_opcodes[]) (void);
-vmlocal extern void (*var_opcodes[]) (void);
+extern void reset_object_tree (void);
+extern void reset_dictionaries (void);
+extern void recheck_string_cache (void);
+
+extern vmlocal void (*op0_opcodes[]) (void);
+extern vmlocal void (*op1_opcodes[]) (void);
+extern vmlocal void (*op2_opcodes[]) (void);
+extern vmlocal void (*var_opcodes[]) (void);
+
+extern vmlocal zword object_tree_lo;
+extern vmlocal zword object_tree_hi;
+extern vmlocal zword dict_index_lo;
+extern vmlocal zword dict_index_hi;
+extern vmlocal zword text_deps_lo;
+extern vmlocal zword text_deps_hi;
 
 vmlocal char save_name[MAX_FILE_NAME + 1] = DEFAULT_SAVE_NAME;
 vmlocal char auxilary_name[MAX_FILE_NAME + 1] = DEFAULT_AUXILARY_NAME;
@@ -75,7 +86,7 @@ vmlocal char auxilary_name[MAX_FILE_NAME + 1] = DEFAULT_AUXILARY_NAME;
 vmlocal zbyte far *zmp = NULL;
 vmlocal zbyte far *pcp = NULL;
 
-vmlocal static FILE *story_fp = NULL;
+static vmlocal FILE *story_fp = NULL;
 
 /*
  * Data for the undo mechanism.
@@ -96,10 +107,10 @@ struct undo_struct {
     /* undo diff and stack data follow */
 };
 
-vmlocal static undo_t *first_undo = NULL, *last_undo = NULL, *curr_undo = NULL;
-vmlocal static zbyte *undo_mem = NULL, *prev_zmp, *undo_diff;
+static vmlocal undo_t *first_undo = NULL, *last_undo = NULL, *curr_undo = NULL;
+static vmlocal zbyte *undo_mem = NULL, *prev_zmp, *undo_diff;
 
-vmlocal static int undo_count = 0;
+static vmlocal int undo_count = 0;
 
 /*
  * get_header_extension
@@ -479,6 +490,235 @@ void reset_memory (void)
     zmp = NULL;
 }/* reset_memory */
 
+#ifdef AUTOFROTZ
+
+/*
+ * memory_usage
+ *
+ * Report the bytes held for the story file and for multiple undo.
+ *
+ */
+
+void memory_usage (size_t *story, size_t *undo)
+{
+    undo_t *p;
+
+    *story = zmp ? story_size : 0;
+
+    *undo = undo_mem ? (h_dynamic_size * 5) / 2 + 2 : 0;
+    for (p = first_undo; p; p = p->next)
+	*undo += sizeof (undo_t) + p->diff_size + p->stack_size * sizeof (*sp);
+
+}/* memory_usage */
+
+/*
+ * reset_undo
+ *
+ * Forget all undo states, after the Z-machine's state has been
+ * replaced other than by restoring.
+ *
+ */
+
+void reset_undo (void)
+{
+
+    if (undo_mem == NULL)
+	return;
+
+    free_undo (undo_count);
+    curr_undo = NULL;
+    memcpy (prev_zmp, zmp, h_dynamic_size);
+
+}/* reset_undo */
+
+/*
+ * auto_malloc, auto_calloc, auto_realloc, auto_free
+ *
+ * Allocate and free heap memory, telling the VmLink how much the
+ * Z-machine holds. Each block is preceded by its size and kept on a
+ * list, so that release_memory can find whatever is left.
+ *
+ */
+
+typedef struct block_struct {
+    struct block_struct *prev;
+    struct block_struct *next;
+    size_t size;
+} block_t;
+
+#define BLOCK_HEADER ((sizeof (block_t) + alignof (max_align_t) - 1) \
+	/ alignof (max_align_t) * alignof (max_align_t))
+
+static vmlocal block_t *blocks = NULL;
+
+static void link_block (block_t *b)
+{
+
+    b->prev = NULL;
+    b->next = blocks;
+    if (blocks != NULL)
+	blocks->prev = b;
+    blocks = b;
+
+}/* link_block */
+
+static void unlink_block (block_t *b)
+{
+
+    if (b->prev != NULL)
+	b->prev->next = b->next;
+    else
+	blocks = b->next;
+    if (b->next != NULL)
+	b->next->prev = b->prev;
+
+}/* unlink_block */
+
+void *auto_malloc (size_t size)
+{
+    block_t *b;
+
+    if ((b = (block_t *) (malloc) (size + BLOCK_HEADER)) == NULL)
+	return NULL;
+    b->size = size;
+    link_block (b);
+    vmLink->countAllocation ((ptrdiff_t) size);
+
+    return (char *) b + BLOCK_HEADER;
+
+}/* auto_malloc */
+
+void *auto_calloc (size_t n, size_t size)
+{
+    void *p;
+
+    if (size != 0 && n > (size_t) -1 / size)
+	return NULL;
+    if ((p = auto_malloc (n * size)) != NULL)
+	memset (p, 0, n * size);
+
+    return p;
+
+}/* auto_calloc */
+
+void *auto_realloc (void *p, size_t size)
+{
+    block_t *b, *new_b;
+    size_t old_size;
+
+    if (p == NULL)
+	return auto_malloc (size);
+
+    b = (block_t *) ((char *) p - BLOCK_HEADER);
+    old_size = b->size;
+    unlink_block (b);
+    if ((new_b = (block_t *) (realloc) (b, size + BLOCK_HEADER)) == NULL) {
+	link_block (b);
+	return NULL;
+    }
+    new_b->size = size;
+    link_block (new_b);
+    vmLink->countAllocation ((ptrdiff_t) size - (ptrdiff_t) old_size);
+
+    return (char *) new_b + BLOCK_HEADER;
+
+}/* auto_realloc */
+
+void auto_free (void *p)
+{
+    block_t *b;
+
+    if (p == NULL)
+	return;
+
+    b = (block_t *) ((char *) p - BLOCK_HEADER);
+    unlink_block (b);
+    vmLink->countAllocation (-(ptrdiff_t) b->size);
+    (free) (b);
+
+}/* auto_free */
+
+/*
+ * release_memory
+ *
+ * Free everything that the Z-machine still holds, however it stopped
+ * (its thread being about to end, and its globals with it).
+ *
+ */
+
+void release_memory (void)
+{
+
+    if (story_fp)
+	fclose (story_fp);
+    story_fp = NULL;
+
+    while (blocks != NULL)
+	auto_free ((char *) blocks + BLOCK_HEADER);
+
+}/* release_memory */
+
+#endif
+
+/*
+ * mark_written
+ *
+ * Mark a range of dynamic memory in the write set, for the writes that
+ * don't go through SET_BYTE or SET_WORD (restoring, undoing and
+ * restarting).
+ *
+ */
+
+static void mark_written (zword addr, long count)
+{
+    long a;
+
+    for (a = addr; a < (long) addr + count; a++)
+	MARK_BYTE (a)
+
+}/* mark_written */
+
+/*
+ * mark_read
+ *
+ * Mark a range of dynamic memory in the read set (if reads are being
+ * recorded), for the reads that don't go through LOW_BYTE or LOW_WORD
+ * (saving).
+ *
+ */
+
+static void mark_read (zword addr, long count)
+{
+    long a;
+
+    if (read_set == NULL)
+	return;
+
+    for (a = addr; a < (long) addr + count; a++)
+	MARK_READ (a)
+
+}/* mark_read */
+
+#ifdef AUTOFROTZ
+/*
+ * set_read_set
+ *
+ * Start recording the addresses that the Z-machine reads in the given
+ * bitmap (or stop, if NULL). The object tree is thrown away, since it
+ * is left empty while reads are recorded (so that every lookup reaches
+ * the object table).
+ *
+ */
+
+void set_read_set (iu64 *words)
+{
+
+    read_set = words;
+    reset_object_tree ();
+
+}/* set_read_set */
+#endif
+
 /*
  * storeb
  *
@@ -489,6 +729,8 @@ void reset_memory (void)
 void storeb (zword addr, zbyte value)
 {
 
+    COUNT_STAT (byteWrites, 1)
+
     if (addr >= h_dynamic_size)
 	runtime_error (ERR_STORE_RANGE);
 
@@ -509,6 +751,15 @@ void storeb (zword addr, zbyte value)
 
     }
 
+    if (addr >= object_tree_lo && addr < object_tree_hi)
+	reset_object_tree ();	/* object table is modified */
+
+    if (addr >= dict_index_lo && addr < dict_index_hi)
+	reset_dictionaries ();	/* dictionary is modified */
+
+    if (addr >= text_deps_lo && addr < text_deps_hi)
+	recheck_string_cache ();	/* abbreviations may be modified */
+
     SET_BYTE (addr, value)
 
 }/* storeb */
@@ -524,6 +775,7 @@ void storew (zword addr, zword value)
 {
 
     MARK_WORD (addr);
+    COUNT_STAT (wordWrites, 1)
 
     storeb ((zword) (addr + 0), hi (value));
     storeb ((zword) (addr + 1), lo (value));
@@ -539,7 +791,7 @@ void storew (zword addr, zword value)
 
 void z_restart (void)
 {
-    vmlocal static bool first_restart = TRUE;
+    static vmlocal bool first_restart = TRUE;
 
     flush_buffer ();
 
@@ -553,14 +805,20 @@ void z_restart (void)
 
 	if (fread (zmp, 1, h_dynamic_size, story_fp) != h_dynamic_size)
 	    os_fatal ("Story file read error");
+	mark_written (0, h_dynamic_size);
 
     } else first_restart = FALSE;
 
+    reset_object_tree ();
+    reset_dictionaries ();
+    recheck_string_cache ();
+
     restart_header ();
     restart_screen ();
 
     sp = fp = stack + STACK_SIZE;
     frame_count = 0;
+    PROFILE_FRAMES (frame_count)
 
     if (h_version != V6) {
 
@@ -651,6 +909,7 @@ void z_restore (void)
 	/* Load auxilary file */
 
 	success = fread (zmp + zargs[0], 1, zargs[1], gfp);
+	mark_written (zargs[0], success);
 
 	/* Close auxilary file */
 
@@ -775,6 +1034,14 @@ void z_restore (void)
 
 finished:
 
+    if (zargc == 0 && success != 0)
+	mark_written (0, h_dynamic_size);
+
+    reset_object_tree ();
+    reset_dictionaries ();
+    recheck_string_cache ();
+    PROFILE_FRAMES (frame_count)
+
     if (h_version <= V3)
 	branch (success);
     else
@@ -884,6 +1151,7 @@ int restore_undo (void)
     /* undo possible */
 
     memcpy (zmp, prev_zmp, h_dynamic_size);
+    mark_written (0, h_dynamic_size);
     SET_PC (curr_undo->pc)
     sp = stack + STACK_SIZE - curr_undo->stack_size;
     fp = stack + curr_undo->frame_offset;
@@ -894,6 +1162,11 @@ int restore_undo (void)
 
     curr_undo = curr_undo->prev;
 
+    reset_object_tree ();
+    reset_dictionaries ();
+    recheck_string_cache ();
+    PROFILE_FRAMES (frame_count)
+
     restart_header ();
 
     return 2;
@@ -949,6 +1222,7 @@ void z_save (void)
 
 	/* Write auxilary file */
 
+	mark_read (zargs[0], zargs[1]);
 	success = fwrite (zmp + zargs[0], zargs[1], 1, gfp);
 
 	/* Close auxilary file */
@@ -970,6 +1244,8 @@ void z_save (void)
 
 	strcpy (save_name, new_name);
 
+	mark_read (0, h_dynamic_size);
+
 #ifdef AUTOFROTZ
 	if (*new_name == '\1') {
 	    /* We're making a save to a Quetzal block. */
@@ -38,14 +38,14 @@ vmlocal char script_name[MAX_FILE_NAME + 1] = DEFAULT_SCRIPT_NAME;
 vmlocal char command_name[MAX_FILE_NAME + 1] = DEFAULT_COMMAND_NAME;
 
 #ifdef __MSDOS__
-vmlocal extern char latin1_to_ibm[];
+extern vmlocal char latin1_to_ibm[];
 #endif
 
-vmlocal static int script_width = 0;
+static vmlocal int script_width = 0;
 
-vmlocal static FILE *sfp = NULL;
-vmlocal static FILE *rfp = NULL;
-vmlocal static FILE *pfp = NULL;
+static vmlocal FILE *sfp = NULL;
+static vmlocal FILE *rfp = NULL;
+static vmlocal FILE *pfp = NULL;
 
 /*
  * script_open
@@ -63,7 +63,7 @@ vmlocal static FILE *pfp = NULL;
 
 void script_open (void)
 {
-    vmlocal static bool script_valid = FALSE;
+    static vmlocal bool script_valid = FALSE;
 
     char new_name[MAX_FILE_NAME + 1];
 
@@ -258,24 +258,26 @@ typedef unsigned char zchar;
 /*** Data access macros ***/
 
 #ifdef AUTOFROTZ
-vmlocal extern autofrotz::vmlink::VmLink *vmLink;
+extern vmlocal autofrotz::vmlink::VmLink *vmLink;
+extern vmlocal iu64 *write_set;
+extern vmlocal iu64 *read_set;
 #endif
 
-#define SET_BYTE(addr,v)  { zmp[addr] = v; }
-#define LOW_BYTE(addr,v)  { v = zmp[addr]; }
+#define SET_BYTE(addr,v)  { MARK_BYTE ((addr)); zmp[addr] = v; }
+#define LOW_BYTE(addr,v)  { MARK_READ ((addr)); v = zmp[addr]; }
 #define CODE_BYTE(v)	  { v = *pcp++;    }
 
 #if defined (AMIGA)
 
-vmlocal extern zbyte *pcp;
-vmlocal extern zbyte *zmp;
+extern vmlocal zbyte *pcp;
+extern vmlocal zbyte *zmp;
 
 #define lo(v)	((zbyte *)&v)[1]
 #define hi(v)	((zbyte *)&v)[0]
 
-#define SET_WORD(addr,v)  { MARK_WORD ((addr)); zmp[addr] = hi(v); zmp[addr+1] = lo(v); }
-#define LOW_WORD(addr,v)  { hi(v) = zmp[addr]; lo(v) = zmp[addr+1]; }
-#define HIGH_WORD(addr,v) { hi(v) = zmp[addr]; lo(v) = zmp[addr+1]; }
+#define SET_WORD(addr,v)  { MARK_WORD ((addr)); MARK_BYTE ((addr)); MARK_BYTE ((addr) + 1); zmp[addr] = hi(v); zmp[addr+1] = lo(v); }
+#define LOW_WORD(addr,v)  { MARK_READ ((addr)); MARK_READ ((addr) + 1); hi(v) = zmp[addr]; lo(v) = zmp[addr+1]; }
+#define HIGH_WORD(addr,v) { MARK_HIGH_READ ((addr)); hi(v) = zmp[addr]; lo(v) = zmp[addr+1]; }
 #define CODE_WORD(v)      { hi(v) = *pcp++; lo(v) = *pcp++; }
 #define GET_PC(v)         { v = pcp - zmp; }
 #define SET_PC(v)         { pcp = zmp + v; }
@@ -286,15 +288,15 @@ vmlocal extern zbyte *zmp;
 
 #if !defined (AMIGA) && !defined (MSDOS_16BIT)
 
-vmlocal extern zbyte *pcp;
-vmlocal extern zbyte *zmp;
+extern vmlocal zbyte *pcp;
+extern vmlocal zbyte *zmp;
 
 #define lo(v)	(v & 0xff)
 #define hi(v)	(v >> 8)
 
-#define SET_WORD(addr,v)  { MARK_WORD ((addr)); zmp[addr] = hi(v); zmp[addr+1] = lo(v); }
-#define LOW_WORD(addr,v)  { v = ((zword) zmp[addr] << 8) | zmp[addr+1]; }
-#define HIGH_WORD(addr,v) { v = ((zword) zmp[addr] << 8) | zmp[addr+1]; }
+#define SET_WORD(addr,v)  { MARK_WORD ((addr)); MARK_BYTE ((addr)); MARK_BYTE ((addr) + 1); zmp[addr] = hi(v); zmp[addr+1] = lo(v); }
+#define LOW_WORD(addr,v)  { MARK_READ ((addr)); MARK_READ ((addr) + 1); v = ((zword) zmp[addr] << 8) | zmp[addr+1]; }
+#define HIGH_WORD(addr,v) { MARK_HIGH_READ ((addr)); v = ((zword) zmp[addr] << 8) | zmp[addr+1]; }
 #define CODE_WORD(v)      { v = ((zword) pcp[0] << 8) | pcp[1]; pcp += 2; }
 #define GET_PC(v)         { v = pcp - zmp; }
 #define SET_PC(v)         { pcp = zmp + v; }
@@ -303,89 +305,133 @@ vmlocal extern zbyte *zmp;
 
 #ifdef AUTOFROTZ
 #define MARK_WORD(addr)  { ::vmLink->markWord((addr)); }
+#define MARK_BYTE(addr)  { ::write_set[(addr) >> 6] |= (iu64) 1 << ((addr) & 63); }
+#define MARK_READ(addr)  { if (::read_set) ::read_set[(addr) >> 6] |= (iu64) 1 << ((addr) & 63); }
+#define MARK_HIGH_READ(addr)  { if ((addr) < 0x10000L) { MARK_READ ((addr)); MARK_READ ((addr) + 1); } }
 #else
 #define MARK_WORD(addr)
+#define MARK_BYTE(addr)
+#define MARK_READ(addr)
+#define MARK_HIGH_READ(addr)
+#endif
+
+/* Per-action statistics */
+
+#ifdef AUTOFROTZ
+#define COUNT_STAT(field,n)  { ::vmLink->getActionStats().field += (n); }
+#define MAX_STAT(field,v)    { autofrotz::vmlink::ActionStats &s_ = ::vmLink->getActionStats(); if (s_.field < (v)) s_.field = (v); }
+#else
+#define COUNT_STAT(field,n)
+#define MAX_STAT(field,v)
+#endif
+
+/* Z-code profiling (compiled in only when asked for) */
+
+#if defined (AUTOFROTZ) && defined (AUTOFROTZ_PROFILE)
+#define PROFILE_OPCODE(op)          { ::vmLink->getProfiler().countOpcode((op)); }
+#define PROFILE_EXT_OPCODE(op)      { ::vmLink->getProfiler().countExtendedOpcode((op)); }
+#define PROFILE_CALL(routine,depth) { ::vmLink->getProfiler().enterRoutine((routine), (depth)); }
+#define PROFILE_FRAMES(depth)       { ::vmLink->getProfiler().setDepth((depth)); }
+#else
+#define PROFILE_OPCODE(op)
+#define PROFILE_EXT_OPCODE(op)
+#define PROFILE_CALL(routine,depth)
+#define PROFILE_FRAMES(depth)
+#endif
+
+/* Heap accounting (so that each VM's memory can be attributed to it) */
+
+#ifdef AUTOFROTZ
+#include <stdlib.h>
+void	*auto_malloc (size_t);
+void	*auto_calloc (size_t, size_t);
+void	*auto_realloc (void *, size_t);
+void	auto_free (void *);
+#define malloc(size)     auto_malloc ((size))
+#define calloc(n,size)   auto_calloc ((n), (size))
+#define realloc(p,size)  auto_realloc ((p), (size))
+#define free(p)          auto_free ((p))
 #endif
 
 
 /*** Story file header data ***/
 
-vmlocal extern zbyte h_version;
-vmlocal extern zbyte h_config;
-vmlocal extern zword h_release;
-vmlocal extern zword h_resident_size;
-vmlocal extern zword h_start_pc;
-vmlocal extern zword h_dictionary;
-vmlocal extern zword h_objects;
-vmlocal extern zword h_globals;
-vmlocal extern zword h_dynamic_size;
-vmlocal extern zword h_flags;
-vmlocal extern zbyte h_serial[6];
-vmlocal extern zword h_abbreviations;
-vmlocal extern zword h_file_size;
-vmlocal extern zword h_checksum;
-vmlocal extern zbyte h_interpreter_number;
-vmlocal extern zbyte h_interpreter_version;
-vmlocal extern zbyte h_screen_rows;
-vmlocal extern zbyte h_screen_cols;
-vmlocal extern zword h_screen_width;
-vmlocal extern zword h_screen_height;
-vmlocal extern zbyte h_font_height;
-vmlocal extern zbyte h_font_width;
-vmlocal extern zword h_functions_offset;
-vmlocal extern zword h_strings_offset;
-vmlocal extern zbyte h_default_background;
-vmlocal extern zbyte h_default_foreground;
-vmlocal extern zword h_terminating_keys;
-vmlocal extern zword h_line_width;
-vmlocal extern zbyte h_standard_high;
-vmlocal extern zbyte h_standard_low;
-vmlocal extern zword h_alphabet;
-vmlocal extern zword h_extension_table;
-vmlocal extern zbyte h_user_name[8];
-
-vmlocal extern zword hx_table_size;
-vmlocal extern zword hx_mouse_x;
-vmlocal extern zword hx_mouse_y;
-vmlocal extern zword hx_unicode_table;
+extern vmlocal zbyte h_version;
+extern vmlocal zbyte h_config;
+extern vmlocal zword h_release;
+extern vmlocal zword h_resident_size;
+extern vmlocal zword h_start_pc;
+extern vmlocal zword h_dictionary;
+extern vmlocal zword h_objects;
+extern vmlocal zword h_globals;
+extern vmlocal zword h_dynamic_size;
+extern vmlocal zword h_flags;
+extern vmlocal zbyte h_serial[6];
+extern vmlocal zword h_abbreviations;
+extern vmlocal zword h_file_size;
+extern vmlocal zword h_checksum;
+extern vmlocal zbyte h_interpreter_number;
+extern vmlocal zbyte h_interpreter_version;
+extern vmlocal zbyte h_screen_rows;
+extern vmlocal zbyte h_screen_cols;
+extern vmlocal zword h_screen_width;
+extern vmlocal zword h_screen_height;
+extern vmlocal zbyte h_font_height;
+extern vmlocal zbyte h_font_width;
+extern vmlocal zword h_functions_offset;
+extern vmlocal zword h_strings_offset;
+extern vmlocal zbyte h_default_background;
+extern vmlocal zbyte h_default_foreground;
+extern vmlocal zword h_terminating_keys;
+extern vmlocal zword h_line_width;
+extern vmlocal zbyte h_standard_high;
+extern vmlocal zbyte h_standard_low;
+extern vmlocal zword h_alphabet;
+extern vmlocal zword h_extension_table;
+extern vmlocal zbyte h_user_name[8];
+
+extern vmlocal zword hx_table_size;
+extern vmlocal zword hx_mouse_x;
+extern vmlocal zword hx_mouse_y;
+extern vmlocal zword hx_unicode_table;
 
 /*** Various data ***/
 
-vmlocal extern const char *story_name;
+extern vmlocal const char *story_name;
 
-vmlocal extern enum story story_id;
-vmlocal extern long story_size;
+extern vmlocal enum story story_id;
+extern vmlocal long story_size;
 
-vmlocal extern zword stack[STACK_SIZE];
-vmlocal extern zword *sp;
-vmlocal extern zword *fp;
-vmlocal extern zword frame_count;
+extern vmlocal zword stack[STACK_SIZE];
+extern vmlocal zword *sp;
+extern vmlocal zword *fp;
+extern vmlocal zword frame_count;
 
-vmlocal extern zword zargs[8];
-vmlocal extern int zargc;
+extern vmlocal zword zargs[8];
+extern vmlocal int zargc;
 
-vmlocal extern bool ostream_screen;
-vmlocal extern bool ostream_script;
-vmlocal extern bool ostream_memory;
-vmlocal extern bool ostream_record;
-vmlocal extern bool istream_replay;
-vmlocal extern bool message;
+extern vmlocal bool ostream_screen;
+extern vmlocal bool ostream_script;
+extern vmlocal bool ostream_memory;
+extern vmlocal bool ostream_record;
+extern vmlocal bool istream_replay;
+extern vmlocal bool message;
 
-vmlocal extern int cwin;
-vmlocal extern int mwin;
+extern vmlocal int cwin;
+extern vmlocal int mwin;
 
-vmlocal extern int mouse_x;
-vmlocal extern int mouse_y;
+extern vmlocal int mouse_x;
+extern vmlocal int mouse_y;
 
-vmlocal extern bool enable_wrapping;
-vmlocal extern bool enable_scripting;
-vmlocal extern bool enable_scrolling;
-vmlocal extern bool enable_buffering;
+extern vmlocal bool enable_wrapping;
+extern vmlocal bool enable_scripting;
+extern vmlocal bool enable_scrolling;
+extern vmlocal bool enable_buffering;
 
 
-vmlocal extern char *option_zcode_path;	/* dg */
+extern vmlocal char *option_zcode_path;	/* dg */
 
-vmlocal extern long reserve_mem;
+extern vmlocal long reserve_mem;
 
 
 /*** Blorb stuff ***/
@@ -592,6 +638,22 @@ void 	branch (bool);
 void	storeb (zword, zbyte);
 void	storew (zword, zword);
 
+#ifdef AUTOFROTZ
+int	lower_window_top (void);
+void	memory_usage (size_t *, size_t *);
+void	release_memory (void);
+size_t	screen_memory_usage (void);
+
+/* Print operations kept from the lower window and recorded for the
+   VmLink to carry out later (0 is its own kind, for text written in
+   the meantime) */
+
+enum deferred_kind {
+    DEFERRED_CHAR = 1, DEFERRED_NEW_LINE, DEFERRED_FLUSH, DEFERRED_STRING,
+    DEFERRED_NUM, DEFERRED_TEXT_DEPS
+};
+#endif
+
 /*** Interface functions ***/
 
 void 	os_beep (int);
@@ -626,5 +688,10 @@ int  	os_string_width (const zchar *);
 void	os_init_setup (void);
 int	os_speech_output(const zchar *);
 zword	os_read_mouse(void);
+#ifdef AUTOFROTZ
+void	os_stream_char (zchar);
+void	os_stream_string (const zchar *);
+void	os_stream_new_line (void);
+#endif
 
 #include "setup.h"
@@ -24,7 +24,7 @@ vmlocal const char *optarg = NULL;
 
 int cdecl getopt (int argc, char *argv[], const char *options)
 {
-    vmlocal static int pos = 1;
+    static vmlocal int pos = 1;
 
     const char *p;
 
@@ -267,6 +267,13 @@ void z_read (void)
     extern void reset_cursor_toheight (zword win, int height);
     extern int cwin;
 
+    /*
+     * When the lower window is streamed, it never reaches the screen,
+     * so there is nothing to clear.
+     */
+    if (h_version != V6 && vmLink->isStreamingOutput ())
+	return;
+
     /*
      * This is a reasonably tacky hack to clear the screen just after
      * the user gives input. Thus, each turn's text is the only thing
@@ -42,6 +42,8 @@ extern void reset_memory (void);
 
 #ifdef AUTOFROTZ
 vmlocal autofrotz::vmlink::VmLink *vmLink = nullptr;
+vmlocal iu64 *write_set = nullptr;
+vmlocal iu64 *read_set = nullptr;
 #endif
 
 /* Story file name, id number and size */
@@ -178,8 +180,9 @@ int cdecl main (int argc, char *argv[])
 {
 
 #ifdef AUTOFROTZ
-    DPRE(!::vmLink, "a VM has already been created (and more than one is not supported)");
+    DPRE(!::vmLink, "a VM has already been created on this thread");
     ::vmLink = vmLink;
+    write_set = vmLink->getWriteSet ().getWords ();
 
     int argc = 0;
     char **argv = nullptr;
@@ -207,6 +210,12 @@ int cdecl main (int argc, char *argv[])
 
     interpret ();
 
+#ifdef AUTOFROTZ
+    /* Output left for later can't be printed once memory is gone */
+
+    vmLink->settleDeferredOutput ();
+#endif
+
     reset_memory ();
 
     os_reset_screen ();
@@ -18,6 +18,7 @@
  * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
  */
 
+#include <string.h>
 #include "frotz.h"
 
 #define MAX_OBJECT 2000
@@ -34,6 +35,45 @@
 #define O4_PROPERTY_OFFSET 12
 #define O4_SIZE 14
 
+#define T_PARENT 0
+#define T_SIBLING 1
+#define T_CHILD 2
+#define T_PREV 3
+
+/*
+ * Host-side copy of the object tree: parent, sibling and child links
+ * plus the attribute bytes, one array per field, and an index of the
+ * object whose sibling link points at each object (0 for a first
+ * child). It is built lazily from the object table, kept in step by
+ * the opcodes below and thrown away whenever the table may have been
+ * written by other means (storeb into the entries, restore, undo or
+ * restart). Objects beyond tree_count use the table directly.
+ *
+ * Alongside it, each object of the decoded table gets a lazily filled
+ * property index: for every property number, the address at which a
+ * search down the (descending) property list stops. The property's
+ * length follows from the size byte(s) found there. An object's index
+ * is stale once its generation differs from prop_gen.
+ *
+ * Both are allocated when the table is first decoded, sized for the
+ * story's version, so that threads not running a Z-machine (and VMs
+ * that never need them) do not carry them.
+ */
+
+vmlocal zword object_tree_lo = 0;
+vmlocal zword object_tree_hi = 0;
+
+static vmlocal bool tree_valid = FALSE;
+static vmlocal zword table_count = 0;
+static vmlocal zword tree_count = 0;
+static vmlocal zword tree_size = 0;
+static vmlocal zword *tree[4];
+static vmlocal zbyte (*tree_attr)[6] = NULL;
+
+static vmlocal unsigned long prop_gen = 1;
+static vmlocal unsigned long *prop_index_gen = NULL;
+static vmlocal zword (*prop_index)[64] = NULL;
+
 /*
  * object_address
  *
@@ -155,6 +195,289 @@ static zword next_property (zword prop_addr)
 
 }/* next_property */
 
+/*
+ * reset_object_tree
+ *
+ * Discard the host-side copy of the object tree and property indices.
+ *
+ */
+
+void reset_object_tree (void)
+{
+
+    tree_valid = FALSE;
+    table_count = 0;
+    tree_count = 0;
+
+    if (++prop_gen == 0) {
+	if (prop_index_gen != NULL)
+	    memset (prop_index_gen, 0, tree_size * sizeof *prop_index_gen);
+	prop_gen = 1;
+    }
+
+    object_tree_lo = 0;
+    object_tree_hi = 0;
+
+}/* reset_object_tree */
+
+/*
+ * alloc_object_tree
+ *
+ * Allocate the host-side copy of the object tree and the property
+ * indices for objects 1 to max_obj, unless that has been done already.
+ *
+ */
+
+static void alloc_object_tree (zword max_obj)
+{
+    int i;
+
+    if (tree_size != 0)
+	return;
+
+    for (i = 0; i < 4; i++)
+	if ((tree[i] = (zword *) malloc ((max_obj + 1) * sizeof (zword))) == NULL)
+	    os_fatal ("Out of memory");
+    tree_attr = (zbyte (*)[6]) malloc ((max_obj + 1) * sizeof *tree_attr);
+    prop_index_gen = (unsigned long *) calloc (max_obj + 1, sizeof *prop_index_gen);
+    prop_index = (zword (*)[64]) malloc ((max_obj + 1) * sizeof *prop_index);
+
+    if (tree_attr == NULL || prop_index_gen == NULL || prop_index == NULL)
+	os_fatal ("Out of memory");
+
+    tree_size = max_obj + 1;
+
+}/* alloc_object_tree */
+
+/*
+ * build_object_tree
+ *
+ * Decode the object table into the host-side copy of the object tree.
+ * The table is taken to end where the first property table starts.
+ *
+ */
+
+static void build_object_tree (void)
+{
+    zword obj_size = (h_version <= V3) ? O1_SIZE : O4_SIZE;
+    zword max_obj = (h_version <= V3) ? 255 : MAX_OBJECT;
+    zword limit = h_dynamic_size;
+    zword count;
+    zword obj;
+    int i;
+
+    tree_valid = TRUE;
+    table_count = 0;
+    tree_count = 0;
+
+    object_tree_lo = 0;
+    object_tree_hi = 0;
+
+#ifdef AUTOFROTZ
+    /* Reads are being recorded, so leave the tree empty */
+    if (read_set != NULL)
+	return;
+#endif
+
+    alloc_object_tree (max_obj);
+
+    for (count = 0; count < max_obj; count++) {
+
+	zword obj_addr = object_address (count + 1);
+	zword prop_addr;
+
+	if ((long) obj_addr + obj_size > limit)
+	    break;
+
+	obj = count + 1;
+
+	if (h_version <= V3) {
+
+	    zbyte link;
+
+	    for (i = 0; i < 3; i++) {
+		LOW_BYTE (obj_addr + O1_PARENT + i, link)
+		tree[T_PARENT + i][obj] = link;
+	    }
+	    LOW_WORD (obj_addr + O1_PROPERTY_OFFSET, prop_addr)
+
+	} else {
+
+	    for (i = 0; i < 3; i++)
+		LOW_WORD (obj_addr + O4_PARENT + 2 * i, tree[T_PARENT + i][obj])
+	    LOW_WORD (obj_addr + O4_PROPERTY_OFFSET, prop_addr)
+
+	}
+
+	for (i = 0; i < 6; i++)
+	    if (i < ((h_version <= V3) ? 4 : 6))
+		LOW_BYTE (obj_addr + i, tree_attr[obj][i])
+	    else
+		tree_attr[obj][i] = 0;
+
+	tree[T_PREV][obj] = 0;
+
+	if (prop_addr < limit)
+	    limit = prop_addr;
+
+    }
+
+    table_count = count;
+
+    if (count != 0) {
+	object_tree_lo = object_address (1);
+	object_tree_hi = object_tree_lo + count * obj_size;
+    }
+
+    /* Give up on trees whose links lead outside the table */
+
+    for (obj = 1; obj <= count; obj++)
+	for (i = T_PARENT; i <= T_CHILD; i++)
+	    if (tree[i][obj] > count)
+		return;
+
+    for (obj = 1; obj <= count; obj++)
+	if (tree[T_SIBLING][obj] != 0)
+	    tree[T_PREV][tree[T_SIBLING][obj]] = obj;
+
+    tree_count = count;
+
+}/* build_object_tree */
+
+/*
+ * in_object_tree
+ *
+ * Return true if the object is covered by the host-side copy of the
+ * object tree.
+ *
+ */
+
+static bool in_object_tree (zword obj)
+{
+
+    if (!tree_valid)
+	build_object_tree ();
+
+    return obj != 0 && obj <= tree_count;
+
+}/* in_object_tree */
+
+/*
+ * set_object_link
+ *
+ * Set the parent, sibling or child link of an object in both the object
+ * table and the host-side copy of the object tree.
+ *
+ */
+
+static void set_object_link (zword obj, int link, zword value)
+{
+    zword obj_addr = object_address (obj);
+
+    if (h_version <= V3) {
+
+	zbyte v = value;
+
+	obj_addr += O1_PARENT + link;
+	SET_BYTE (obj_addr, v)
+
+    } else {
+
+	obj_addr += O4_PARENT + 2 * link;
+	SET_WORD (obj_addr, value)
+
+    }
+
+    tree[link][obj] = value;
+
+}/* set_object_link */
+
+/*
+ * set_object_attr_byte
+ *
+ * Store an attribute byte of an object (already written to the object
+ * table) into the host-side copy of the object tree.
+ *
+ */
+
+static void set_object_attr_byte (zword obj, zword n, zbyte value)
+{
+
+    if (n >= ((h_version <= V3) ? 4 : 6))	/* hit the links or beyond */
+	reset_object_tree ();
+    else if (in_object_tree (obj))
+	tree_attr[obj][n] = value;
+
+}/* set_object_attr_byte */
+
+/*
+ * find_property
+ *
+ * Return the address at which a search down an object's property list
+ * for the given property stops: the property itself if it exists.
+ *
+ */
+
+static zword find_property (zword obj, zword prop)
+{
+    zword prop_addr;
+    zbyte value;
+    zbyte mask;
+
+    /* Property id is in bottom five (six) bits */
+
+    mask = (h_version <= V3) ? 0x1f : 0x3f;
+
+    if (!tree_valid)
+	build_object_tree ();
+
+    if (obj != 0 && obj <= table_count) {
+
+	zword *index = prop_index[obj];
+
+	if (prop_index_gen[obj] != prop_gen) {
+
+	    zword lowest = 64;
+
+	    /* Every property number from the current one up to (but not
+	       including) the lowest so far stops the search here */
+
+	    prop_addr = first_property (obj);
+
+	    for (;;) {
+		LOW_BYTE (prop_addr, value)
+		while (lowest > (value & mask))
+		    index[--lowest] = prop_addr;
+		if ((value & mask) == 0)
+		    break;
+		prop_addr = next_property (prop_addr);
+	    }
+
+	    prop_index_gen[obj] = prop_gen;
+
+	}
+
+	return (prop < 64) ? index[prop] : index[63];
+
+    }
+
+    /* Load address of first property */
+
+    prop_addr = first_property (obj);
+
+    /* Scan down the property list */
+
+    for (;;) {
+	LOW_BYTE (prop_addr, value)
+	if ((value & mask) <= prop)
+	    break;
+	prop_addr = next_property (prop_addr);
+    }
+
+    return prop_addr;
+
+}/* find_property */
+
 /*
  * unlink_object
  *
@@ -173,6 +496,40 @@ static void unlink_object (zword object)
 	return;
     }
 
+    if (in_object_tree (object)) {
+
+	zword parent = tree[T_PARENT][object];
+	zword younger_sibling = tree[T_PREV][object];
+	zword older_sibling = tree[T_SIBLING][object];
+
+	/* Return if no parent */
+
+	if (!parent)
+	    return;
+
+	/* Clear the object's links and bridge the gap it leaves in the
+	   list of siblings */
+
+	set_object_link (object, T_PARENT, 0);
+	set_object_link (object, T_SIBLING, 0);
+
+	if (younger_sibling == 0)
+	    set_object_link (parent, T_CHILD, older_sibling);
+	else
+	    set_object_link (younger_sibling, T_SIBLING, older_sibling);
+
+	if (older_sibling != 0)
+	    tree[T_PREV][older_sibling] = younger_sibling;
+	tree[T_PREV][object] = 0;
+
+	return;
+
+    }
+
+    /* The object table is written directly from here on */
+
+    reset_object_tree ();
+
     obj_addr = object_address (object);
 
     if (h_version <= V3) {
@@ -303,6 +660,8 @@ void z_clear_attr (void)
     value &= ~(0x80 >> (zargs[1] & 7));
     SET_BYTE (obj_addr, value)
 
+    set_object_attr_byte (zargs[0], zargs[1] / 8, value);
+
 }/* z_clear_attr */
 
 /*
@@ -334,6 +693,11 @@ void z_jin (void)
 	return;
     }
 
+    if (in_object_tree (zargs[0])) {
+	branch (tree[T_PARENT][zargs[0]] == zargs[1]);
+	return;
+    }
+
     obj_addr = object_address (zargs[0]);
 
     if (h_version <= V3) {
@@ -393,6 +757,16 @@ void z_get_child (void)
 	return;
     }
 
+    if (in_object_tree (zargs[0])) {
+
+	zword child = tree[T_CHILD][zargs[0]];
+
+	store (child);
+	branch (child);
+	return;
+
+    }
+
     obj_addr = object_address (zargs[0]);
 
     if (h_version <= V3) {
@@ -504,6 +878,11 @@ void z_get_parent (void)
 	return;
     }
 
+    if (in_object_tree (zargs[0])) {
+	store (tree[T_PARENT][zargs[0]]);
+	return;
+    }
+
     obj_addr = object_address (zargs[0]);
 
     if (h_version <= V3) {
@@ -562,18 +941,10 @@ void z_get_prop (void)
 
     mask = (h_version <= V3) ? 0x1f : 0x3f;
 
-    /* Load address of first property */
-
-    prop_addr = first_property (zargs[0]);
-
-    /* Scan down the property list */
+    /* Find the property */
 
-    for (;;) {
-	LOW_BYTE (prop_addr, value)
-	if ((value & mask) <= zargs[1])
-	    break;
-	prop_addr = next_property (prop_addr);
-    }
+    prop_addr = find_property (zargs[0], zargs[1]);
+    LOW_BYTE (prop_addr, value)
 
     if ((value & mask) == zargs[1]) {	/* property found */
 
@@ -631,18 +1002,10 @@ void z_get_prop_addr (void)
 
     mask = (h_version <= V3) ? 0x1f : 0x3f;
 
-    /* Load address of first property */
-
-    prop_addr = first_property (zargs[0]);
-
-    /* Scan down the property list */
+    /* Find the property */
 
-    for (;;) {
-	LOW_BYTE (prop_addr, value)
-	if ((value & mask) <= zargs[1])
-	    break;
-	prop_addr = next_property (prop_addr);
-    }
+    prop_addr = find_property (zargs[0], zargs[1]);
+    LOW_BYTE (prop_addr, value)
 
     /* Calculate the property address or return zero */
 
@@ -711,6 +1074,16 @@ void z_get_sibling (void)
 	return;
     }
 
+    if (in_object_tree (zargs[0])) {
+
+	zword sibling = tree[T_SIBLING][zargs[0]];
+
+	store (sibling);
+	branch (sibling);
+	return;
+
+    }
+
     obj_addr = object_address (zargs[0]);
 
     if (h_version <= V3) {
@@ -781,6 +1154,30 @@ void z_insert_obj (void)
 	return;
     }
 
+    if (in_object_tree (obj1) && in_object_tree (obj2)) {
+
+	zword child;
+
+	/* Remove object 1 from current parent */
+
+	unlink_object (obj1);
+
+	/* Make object 1 first child of object 2 */
+
+	child = tree[T_CHILD][obj2];
+
+	set_object_link (obj1, T_PARENT, obj2);
+	set_object_link (obj2, T_CHILD, obj1);
+	set_object_link (obj1, T_SIBLING, child);
+
+	tree[T_PREV][obj1] = 0;
+	if (child != 0)
+	    tree[T_PREV][child] = obj1;
+
+	return;
+
+    }
+
     /* Get addresses of both objects */
 
     obj1_addr = object_address (obj1);
@@ -790,6 +1187,10 @@ void z_insert_obj (void)
 
     unlink_object (obj1);
 
+    /* The object table is written directly from here on */
+
+    reset_object_tree ();
+
     /* Make object 1 first child of object 2 */
 
     if (h_version <= V3) {
@@ -844,18 +1245,10 @@ void z_put_prop (void)
 
     mask = (h_version <= V3) ? 0x1f : 0x3f;
 
-    /* Load address of first property */
+    /* Find the property */
 
-    prop_addr = first_property (zargs[0]);
-
-    /* Scan down the property list */
-
-    for (;;) {
-	LOW_BYTE (prop_addr, value)
-	if ((value & mask) <= zargs[1])
-	    break;
-	prop_addr = next_property (prop_addr);
-    }
+    prop_addr = find_property (zargs[0], zargs[1]);
+    LOW_BYTE (prop_addr, value)
 
     /* Exit if the property does not exist */
 
@@ -953,6 +1346,8 @@ void z_set_attr (void)
 
     SET_BYTE (obj_addr, value)
 
+    set_object_attr_byte (zargs[0], zargs[1] / 8, value);
+
 }/* z_set_attr */
 
 /*
@@ -988,6 +1383,11 @@ void z_test_attr (void)
 	return;
     }
 
+    if (zargs[1] <= ((h_version <= V3) ? 31 : 47) && in_object_tree (zargs[0])) {
+	branch (tree_attr[zargs[0]][zargs[1] / 8] & (0x80 >> (zargs[1] & 7)));
+	return;
+    }
+
     /* Get attribute address */
 
     obj_addr = object_address (zargs[0]) + zargs[1] / 8;
@@ -28,7 +28,7 @@
 vmlocal zword zargs[8];
 vmlocal int zargc;
 
-vmlocal static int finished = 0;
+static vmlocal int finished = 0;
 
 static void __extended__ (void);
 static void __illegal__ (void);
@@ -262,8 +262,14 @@ void interpret (void)
 
 	zbyte opcode;
 
+#ifdef AUTOFROTZ
+	vmLink->countInstruction ();
+#endif
+
 	CODE_BYTE (opcode)
 
+	PROFILE_OPCODE (opcode)
+
 	zargc = 0;
 
 	if (opcode < 0x80) {			/* 2OP opcodes */
@@ -357,6 +363,8 @@ void call (zword routine, int argc, zword *args, int ct)
     if (pc >= story_size)
 	runtime_error (ERR_ILL_CALL_ADDR);
 
+    PROFILE_CALL (pc, frame_count)
+
     SET_PC (pc)
 
     /* Initialise local variables */
@@ -382,6 +390,9 @@ void call (zword routine, int argc, zword *args, int ct)
 
     }
 
+    COUNT_STAT (calls, 1)
+    MAX_STAT (maxStackDepth, (iu32) (stack + STACK_SIZE - sp))
+
     /* Start main loop for direct calls */
 
     if (ct == 2)
@@ -411,6 +422,7 @@ void ret (zword value)
 
     ct = *sp++ >> (f_setup.save_quetzal ? 12 : 8);
     frame_count--;
+    PROFILE_FRAMES (frame_count)
     fp = stack + 1 + *sp++;
     pc = *sp++;
     pc = ((long) *sp++ << 9) | pc;
@@ -572,6 +584,8 @@ static void __extended__ (void)
     CODE_BYTE (opcode)
     CODE_BYTE (specifier)
 
+    PROFILE_EXT_OPCODE (opcode)
+
     load_all_operands (specifier);
 
     if (opcode < 0x1d)			/* extended opcodes from 0x1d on */
@@ -20,10 +20,10 @@
 
 #include "frotz.h"
 
-vmlocal static long A = 1;
+static vmlocal long A = 1;
 
-vmlocal static int interval = 0;
-vmlocal static int counter = 0;
+static vmlocal int interval = 0;
+static vmlocal int counter = 0;
 
 /*
  * seed_random
@@ -113,12 +113,19 @@ void z_random ()
     if ((short) zargs[0] <= 0) {	/* set random seed */
 
 	seed_random (- (short) zargs[0]);
+#ifdef AUTOFROTZ
+	vmLink->logRandomSeed (- (short) zargs[0]);
+#endif
 	store (0);
 
     } else {				/* generate random number */
 
 	zword result;
 
+#ifdef AUTOFROTZ
+	vmLink->markRandomRead ();
+#endif
+
 	if (interval != 0) {		/* ...in special mode */
 	    result = counter++;
 	    if (counter == interval) counter = 0;
@@ -127,6 +134,9 @@ void z_random ()
 	    result = (A >> 16) & 0x7fff;
 	}
 
+#ifdef AUTOFROTZ
+	vmLink->logRandomNumber ((zword) (result % zargs[0] + 1));
+#endif
 	store ((zword) (result % zargs[0] + 1));
 
     }
@@ -18,15 +18,16 @@
  * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
  */
 
+#include <string.h>
 #include "frotz.h"
 
 #define MAX_NESTING 16
 
 extern zword get_max_width (zword);
 
-vmlocal static int depth = -1;
+static vmlocal int depth = -1;
 
-vmlocal static struct {
+static vmlocal struct {
     zword xsize;
     zword table;
     zword width;
@@ -170,3 +171,56 @@ void memory_close (void)
     }
 
 }/* memory_close */
+
+#ifdef AUTOFROTZ
+
+/*
+ * redirect_statesize
+ *
+ * Returns the number of unsigned chars needed to store the state of
+ * output redirection.
+ *
+ */
+
+unsigned int redirect_statesize (void)
+{
+
+    return sizeof (depth) + sizeof (redirect);
+
+}/* redirect_statesize */
+
+/*
+ * redirect_savestate
+ *
+ * Saves the state of output redirection to the given buffer (of size
+ * at least redirect_statesize()). Unused levels are saved as zeros.
+ *
+ */
+
+void redirect_savestate (unsigned char *b)
+{
+    int n = (depth < MAX_NESTING) ? depth + 1 : MAX_NESTING;
+
+    core::set(b, depth); b += sizeof (depth);
+    memset (b, 0, sizeof (redirect));
+    memcpy (b, redirect, n * sizeof (redirect[0]));
+
+}/* redirect_savestate */
+
+/*
+ * redirect_restorestate
+ *
+ * Restores the state of output redirection from the given buffer
+ * (filled with redirect_savestate() from this process).
+ *
+ */
+
+void redirect_restorestate (unsigned char *b)
+{
+
+    depth = core::get<decltype(depth)>(b); b += sizeof (depth);
+    memcpy (redirect, b, sizeof (redirect));
+
+}/* redirect_restorestate */
+
+#endif
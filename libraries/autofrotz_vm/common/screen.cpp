@@ -18,6 +18,7 @@
  * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
  */
 
+#include <string.h>
 #include "frotz.h"
 
 extern void set_header_extension (int, zword);
@@ -39,17 +40,17 @@ static const struct {
     {   UNKNOWN,  0,   0,   0 }
 };
 
-vmlocal static int font_height = 1;
-vmlocal static int font_width = 1;
+static vmlocal int font_height = 1;
+static vmlocal int font_width = 1;
 
-vmlocal static bool input_redraw = FALSE;
-vmlocal static bool more_prompts = TRUE;
-vmlocal static bool discarding = FALSE;
-vmlocal static bool cursor = TRUE;
+static vmlocal bool input_redraw = FALSE;
+static vmlocal bool more_prompts = TRUE;
+static vmlocal bool discarding = FALSE;
+static vmlocal bool cursor = TRUE;
 
-vmlocal static int input_window = 0;
+static vmlocal int input_window = 0;
 
-vmlocal static struct {
+static vmlocal struct {
     zword y_pos;
     zword x_pos;
     zword y_size;
@@ -69,6 +70,61 @@ vmlocal static struct {
 } wp[8], *cwp;
 
 
+#ifdef AUTOFROTZ
+
+/*
+ * streaming
+ *
+ * Return true if text in the current window is to be streamed straight
+ * to the output (or, for the status line, captured), bypassing the
+ * screen.
+ *
+ */
+
+static bool streaming (void)
+{
+
+    if (h_version == V6)
+	return FALSE;
+
+    return (cwin == 0 && vmLink->isStreamingOutput ())
+	|| (cwin == 7 && vmLink->isCapturingStatus ());
+
+}/* streaming */
+
+/*
+ * lower_window_top
+ *
+ * Return the screen row (counting from 0) at which the lower window
+ * starts; everything above it belongs to the status line or the upper
+ * window.
+ *
+ */
+
+int lower_window_top (void)
+{
+
+    return wp[0].y_pos - 1;
+
+}/* lower_window_top */
+
+/*
+ * select_lower_window
+ *
+ * Make the lower window the current one without any of the effects of
+ * set_window (for carrying out print operations recorded for later).
+ *
+ */
+
+void select_lower_window (void)
+{
+
+    cwin = 0; cwp = wp;
+
+}/* select_lower_window */
+
+#endif
+
 /*
  * winarg0
  *
@@ -250,6 +306,23 @@ void screen_new_line (void)
     if (input_window == cwin)
 	input_redraw = TRUE;
 
+#ifdef AUTOFROTZ
+    /* A stream has neither a bottom line nor more prompts */
+
+    if (streaming ()) {
+
+	cwp->x_cursor = cwp->left + 1;
+
+	os_stream_new_line ();
+
+	if (h_interpreter_number == INTERP_MSDOS && story_id == ZORK_ZERO && h_release == 393)
+	    countdown ();
+
+	return;
+
+    }
+#endif
+
     /* If the cursor has not reached the bottom line, then move it to
        the next line; otherwise scroll the window or reset the cursor
        to the top left. */
@@ -328,6 +401,11 @@ void screen_char (zchar c)
 
     }
 
+#ifdef AUTOFROTZ
+    if (streaming ())
+	{ os_stream_char (c); cwp->x_cursor += width; return; }
+#endif
+
     os_display_char (c); cwp->x_cursor += width;
 
 }/* screen_char */
@@ -384,6 +462,11 @@ void screen_word (const zchar *s)
 
     }
 
+#ifdef AUTOFROTZ
+    if (streaming ())
+	{ os_stream_string (s); cwp->x_cursor += width; return; }
+#endif
+
     os_display_string (s); cwp->x_cursor += width;
 
 }/* screen_word */
@@ -402,6 +485,11 @@ void screen_write_input (const zchar *buf, zchar key)
     if (units_left () < (width = os_string_width (buf)))
 	screen_new_line ();
 
+#ifdef AUTOFROTZ
+    if (streaming ())
+	os_stream_string (buf);
+    else
+#endif
     os_display_string (buf); cwp->x_cursor += width;
 
     if (key == ZC_RETURN)
@@ -617,6 +705,11 @@ void erase_window (zword win)
     if (h_version == V6 && win != cwin && h_interpreter_number != INTERP_AMIGA)
 	os_set_colour (lo (wp[win].colour), hi (wp[win].colour));
 
+#ifdef AUTOFROTZ
+    /* There is nothing on the screen to erase for a streamed window */
+
+    if (win != 0 || h_version == V6 || !vmLink->isStreamingOutput ())
+#endif
     os_erase_area (y,
 		   x,
 		   y + wp[win].y_size - 1,
@@ -1617,6 +1710,30 @@ void z_show_status (void)
     addr += 2;
     LOW_WORD (addr, global2)
 
+#ifdef AUTOFROTZ
+    /* Hand the fields over as they are rather than drawing them; only the
+       object description needs to be printed (and is captured) */
+
+    if (vmLink->isCapturingStatus ()) {
+
+	set_window (7);
+
+	vmLink->beginStatusLine ();
+	print_object (global0);
+	flush_buffer ();
+
+	if (h_config & CONFIG_TIME)
+	    vmLink->setStatusTime (global1, global2);
+	else
+	    vmLink->setStatusScore ((short) global1, global2);
+
+	set_window (0);
+
+	return;
+
+    }
+#endif
+
     /* Frotz uses window 7 for the status line. Don't forget to select
        reverse and fixed width text style */
 
@@ -1759,3 +1876,85 @@ void z_window_style (void)
 	update_attributes ();
 
 }/* z_window_style */
+
+#ifdef AUTOFROTZ
+
+/*
+ * screen_statesize
+ *
+ * Returns the number of unsigned chars needed to store the state of
+ * the windows.
+ *
+ */
+
+unsigned int screen_statesize (void)
+{
+
+    return sizeof (font_height) + sizeof (font_width)
+	+ sizeof (input_redraw) + sizeof (more_prompts) + sizeof (discarding)
+	+ sizeof (cursor) + sizeof (input_window) + sizeof (wp)
+	+ sizeof (cwin) + sizeof (mwin) + sizeof (enable_wrapping)
+	+ sizeof (enable_scripting) + sizeof (enable_scrolling)
+	+ sizeof (enable_buffering);
+
+}/* screen_statesize */
+
+/*
+ * screen_savestate
+ *
+ * Saves the state of the windows to the given buffer (of size at
+ * least screen_statesize()).
+ *
+ */
+
+void screen_savestate (unsigned char *b)
+{
+
+    core::set(b, font_height); b += sizeof (font_height);
+    core::set(b, font_width); b += sizeof (font_width);
+    core::set(b, input_redraw); b += sizeof (input_redraw);
+    core::set(b, more_prompts); b += sizeof (more_prompts);
+    core::set(b, discarding); b += sizeof (discarding);
+    core::set(b, cursor); b += sizeof (cursor);
+    core::set(b, input_window); b += sizeof (input_window);
+    memcpy (b, wp, sizeof (wp)); b += sizeof (wp);
+    core::set(b, cwin); b += sizeof (cwin);
+    core::set(b, mwin); b += sizeof (mwin);
+    core::set(b, enable_wrapping); b += sizeof (enable_wrapping);
+    core::set(b, enable_scripting); b += sizeof (enable_scripting);
+    core::set(b, enable_scrolling); b += sizeof (enable_scrolling);
+    core::set(b, enable_buffering); b += sizeof (enable_buffering);
+
+}/* screen_savestate */
+
+/*
+ * screen_restorestate
+ *
+ * Restores the state of the windows from the given buffer (filled
+ * with screen_savestate() from this process).
+ *
+ */
+
+void screen_restorestate (unsigned char *b)
+{
+
+    font_height = core::get<decltype(font_height)>(b); b += sizeof (font_height);
+    font_width = core::get<decltype(font_width)>(b); b += sizeof (font_width);
+    input_redraw = core::get<decltype(input_redraw)>(b); b += sizeof (input_redraw);
+    more_prompts = core::get<decltype(more_prompts)>(b); b += sizeof (more_prompts);
+    discarding = core::get<decltype(discarding)>(b); b += sizeof (discarding);
+    cursor = core::get<decltype(cursor)>(b); b += sizeof (cursor);
+    input_window = core::get<decltype(input_window)>(b); b += sizeof (input_window);
+    memcpy (wp, b, sizeof (wp)); b += sizeof (wp);
+    cwin = core::get<decltype(cwin)>(b); b += sizeof (cwin);
+    mwin = core::get<decltype(mwin)>(b); b += sizeof (mwin);
+    enable_wrapping = core::get<decltype(enable_wrapping)>(b); b += sizeof (enable_wrapping);
+    enable_scripting = core::get<decltype(enable_scripting)>(b); b += sizeof (enable_scripting);
+    enable_scrolling = core::get<decltype(enable_scrolling)>(b); b += sizeof (enable_scrolling);
+    enable_buffering = core::get<decltype(enable_buffering)>(b); b += sizeof (enable_buffering);
+
+    cwp = wp + cwin;
+
+}/* screen_restorestate */
+
+#endif
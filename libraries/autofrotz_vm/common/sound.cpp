@@ -31,13 +31,13 @@
 
 extern int direct_call (zword);
 
-vmlocal static zword routine = 0;
+static vmlocal zword routine = 0;
 
-vmlocal static int next_sample = 0;
-vmlocal static int next_volume = 0;
+static vmlocal int next_sample = 0;
+static vmlocal int next_volume = 0;
 
-vmlocal static bool locked = FALSE;
-vmlocal static bool playing = FALSE;
+static vmlocal bool locked = FALSE;
+static vmlocal bool playing = FALSE;
 
 /*
  * init_sound
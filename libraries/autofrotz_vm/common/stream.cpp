@@ -59,6 +59,24 @@ extern zchar console_read_input (int, zchar *, zword, bool);
 
 extern int direct_call (zword);
 
+#ifdef AUTOFROTZ
+extern unsigned int buffer_statesize (void);
+extern void buffer_savestate (unsigned char *);
+extern void buffer_restorestate (unsigned char *);
+extern unsigned int screen_statesize (void);
+extern void screen_savestate (unsigned char *);
+extern void screen_restorestate (unsigned char *);
+extern unsigned int dumb_output_statesize (void);
+extern void dumb_output_savestate (unsigned char *);
+extern void dumb_output_restorestate (unsigned char *);
+extern void select_lower_window (void);
+extern void print_deferred_text (long);
+extern void restore_deferred_text_deps (const zbyte *);
+extern void end_deferred_text (void);
+
+static vmlocal unsigned char *deferred_state = NULL;
+#endif
+
 /*
  * stream_mssg_on
  *
@@ -138,6 +156,144 @@ void z_output_stream (void)
 
 }/* z_output_stream */
 
+#ifdef AUTOFROTZ
+
+/*
+ * stream_silenced
+ *
+ * Return true if text printed now would only reach the lower window
+ * of the screen and the VmLink wants such text dropped (so that an
+ * action that only needs its resulting state pays nothing for the
+ * buffering, wrapping and screen work). Text in other windows is kept,
+ * since the Z-machine can see where it leaves the cursor.
+ *
+ */
+
+bool stream_silenced (void)
+{
+
+    return vmLink->isSilent () && cwin == 0 && h_version != V6
+	&& !(ostream_memory && !message)
+	&& !(ostream_script && enable_scripting);
+
+}/* stream_silenced */
+
+/*
+ * stream_defer
+ *
+ * Record a print operation that stream_silenced keeps from the lower
+ * window, if the VmLink wants it carried out later (by print_deferred)
+ * and the text would have reached the screen.
+ *
+ */
+
+void stream_defer (int kind, long value)
+{
+
+    if (vmLink->isDeferringOutput () && ostream_screen)
+	vmLink->deferOutput (kind, value);
+
+}/* stream_defer */
+
+/*
+ * begin_deferred_output
+ *
+ * Get ready to carry out recorded print operations: the lower window
+ * is selected, all of its text goes to the screen and the state that
+ * printing changes is kept, to be put back by end_deferred_output (so
+ * the Z-machine is left as if the operations were never carried out).
+ *
+ */
+
+void begin_deferred_output (void)
+{
+    unsigned char *b;
+
+    deferred_state = (unsigned char *) malloc (buffer_statesize () + screen_statesize ()
+	+ dumb_output_statesize () + 4 * sizeof (bool));
+    if (deferred_state == NULL)
+	os_fatal ("Out of memory");
+
+    b = deferred_state;
+    buffer_savestate (b); b += buffer_statesize ();
+    screen_savestate (b); b += screen_statesize ();
+    dumb_output_savestate (b); b += dumb_output_statesize ();
+    core::set(b, ostream_screen); b += sizeof (bool);
+    core::set(b, ostream_script); b += sizeof (bool);
+    core::set(b, ostream_memory); b += sizeof (bool);
+    core::set(b, message); b += sizeof (bool);
+
+    select_lower_window ();
+    ostream_screen = TRUE;
+    ostream_script = FALSE;
+    ostream_memory = FALSE;
+    message = FALSE;
+
+}/* begin_deferred_output */
+
+/*
+ * print_deferred
+ *
+ * Carry out a print operation recorded by stream_defer.
+ *
+ */
+
+void print_deferred (int kind, long value)
+{
+
+    switch (kind) {
+
+    case DEFERRED_CHAR:
+	print_char ((zchar) value);
+	break;
+    case DEFERRED_NEW_LINE:
+	new_line ();
+	break;
+    case DEFERRED_FLUSH:
+	flush_buffer ();
+	break;
+    case DEFERRED_STRING:
+	print_deferred_text (value);
+	break;
+    case DEFERRED_NUM:
+	print_num ((zword) value);
+	break;
+    case DEFERRED_TEXT_DEPS:
+	restore_deferred_text_deps (vmLink->getDeferredBytes (value));
+	break;
+
+    }
+
+}/* print_deferred */
+
+/*
+ * end_deferred_output
+ *
+ * Put back the state kept by begin_deferred_output.
+ *
+ */
+
+void end_deferred_output (void)
+{
+    unsigned char *b = deferred_state;
+
+    end_deferred_text ();
+
+    buffer_restorestate (b); b += buffer_statesize ();
+    screen_restorestate (b); b += screen_statesize ();
+    dumb_output_restorestate (b); b += dumb_output_statesize ();
+    ostream_screen = core::get<bool>(b); b += sizeof (bool);
+    ostream_script = core::get<bool>(b); b += sizeof (bool);
+    ostream_memory = core::get<bool>(b); b += sizeof (bool);
+    message = core::get<bool>(b); b += sizeof (bool);
+
+    free (deferred_state);
+    deferred_state = NULL;
+
+}/* end_deferred_output */
+
+#endif
+
 /*
  * stream_char
  *
@@ -18,16 +18,86 @@
  * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
  */
 
+#include <stdlib.h>
+#include <string.h>
 #include "frotz.h"
 
+#define DICT_INDICES 4
+
+#define STRING_CACHE_SIZE 8192		/* must be a power of two */
+#define STRING_POOL_MAX 0x100000L
+#define STRING_NEW_LINE 0x100
+
 enum string_type {
     LOW_STRING, ABBREVIATION, HIGH_STRING, EMBEDDED_STRING, VOCABULARY
 };
 
 extern zword object_name (zword);
+#ifdef AUTOFROTZ
+extern bool stream_silenced (void);
+extern void stream_defer (int, long);
+#endif
+
+static vmlocal zchar decoded[10];
+static vmlocal zword encoded[3];
+
+/*
+ * Decoded dictionaries, most recently built last. For each one there
+ * is a bitmap of its word separators and, unless a binary search might
+ * disagree with it, a hash table from encoded words to entry addresses.
+ * Indices of dictionaries in dynamic memory are discarded when storeb
+ * writes into dict_index_lo..dict_index_hi.
+ */
+
+typedef struct {
+    zword dct;
+    zbyte separators[32];
+    bool hashed;
+    unsigned long hash_mask;
+    zword *hash_table;
+} dict_index_t;
+
+vmlocal zword dict_index_lo = 0;
+vmlocal zword dict_index_hi = 0;
+
+static vmlocal dict_index_t dict_index[DICT_INDICES];
+static vmlocal int dict_index_count = 0;
+
+/*
+ * Decoded strings from static and high memory, keyed by byte address.
+ * The decoded text lives in a pool of characters and STRING_NEW_LINE
+ * markers. Decoding can also depend on the abbreviations, alphabet and
+ * Unicode tables (and the abbreviations themselves); the parts of those
+ * in dynamic memory are snapshotted as text_deps_lo..text_deps_hi and
+ * compared again after storeb writes into them or memory is restored.
+ * Nothing is added or discarded while cached text is being printed.
+ * The table itself is allocated when the cache is first cleared.
+ */
 
-vmlocal static zchar decoded[10];
-vmlocal static zword encoded[3];
+typedef struct {
+    long addr;
+    zword words;
+    long start;
+    long length;
+} string_cache_t;
+
+vmlocal zword text_deps_lo = 0;
+vmlocal zword text_deps_hi = 0;
+
+static vmlocal string_cache_t *string_cache = NULL;
+static vmlocal int string_cache_count = 0;
+static vmlocal zword *string_pool = NULL;
+static vmlocal long string_pool_size = 0;
+static vmlocal long string_pool_length = 0;
+static vmlocal bool string_recording = FALSE;
+static vmlocal int string_cache_busy = 0;
+static vmlocal bool text_deps_known = FALSE;
+static vmlocal bool text_deps_checked = FALSE;
+static vmlocal zbyte *text_deps = NULL;
+#ifdef AUTOFROTZ
+static vmlocal bool text_deps_deferred = FALSE;
+static vmlocal zbyte *deferred_memory = NULL;
+#endif
 
 /* 
  * According to Matteo De Luigi <matteo.de.luigi@libero.it>, 
@@ -354,6 +424,463 @@ void z_encode_text (void)
 
 }/* z_encode_text */
 
+/*
+ * recheck_string_cache
+ *
+ * Make sure that the tables that cached strings were decoded with are
+ * compared again before the cache is next used.
+ *
+ */
+
+void recheck_string_cache (void)
+{
+
+    text_deps_checked = FALSE;
+#ifdef AUTOFROTZ
+    text_deps_deferred = FALSE;
+#endif
+
+}/* recheck_string_cache */
+
+/*
+ * add_text_dep
+ *
+ * Widen the range of dynamic memory that decoding depends on.
+ *
+ */
+
+static void add_text_dep (long addr, long length, long *lo, long *hi)
+{
+
+    if (addr >= h_dynamic_size)
+	return;
+
+    if (addr + length > h_dynamic_size)
+	length = h_dynamic_size - addr;
+
+    if (addr < *lo)
+	*lo = addr;
+    if (addr + length > *hi)
+	*hi = addr + length;
+
+}/* add_text_dep */
+
+/*
+ * find_text_deps
+ *
+ * Snapshot the parts of dynamic memory that decoding depends on.
+ *
+ */
+
+static void find_text_deps (void)
+{
+    long lo = h_dynamic_size;
+    long hi = 0;
+    int count = (h_version == V1) ? 0 : (h_version == V2) ? 32 : 96;
+    int i;
+
+    if (h_abbreviations != 0) {
+
+	add_text_dep (h_abbreviations, 2 * count, &lo, &hi);
+
+	for (i = 0; i < count; i++) {
+
+	    zword ptr_addr = h_abbreviations + 2 * i;
+	    zword abbr_addr;
+	    zword code;
+	    long byte_addr;
+
+	    LOW_WORD (ptr_addr, abbr_addr)
+	    byte_addr = (long) abbr_addr << 1;
+
+	    if (byte_addr >= h_dynamic_size)
+		continue;
+
+	    ptr_addr = byte_addr;
+	    do {
+		HIGH_WORD (byte_addr, code)
+		byte_addr += 2;
+	    } while (!(code & 0x8000) && byte_addr < h_dynamic_size);
+
+	    add_text_dep (ptr_addr, byte_addr - ptr_addr, &lo, &hi);
+
+	}
+
+    }
+
+    if (h_alphabet != 0)
+	add_text_dep (h_alphabet, 78, &lo, &hi);
+
+    if (hx_unicode_table != 0) {
+
+	zbyte N;
+
+	LOW_BYTE (hx_unicode_table, N)
+	add_text_dep (hx_unicode_table, 1 + 2 * N, &lo, &hi);
+
+    }
+
+    if (lo >= hi)
+	lo = hi = 0;
+
+    text_deps_lo = lo;
+    text_deps_hi = hi;
+
+    free (text_deps);
+    text_deps = (zbyte *) malloc (hi - lo + 1);
+    if (text_deps != NULL)
+	memcpy (text_deps, zmp + lo, hi - lo);
+
+    text_deps_known = text_deps != NULL;
+    text_deps_checked = TRUE;
+
+}/* find_text_deps */
+
+/*
+ * clear_string_cache
+ *
+ * Discard all decoded strings.
+ *
+ */
+
+static void clear_string_cache (void)
+{
+    int i;
+
+    if (string_cache == NULL) {
+	string_cache = (string_cache_t *) malloc (STRING_CACHE_SIZE * sizeof (string_cache_t));
+	if (string_cache == NULL)
+	    os_fatal ("Out of memory");
+    }
+
+    for (i = 0; i < STRING_CACHE_SIZE; i++)
+	string_cache[i].addr = -1;
+
+    string_cache_count = 0;
+    string_pool_length = 0;
+
+}/* clear_string_cache */
+
+/*
+ * check_text_deps
+ *
+ * Make sure that the snapshot of the tables that decoding depends on
+ * is up to date, discarding all decoded strings if they have changed.
+ * Return false if they cannot be snapshotted.
+ *
+ */
+
+static bool check_text_deps (void)
+{
+
+    if (!text_deps_known) {
+	clear_string_cache ();
+	find_text_deps ();
+    } else if (!text_deps_checked) {
+	if (memcmp (text_deps, zmp + text_deps_lo, text_deps_hi - text_deps_lo) != 0)
+	    clear_string_cache ();
+	find_text_deps ();
+    }
+
+    return text_deps_known;
+
+}/* check_text_deps */
+
+/*
+ * record_char
+ *
+ * Append a character (or STRING_NEW_LINE) to the string being cached.
+ *
+ */
+
+static void record_char (zword c)
+{
+
+    if (string_pool_length == string_pool_size) {
+
+	long size = (string_pool_size != 0) ? 2 * string_pool_size : 4096;
+	zword *pool = (zword *) realloc (string_pool, size * sizeof (zword));
+
+	if (pool == NULL)
+	    os_fatal ("Out of memory");
+
+	string_pool = pool;
+	string_pool_size = size;
+
+    }
+
+    string_pool[string_pool_length++] = c;
+
+}/* record_char */
+
+static void decode_text (enum string_type, zword);
+
+/*
+ * string_address
+ *
+ * Return the byte address of a string (that at PC for an embedded
+ * string).
+ *
+ */
+
+static long string_address (enum string_type st, zword addr)
+{
+    long byte_addr;
+
+    if (st == LOW_STRING)
+	byte_addr = addr;
+    else if (st == ABBREVIATION)
+	byte_addr = (long) addr << 1;
+    else if (st == HIGH_STRING) {
+	if (h_version <= V3)
+	    byte_addr = (long) addr << 1;
+	else if (h_version <= V5)
+	    byte_addr = (long) addr << 2;
+	else if (h_version <= V7)
+	    byte_addr = ((long) addr << 2) + ((long) h_strings_offset << 3);
+	else /* h_version == V8 */
+	    byte_addr = (long) addr << 3;
+    } else
+	GET_PC (byte_addr)
+
+    return byte_addr;
+
+}/* string_address */
+
+/*
+ * print_cached_text
+ *
+ * Print a string from the string cache, decoding it into the cache
+ * first if need be. Return false (having done nothing) if the string
+ * cannot be cached.
+ *
+ */
+
+static bool print_cached_text (enum string_type st, zword addr)
+{
+    string_cache_t *entry;
+    long byte_addr = string_address (st, addr);
+    long i;
+
+    /* Only strings outside dynamic memory never change */
+
+    if (byte_addr < h_dynamic_size || byte_addr >= story_size)
+	return FALSE;
+
+#ifdef AUTOFROTZ
+    /* Reads of the tables that the text depends on are being recorded */
+    if (read_set != NULL)
+	return FALSE;
+#endif
+
+    if (!string_cache_busy) {
+
+	if (!check_text_deps ())
+	    return FALSE;
+
+    } else if (!text_deps_checked)
+	return FALSE;
+
+    /* Look the string up */
+
+    i = (byte_addr * 0x9e3779b1UL >> 8) & (STRING_CACHE_SIZE - 1);
+
+    while (string_cache[i].addr != byte_addr && string_cache[i].addr != -1)
+	i = (i + 1) & (STRING_CACHE_SIZE - 1);
+
+    entry = &string_cache[i];
+
+    if (entry->addr == -1) {
+
+	long start;
+
+	/* Decode the string into the cache, unless it is in use or full */
+
+	if (string_cache_busy)
+	    return FALSE;
+
+	if (string_cache_count >= STRING_CACHE_SIZE / 2 || string_pool_length >= STRING_POOL_MAX) {
+	    clear_string_cache ();
+	    return print_cached_text (st, addr);
+	}
+
+	start = string_pool_length;
+
+	string_recording = TRUE;
+	decode_text (st, addr);
+	string_recording = FALSE;
+
+	entry->addr = byte_addr;
+	entry->start = start;
+	entry->length = string_pool_length - start;
+	entry->words = 0;
+
+	if (st == EMBEDDED_STRING) {
+
+	    long pc;
+
+	    GET_PC (pc)
+	    entry->words = (zword) ((pc - byte_addr) / 2);
+
+	}
+
+	string_cache_count++;
+
+    } else if (st == EMBEDDED_STRING) {
+
+	long pc = byte_addr + 2 * entry->words;
+	SET_PC (pc)
+
+    }
+
+    /* Print it */
+
+    string_cache_busy++;
+
+    for (i = entry->start; i < entry->start + entry->length; i++)
+	if (string_pool[i] == STRING_NEW_LINE)
+	    new_line ();
+	else
+	    print_char ((zchar) string_pool[i]);
+
+    string_cache_busy--;
+
+    return TRUE;
+
+}/* print_cached_text */
+
+#ifdef AUTOFROTZ
+
+/*
+ * defer_text
+ *
+ * Record a string that stream_silenced keeps from the lower window
+ * instead of decoding it, for the VmLink to print with print_deferred
+ * if the output is wanted. Strings that could change before then (in
+ * dynamic memory) are left to be decoded now, as are all strings while
+ * reads are recorded. The tables that decoding depends on could change
+ * too, so what they hold is recorded with the first string after they
+ * are written to. Return false (having done nothing) if the string is
+ * to be decoded.
+ *
+ */
+
+static bool defer_text (enum string_type st, zword addr)
+{
+    long byte_addr;
+    zword code;
+
+    if (st == ABBREVIATION || !stream_silenced ()
+	|| !vmLink->isDeferringOutput () || !ostream_screen)
+	return FALSE;
+
+    byte_addr = string_address (st, addr);
+
+    if (byte_addr < h_dynamic_size || byte_addr >= story_size
+	|| read_set != NULL || string_cache_busy)
+	return FALSE;
+
+    if (!text_deps_deferred || vmLink->getDeferredByteCount () == 0) {
+
+	zbyte range[2 * sizeof (zword)];
+
+	if (!check_text_deps ())
+	    return FALSE;
+
+	core::set(range, text_deps_lo);
+	core::set(range + sizeof (zword), text_deps_hi);
+	stream_defer (DEFERRED_TEXT_DEPS, vmLink->deferBytes (range, sizeof (range)));
+	vmLink->deferBytes (zmp + text_deps_lo, text_deps_hi - text_deps_lo);
+	text_deps_deferred = TRUE;
+
+    }
+
+    stream_defer (DEFERRED_STRING, byte_addr);
+
+    /* Skip past a string in the instruction stream */
+
+    if (st == EMBEDDED_STRING)
+	do {
+	    CODE_WORD (code)
+	} while (!(code & 0x8000));
+
+    return TRUE;
+
+}/* defer_text */
+
+/*
+ * print_deferred_text
+ *
+ * Print a string recorded by defer_text.
+ *
+ */
+
+void print_deferred_text (long byte_addr)
+{
+    long pc;
+
+    GET_PC (pc)
+    SET_PC (byte_addr)
+    decode_text (EMBEDDED_STRING, 0);
+    SET_PC (pc)
+
+}/* print_deferred_text */
+
+/*
+ * restore_deferred_text_deps
+ *
+ * Put back the tables that decoding depends on as defer_text recorded
+ * them, so that the strings recorded after them print as they would
+ * have. Dynamic memory is kept to be put back by end_deferred_text.
+ *
+ */
+
+void restore_deferred_text_deps (const zbyte *b)
+{
+    zword lo = core::get<zword>(b);
+    zword hi = core::get<zword>(b + sizeof (zword));
+
+    b += 2 * sizeof (zword);
+
+    if (memcmp (zmp + lo, b, hi - lo) == 0)
+	return;
+
+    if (deferred_memory == NULL) {
+
+	deferred_memory = (zbyte *) malloc (h_dynamic_size);
+	if (deferred_memory == NULL)
+	    os_fatal ("Out of memory");
+	memcpy (deferred_memory, zmp, h_dynamic_size);
+
+    }
+
+    memcpy (zmp + lo, b, hi - lo);
+    recheck_string_cache ();
+
+}/* restore_deferred_text_deps */
+
+/*
+ * end_deferred_text
+ *
+ * Put back dynamic memory after restore_deferred_text_deps.
+ *
+ */
+
+void end_deferred_text (void)
+{
+
+    if (deferred_memory == NULL)
+	return;
+
+    memcpy (zmp, deferred_memory, h_dynamic_size);
+    free (deferred_memory);
+    deferred_memory = NULL;
+    recheck_string_cache ();
+
+}/* end_deferred_text */
+
+#endif
+
 /*
  * decode_text
  *
@@ -375,7 +902,8 @@ void z_encode_text (void)
  *
  */
 
-#define outchar(c)	if (st==VOCABULARY) *ptr++=c; else print_char(c)
+#define outchar(c)	if (st==VOCABULARY) *ptr++=c; else if (string_recording) record_char(c); else print_char(c)
+#define outline()	if (string_recording) record_char(STRING_NEW_LINE); else new_line()
 
 static void decode_text (enum string_type st, zword addr)
 {
@@ -391,6 +919,18 @@ static void decode_text (enum string_type st, zword addr)
     ptr = NULL;		/* makes compilers shut up */
     byte_addr = 0;
 
+#ifdef AUTOFROTZ
+    /* Leave strings kept from the lower window to be printed later */
+
+    if (st != VOCABULARY && !string_recording && defer_text (st, addr))
+	return;
+#endif
+
+    /* Print strings that never change from the string cache */
+
+    if (st != VOCABULARY && !string_recording && print_cached_text (st, addr))
+	return;
+
     /* Calculate the byte address if necessary */
 
     if (st == ABBREVIATION)
@@ -433,6 +973,8 @@ static void decode_text (enum string_type st, zword addr)
 	} else
 	    CODE_WORD (code)
 
+	COUNT_STAT (zchars, 3)
+
 	/* Read its three Z-characters */
 
 	for (i = 10; i >= 0; i -= 5) {
@@ -450,10 +992,10 @@ static void decode_text (enum string_type st, zword addr)
 		    status = 2;
 
 		else if (h_version == V1 && c == 1)
-		    new_line ();
+		    outline ();
 
 		else if (h_version >= V2 && shift_state == 2 && c == 7)
-		    new_line ();
+		    outline ();
 
 		else if (c >= 6)
 		    outchar (alphabet (shift_state, c - 6));
@@ -519,6 +1061,7 @@ static void decode_text (enum string_type st, zword addr)
 }/* decode_text */
 
 #undef outchar
+#undef outline
 
 /*
  * z_new_line, print a new line.
@@ -629,6 +1172,11 @@ void print_num (zword value)
 {
     int i;
 
+#ifdef AUTOFROTZ
+    if (stream_silenced ())
+	{ stream_defer (DEFERRED_NUM, value); return; }
+#endif
+
     /* Print sign */
 
     if ((short) value < 0) {
@@ -764,6 +1312,246 @@ void z_print_unicode (void)
 
 }/* z_print_unicode */
 
+/*
+ * hash_word
+ *
+ * Hash an encoded word.
+ *
+ */
+
+static zword hash_word (zword w0, zword w1, zword w2)
+{
+    unsigned long h;
+
+    h = w0 * 0x9e3779b1UL;
+    h = (h ^ w1) * 0x9e3779b1UL;
+    h = (h ^ w2) * 0x9e3779b1UL;
+
+    return (zword) (h >> 16);
+
+}/* hash_word */
+
+/*
+ * reset_dictionaries
+ *
+ * Discard the indices of all dictionaries in dynamic memory.
+ *
+ */
+
+void reset_dictionaries (void)
+{
+    int i, j;
+
+    for (i = j = 0; i < dict_index_count; i++)
+	if (dict_index[i].dct < h_dynamic_size)
+	    free (dict_index[i].hash_table);
+	else
+	    dict_index[j++] = dict_index[i];
+
+    dict_index_count = j;
+
+    dict_index_lo = 0;
+    dict_index_hi = 0;
+
+}/* reset_dictionaries */
+
+/*
+ * build_dictionary
+ *
+ * Decode a dictionary into the given index.
+ *
+ */
+
+static void build_dictionary (dict_index_t *index, zword dct)
+{
+    zword entry_addr;
+    zword entry_count;
+    zword entry;
+    zword addr;
+    zbyte entry_len;
+    zbyte sep_count;
+    zbyte separator;
+    zword key[3];
+    zword prev_key[3];
+    long end;
+    int resolution = (h_version <= V3) ? 2 : 3;
+    int entry_number;
+    int c;
+    int i;
+    bool sorted;
+
+    index->dct = dct;
+    index->hashed = FALSE;
+    index->hash_mask = 0;
+    index->hash_table = NULL;
+
+    /* Classify every character exactly as the scan in tokenise_line
+       would (which reads 256 bytes if there are no separators) */
+
+    memset (index->separators, 0, sizeof index->separators);
+
+    for (c = 0; c < 256; c++) {
+
+	addr = dct;
+
+	LOW_BYTE (addr, sep_count)
+	addr++;
+
+	do {
+
+	    LOW_BYTE (addr, separator)
+	    addr++;
+
+	} while (c != separator && --sep_count != 0);
+
+	if (sep_count != 0)
+	    index->separators[c >> 3] |= 1 << (c & 7);
+
+    }
+
+    LOW_BYTE (dct, sep_count)
+    end = (long) dct + 1 + ((sep_count != 0) ? sep_count : 256);
+    dct += 1 + sep_count;
+    LOW_BYTE (dct, entry_len)
+    dct += 1;
+    LOW_WORD (dct, entry_count)
+    dct += 2;
+
+    if ((short) entry_count < 0) {
+
+	entry_count = - (short) entry_count;
+	sorted = FALSE;
+
+    } else sorted = TRUE;
+
+    if (end < (long) dct + entry_count * entry_len + 2 * resolution)
+	end = (long) dct + entry_count * entry_len + 2 * resolution;
+
+    if (index->dct < h_dynamic_size) {
+	if (dict_index_lo == dict_index_hi || index->dct < dict_index_lo)
+	    dict_index_lo = index->dct;
+	if (end > dict_index_hi)
+	    dict_index_hi = (end < h_dynamic_size) ? end : h_dynamic_size;
+    }
+
+    if (end > story_size || end > 0x10000L)
+	return;
+
+    index->hash_mask = 1;
+    while (index->hash_mask < 2 * entry_count)
+	index->hash_mask <<= 1;
+
+    index->hash_table = (zword *) calloc (index->hash_mask, sizeof (zword));
+    index->hash_mask--;
+
+    if (index->hash_table == NULL)
+	return;
+
+    /* Enter the words, keeping the first of any duplicates (as the
+       linear search finds) but giving up on "sorted" dictionaries that
+       are not in strictly ascending order (as the binary search could
+       then miss words) */
+
+    key[2] = 0;
+
+    for (entry_number = 0; entry_number < entry_count; entry_number++) {
+
+	unsigned long h;
+
+	entry_addr = dct + entry_number * entry_len;
+
+	for (i = 0, addr = entry_addr; i < resolution; i++, addr += 2)
+	    LOW_WORD (addr, key[i])
+
+	if (sorted && entry_number != 0) {
+
+	    for (i = 0; i < resolution && key[i] == prev_key[i]; i++);
+
+	    if (i == resolution || key[i] < prev_key[i]) {
+		free (index->hash_table);
+		index->hash_table = NULL;
+		return;
+	    }
+
+	}
+
+	memcpy (prev_key, key, sizeof key);
+
+	h = hash_word (key[0], key[1], key[2]) & index->hash_mask;
+
+	while ((entry = index->hash_table[h]) != 0) {
+
+	    for (i = 0, addr = entry; i < resolution; i++, addr += 2) {
+		zword w;
+		LOW_WORD (addr, w)
+		if (w != key[i])
+		    break;
+	    }
+
+	    if (i == resolution)
+		break;
+
+	    h = (h + 1) & index->hash_mask;
+
+	}
+
+	if (entry == 0)
+	    index->hash_table[h] = entry_addr;
+
+    }
+
+    index->hashed = TRUE;
+
+}/* build_dictionary */
+
+/*
+ * find_dictionary
+ *
+ * Return the index of a dictionary, building it if need be.
+ *
+ */
+
+static dict_index_t *find_dictionary (zword dct)
+{
+    dict_index_t found;
+    int i;
+
+#ifdef AUTOFROTZ
+    /* Reads are being recorded, so have a dictionary in dynamic memory
+       read (through its index being rebuilt) every time */
+    if (read_set != NULL && dct < h_dynamic_size)
+	reset_dictionaries ();
+#endif
+
+    for (i = dict_index_count - 1; i >= 0; i--)
+	if (dict_index[i].dct == dct)
+	    break;
+
+    if (i < 0) {
+
+	/* Make room by dropping the least recently used dictionary */
+
+	if (dict_index_count == DICT_INDICES) {
+	    free (dict_index[0].hash_table);
+	    memmove (dict_index, dict_index + 1, (DICT_INDICES - 1) * sizeof (dict_index_t));
+	    dict_index_count--;
+	}
+
+	i = dict_index_count++;
+	build_dictionary (&dict_index[i], dct);
+
+    }
+
+    /* Move the dictionary to the end of the list */
+
+    found = dict_index[i];
+    memmove (dict_index + i, dict_index + i + 1, (dict_index_count - 1 - i) * sizeof (dict_index_t));
+    dict_index[dict_index_count - 1] = found;
+
+    return &dict_index[dict_index_count - 1];
+
+}/* find_dictionary */
+
 /*
  * lookup_text
  *
@@ -794,6 +1582,33 @@ static zword lookup_text (int padding, zword dct)
 
     encode_text (padding);
 
+    if (padding == 0x05) {		/* exact match wanted, try hashing */
+
+	dict_index_t *index = find_dictionary (dct);
+
+	if (index->hashed) {
+
+	    unsigned long h = hash_word (encoded[0], encoded[1], (resolution == 3) ? encoded[2] : 0);
+
+	    for (h &= index->hash_mask; (entry_addr = index->hash_table[h]) != 0; h = (h + 1) & index->hash_mask) {
+
+		for (i = 0, addr = entry_addr; i < resolution; i++, addr += 2) {
+		    LOW_WORD (addr, entry)
+		    if (encoded[i] != entry)
+			break;
+		}
+
+		if (i == resolution)
+		    return entry_addr;
+
+	    }
+
+	    return 0;
+
+	}
+
+    }
+
     LOW_BYTE (dct, sep_count)		/* skip word separators */
     dct += 1 + sep_count;
     LOW_BYTE (dct, entry_len)		/* get length of entries */
@@ -912,6 +1727,7 @@ static void tokenise_text (zword text, zword length, zword from, zword parse, zw
 
 void tokenise_line (zword text, zword token, zword dct, bool flag)
 {
+    zbyte separators[32];
     zword addr1;
     zword addr2;
     zbyte length;
@@ -924,6 +1740,8 @@ void tokenise_line (zword text, zword token, zword dct, bool flag)
     if (dct == 0)
 	dct = h_dictionary;
 
+    memcpy (separators, find_dictionary (dct)->separators, sizeof separators);
+
     /* Remove all tokens before inserting new ones */
 
     storeb ((zword) (token + 1), 0);
@@ -944,9 +1762,7 @@ void tokenise_line (zword text, zword token, zword dct, bool flag)
 
     do {
 
-	zword sep_addr;
-	zbyte sep_count;
-	zbyte separator;
+	bool sep;
 
 	/* Fetch next ZSCII character */
 
@@ -959,21 +1775,11 @@ void tokenise_line (zword text, zword token, zword dct, bool flag)
 
 	/* Check for separator */
 
-	sep_addr = dct;
-
-	LOW_BYTE (sep_addr, sep_count)
-	sep_addr++;
-
-	do {
-
-	    LOW_BYTE (sep_addr, separator)
-	    sep_addr++;
-
-	} while (c != separator && --sep_count != 0);
+	sep = (separators[c >> 3] >> (c & 7)) & 1;
 
 	/* This could be the start or the end of a word */
 
-	if (sep_count == 0 && c != ' ' && c != 0) {
+	if (!sep && c != ' ' && c != 0) {
 
 	    if (addr2 == 0)
 		addr2 = addr1;
@@ -992,7 +1798,7 @@ void tokenise_line (zword text, zword token, zword dct, bool flag)
 
 	/* Translate separator (which is a word in its own right) */
 
-	if (sep_count != 0)
+	if (sep)
 
 	    tokenise_text (
 		text,
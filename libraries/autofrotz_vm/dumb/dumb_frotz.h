@@ -15,7 +15,7 @@
 #include <time.h>
 
 /* from ../common/setup.h */
-vmlocal extern f_setup_t f_setup;
+extern vmlocal f_setup_t f_setup;
 
 /* From input.c.  */
 bool is_terminator (zchar);
@@ -25,7 +25,7 @@ Syntax: dfrotz [options] story-file\n\
   -P   alter piracy opcode     \t -x   expand abbreviations g/x/z"
 
 /*
-vmlocal static char usage[] = "\
+static vmlocal char usage[] = "\
 \n\
 FROTZ V2.32 - interpreter for all Infocom games. Complies with standard\n\
 1.0 of Graham Nelson's specification. Written by Stefan Jokisch in 1995-7.\n\
@@ -59,12 +59,12 @@ While running, enter \"\\help\" to list the runtime escape sequences.\n\
 
 
 /* A unix-like getopt, but with the names changed to avoid any problems.  */
-vmlocal static int zoptind = 1;
-vmlocal static int zoptopt = 0;
-vmlocal static char *zoptarg = NULL;
+static vmlocal int zoptind = 1;
+static vmlocal int zoptopt = 0;
+static vmlocal char *zoptarg = NULL;
 static int zgetopt (int argc, char *argv[], const char *options)
 {
-    vmlocal static int pos = 1;
+    static vmlocal int pos = 1;
     const char *p;
     if (zoptind >= argc || argv[zoptind][0] != '-' || argv[zoptind][1] == 0)
 	return EOF;
@@ -93,13 +93,13 @@ error:
     return '?';
 }/* zgetopt */
 
-vmlocal static int user_screen_width = 75;
-vmlocal static int user_screen_height = 24;
-vmlocal static int user_interpreter_number = -1;
-vmlocal static int user_random_seed = -1;
-vmlocal static int user_tandy_bit = 0;
-vmlocal static char *graphics_filename = NULL;
-vmlocal static bool plain_ascii = FALSE;
+static vmlocal int user_screen_width = 75;
+static vmlocal int user_screen_height = 24;
+static vmlocal int user_interpreter_number = -1;
+static vmlocal int user_random_seed = -1;
+static vmlocal int user_tandy_bit = 0;
+static vmlocal char *graphics_filename = NULL;
+static vmlocal bool plain_ascii = FALSE;
 
 #ifdef AUTOFROTZ
 void os_process_arguments(int argc, char *argv[])
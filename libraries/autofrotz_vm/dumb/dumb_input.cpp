@@ -52,8 +52,8 @@ static const char runtime_usage[] =
   "            (blank) Any other output line.\n"
 ;
 
-vmlocal static float speed = 1;
-vmlocal static bool do_more_prompts = TRUE;
+static vmlocal float speed = 1;
+static vmlocal bool do_more_prompts = TRUE;
 
 enum input_type {
   INPUT_CHAR,
@@ -146,7 +146,7 @@ static void translate_special_chars(char *s)
 
 
 /* The time in tenths of seconds that the user is ahead of z time.  */
-vmlocal static int time_ahead = 0;
+static vmlocal int time_ahead = 0;
 
 /* Called from os_read_key and os_read_line if they have input from
  * a previous call to dumb_read_line.
@@ -220,7 +220,10 @@ static bool dumb_read_line(char *s, const char *prompt, bool show_cursor,
     char *command;
     if (prompt)
 #ifdef AUTOFROTZ
-      os_display_string((const zchar *) prompt);
+      if (vmLink->isStreamingOutput() && cwin == 0 && h_version != V6)
+	os_stream_string((const zchar *) prompt);
+      else
+	os_display_string((const zchar *) prompt);
 #else
       fputs(prompt, stdout);
 #endif
@@ -309,10 +312,47 @@ static bool dumb_read_line(char *s, const char *prompt, bool show_cursor,
   }
 }
 
+#ifdef AUTOFROTZ
+/* What the Z-machine is waiting on (when it's waiting for input).
+ * While it waits, its C stack holds the frames of the read in
+ * progress, so a snapshot of another state can only be resumed here
+ * if it was taken while waiting on exactly the same sort of read.  */
+enum pending_kind {
+  PENDING_NONE, PENDING_KEY, PENDING_LINE, PENDING_MISC,
+};
+static vmlocal struct {
+  int kind;
+  int max;
+  int timeout;
+  int width;
+  int continued;
+  zchar buf[INPUT_BUFFER_SIZE];
+} pending_read;
+
+static void note_pending_read(int kind, int max, int timeout, int width,
+			      int continued, const zchar *buf)
+{
+  memset(&pending_read, 0, sizeof(pending_read));
+  pending_read.kind = kind;
+  pending_read.max = max;
+  pending_read.timeout = timeout;
+  pending_read.width = width;
+  pending_read.continued = continued;
+  if (buf) {
+    int i;
+    for (i = 0; i < INPUT_BUFFER_SIZE - 1 && buf[i]; i++)
+      pending_read.buf[i] = buf[i];
+  }
+}
+#endif
+
 /* Read a line that is not part of z-machine input (more prompts and
  * filename requests).  */
 static void dumb_read_misc_line(char *s, const char *prompt)
 {
+#ifdef AUTOFROTZ
+  note_pending_read(PENDING_MISC, 0, 0, 0, 0, NULL);
+#endif
   dumb_read_line(s, prompt, 0, 0, INPUT_CHAR, 0);
   /* Remove terminating newline */
   s[strlen(s) - 1] = '\0';
@@ -321,10 +361,14 @@ static void dumb_read_misc_line(char *s, const char *prompt)
 /* For allowing the user to input in a single line keys to be returned
  * for several consecutive calls to read_char, with no screen update
  * in between.  Useful for traversing menus.  */
-vmlocal static char read_key_buffer[INPUT_BUFFER_SIZE];
+static vmlocal char read_key_buffer[INPUT_BUFFER_SIZE];
 
 /* Similar.  Useful for using function key abbreviations.  */
-vmlocal static char read_line_buffer[INPUT_BUFFER_SIZE];
+static vmlocal char read_line_buffer[INPUT_BUFFER_SIZE];
+
+/* Whether the last line read timed out (so that the rest of the line
+ * read ahead should be discarded).  */
+static vmlocal bool timed_out_last_time;
 
 zchar os_read_key (int timeout, bool show_cursor)
 {
@@ -334,6 +378,10 @@ zchar os_read_key (int timeout, bool show_cursor)
   /* Discard any keys read for line input.  */
   read_line_buffer[0] = '\0';
 
+#ifdef AUTOFROTZ
+  note_pending_read(PENDING_KEY, 0, timeout, 0, 0, NULL);
+#endif
+
   if (read_key_buffer[0] == '\0') {
     timed_out = dumb_read_line(read_key_buffer, NULL, show_cursor, timeout,
 			       INPUT_CHAR, NULL);
@@ -360,12 +408,15 @@ zchar os_read_line (int max, zchar *buf, int timeout, int width, int continued)
 {
   char *p;
   int terminator;
-  vmlocal static bool timed_out_last_time;
   int timed_out;
 
   /* Discard any keys read for single key input.  */
   read_key_buffer[0] = '\0';
 
+#ifdef AUTOFROTZ
+  note_pending_read(PENDING_LINE, max, timeout, width, continued, buf);
+#endif
+
   /* After timing out, discard any further input unless we're continuing.  */
   if (timed_out_last_time && !continued)
     read_line_buffer[0] = '\0';
@@ -456,3 +507,56 @@ zword os_read_mouse(void)
 {
 	/* NOT IMPLEMENTED */
 }
+
+#ifdef AUTOFROTZ
+/* Returns the number of unsigned chars needed to store the state of
+ * input, including the read that's waiting.  */
+unsigned int dumb_input_statesize(void)
+{
+  return sizeof(pending_read) + sizeof(time_ahead) + sizeof(read_key_buffer)
+    + sizeof(read_line_buffer) + sizeof(timed_out_last_time);
+}
+
+/* Saves the state of input to the given buffer (of size at least
+ * dumb_input_statesize()), with the unused ends of the read-ahead
+ * buffers saved as zeros.  The read that's waiting comes first.  */
+void dumb_input_savestate(unsigned char *b)
+{
+  memcpy(b, &pending_read, sizeof(pending_read)); b += sizeof(pending_read);
+  core::set(b, time_ahead); b += sizeof(time_ahead);
+  memset(b, 0, sizeof(read_key_buffer));
+  strcpy((char *) b, read_key_buffer); b += sizeof(read_key_buffer);
+  memset(b, 0, sizeof(read_line_buffer));
+  strcpy((char *) b, read_line_buffer); b += sizeof(read_line_buffer);
+  core::set(b, timed_out_last_time); b += sizeof(timed_out_last_time);
+}
+
+/* Restores the state of input from the given buffer (filled with
+ * dumb_input_savestate() from this process).  */
+void dumb_input_restorestate(unsigned char *b)
+{
+  memcpy(&pending_read, b, sizeof(pending_read)); b += sizeof(pending_read);
+  time_ahead = core::get<decltype(time_ahead)>(b); b += sizeof(time_ahead);
+  memcpy(read_key_buffer, b, sizeof(read_key_buffer)); b += sizeof(read_key_buffer);
+  memcpy(read_line_buffer, b, sizeof(read_line_buffer)); b += sizeof(read_line_buffer);
+  timed_out_last_time = core::get<decltype(timed_out_last_time)>(b); b += sizeof(timed_out_last_time);
+}
+
+/* Returns the size of the read that's waiting, at the start of a
+ * buffer filled with dumb_input_savestate().  */
+unsigned int dumb_input_readsize(void)
+{
+  return sizeof(pending_read);
+}
+
+/* Returns whether or not the Z-machine is waiting on the same read as
+ * the one in the given buffer (filled with dumb_input_savestate()), and
+ * that read is one that can be resumed from another state (a key or a
+ * line, rather than a more prompt or a filename).  */
+bool dumb_input_is_resumable(const unsigned char *b)
+{
+  if (pending_read.kind != PENDING_KEY && pending_read.kind != PENDING_LINE)
+    return FALSE;
+  return memcmp(&pending_read, b, sizeof(pending_read)) == 0;
+}
+#endif
@@ -7,11 +7,11 @@
 
 #include "dumb_frotz.h"
 
-vmlocal static bool show_line_numbers = FALSE;
-vmlocal static bool show_line_types = -1;
-vmlocal static bool show_pictures = TRUE;
-vmlocal static bool visual_bell = TRUE;
-vmlocal static bool plain_ascii = FALSE;
+static vmlocal bool show_line_numbers = FALSE;
+static vmlocal bool show_line_types = -1;
+static vmlocal bool show_pictures = TRUE;
+static vmlocal bool visual_bell = TRUE;
+static vmlocal bool plain_ascii = FALSE;
 
 static const char latin1_to_ascii[] =
   "    !   c   L   >o< Y   |   S   ''  C   a   <<  not -   R   _   "
@@ -23,12 +23,12 @@ static const char latin1_to_ascii[] =
 ;
 
 /* h_screen_rows * h_screen_cols */
-vmlocal static int screen_cells;
+static vmlocal int screen_cells;
 
 /* The in-memory state of the screen.  */
 /* Each cell contains a style in the upper byte and a char in the lower. */
 typedef unsigned short cell;
-vmlocal static cell *screen_data;
+static vmlocal cell *screen_data;
 
 static cell make_cell(int style, char c) {return (style << 8) | (0xff & c);}
 static char cell_char(cell c) {return c & 0xff;}
@@ -42,26 +42,32 @@ static int cell_style(cell c) {return c >> 8;}
  * the rv bit some company in that huge byte I allocated for it.)  */
 #define PICTURE_STYLE 16
 
-vmlocal static int current_style = 0;
+static vmlocal int current_style = 0;
 
 /* Which cells have changed (1 byte per cell).  */
-vmlocal static char *screen_changes;
+static vmlocal char *screen_changes;
 
-vmlocal static int cursor_row = 0, cursor_col = 0;
+/* Which part of each row may have changed: every changed cell of row r
+ * lies in columns dirty_lo[r] to dirty_hi[r] - 1.  A clean row has
+ * dirty_lo[r] >= dirty_hi[r].  */
+static vmlocal int *dirty_lo;
+static vmlocal int *dirty_hi;
+
+static vmlocal int cursor_row = 0, cursor_col = 0;
 
 /* Compression styles.  */
-vmlocal static enum {
+static vmlocal enum {
   COMPRESSION_NONE, COMPRESSION_SPANS, COMPRESSION_MAX,
 } compression_mode = COMPRESSION_SPANS;
 static const char *const compression_names[] = {"NONE", "SPANS", "MAX"};
-vmlocal static int hide_lines = 0;
+static vmlocal int hide_lines = 0;
 
 /* Reverse-video display styles.  */
-vmlocal static enum {
+static vmlocal enum {
   RV_NONE, RV_DOUBLESTRIKE, RV_UNDERLINE, RV_CAPS,
 } rv_mode = RV_NONE;
 static const char *const rv_names[] = {"NONE", "DOUBLESTRIKE", "UNDERLINE", "CAPS"};
-vmlocal static char rv_blank_char = ' ';
+static vmlocal char rv_blank_char = ' ';
 
 static cell *dumb_row(int r)
 {
@@ -117,11 +123,21 @@ void os_set_cursor(int row, int col)
     cursor_row = h_screen_rows - 1;
 }
 
+/* Widen the dirty part of a row to include columns lo to hi - 1.  */
+static void dumb_mark_dirty(int row, int lo, int hi)
+{
+  if (lo < dirty_lo[row])
+    dirty_lo[row] = lo;
+  if (hi > dirty_hi[row])
+    dirty_hi[row] = hi;
+}
+
 /* Set a cell and update screen_changes.  */
 static void dumb_set_cell(int row, int col, cell c)
 {
   cell *t = dumb_row(row) + col;
-  dumb_changes_row(row)[col] = (c != *t);
+  if ((dumb_changes_row(row)[col] = (c != *t)))
+    dumb_mark_dirty(row, col, col + 1);
   *t = c;
 }
 
@@ -136,7 +152,8 @@ static void dumb_copy_cell(int dest_row, int dest_col,
 			   int src_row, int src_col)
 {
   dumb_row(dest_row)[dest_col] = dumb_row(src_row)[src_col];
-  dumb_changes_row(dest_row)[dest_col] = dumb_changes_row(src_row)[src_col];
+  if ((dumb_changes_row(dest_row)[dest_col] = dumb_changes_row(src_row)[src_col]))
+    dumb_mark_dirty(dest_row, dest_col, dest_col + 1);
 }
 
 void os_set_text_style(int x)
@@ -198,6 +215,81 @@ void os_display_char (zchar c)
 }
 
 
+#ifdef AUTOFROTZ
+/* Streamed characters are gathered here and handed to the output a run
+ * at a time.  */
+#define STREAM_RUN_SIZE 256
+
+static vmlocal uchar stream_run[STREAM_RUN_SIZE];
+static vmlocal size_t stream_len;
+
+/* Window 7 is only streamed when the status line is being captured, in
+ * which case what comes through is the location's name.  */
+static void stream_flush(void)
+{
+  if (stream_len != 0) {
+    if (cwin == 7)
+      vmLink->writeStatusName(stream_run, stream_len);
+    else
+      vmLink->writeOutput(stream_run, stream_len);
+    stream_len = 0;
+  }
+}
+
+static void stream_put(uchar c)
+{
+  if (stream_len == STREAM_RUN_SIZE)
+    stream_flush();
+  stream_run[stream_len++] = c;
+}
+
+/* Stream a character straight to the output, as os_display_char would
+ * have put it on the screen.  */
+static void stream_char(zchar c)
+{
+  if (c >= ZC_LATIN1_MIN && c <= ZC_LATIN1_MAX) {
+    if (plain_ascii) {
+      const char *ptr = latin1_to_ascii + 4 * (c - ZC_LATIN1_MIN);
+      do
+	stream_put(*ptr++);
+      while (*ptr != ' ');
+    } else
+      stream_put(c);
+  } else if (c >= 32 && c <= 126) {
+    stream_put(c);
+  } else if (c == ZC_GAP) {
+    stream_put(' '); stream_put(' ');
+  } else if (c == ZC_INDENT) {
+    stream_put(' '); stream_put(' '); stream_put(' ');
+  }
+}
+
+void os_stream_char (zchar c)
+{
+  stream_char(c);
+  stream_flush();
+}
+
+void os_stream_string (const zchar *s)
+{
+  zchar c;
+
+  while ((c = *s++) != 0)
+    if (c == ZC_NEW_FONT || c == ZC_NEW_STYLE)
+      s++;
+    else
+      stream_char(c);
+  stream_flush();
+}
+
+void os_stream_new_line (void)
+{
+  if (cwin == 7)
+    return;
+  vmLink->writeOutput('\n');
+}
+#endif
+
 /* Haxor your boxor? */
 void os_display_string (const zchar *s)
 {
@@ -217,7 +309,8 @@ void os_erase_area (int top, int left, int bottom, int right)
 {
   cell out, *screen_data_i, *screen_data_end, *t;
   char *screen_changes_i;
-  int c;
+  int r, c;
+  bool changed;
 
   top--; left--;
   out = make_cell(current_style, ' ');
@@ -225,12 +318,15 @@ void os_erase_area (int top, int left, int bottom, int right)
   screen_changes_i = dumb_changes_row(top);
   screen_data_end = dumb_row(bottom);
 
-  while (screen_data_i < screen_data_end) {
+  for (r = top; screen_data_i < screen_data_end; r++) {
+    changed = FALSE;
     for (c = left; c < right; c++) {
       t = screen_data_i + c;
-      screen_changes_i[c] = (*t != out);
+      changed |= (screen_changes_i[c] = (*t != out));
       *t = out;
     }
+    if (changed)
+      dumb_mark_dirty(r, left, right);
     screen_data_i = dumb_row_nextrow(screen_data_i);
     screen_changes_i = dumb_changes_row_nextrow(screen_changes_i);
   }
@@ -278,10 +374,11 @@ static void output_putchar(char c)
      dumb_elide_more_prompt (ext only)
      os_beep (ext only)
   */
-  vmLink->writeOutput(c);
+  vmLink->writeOutput((unsigned char) c);
 }
 
-static void show_cell(cell cel)
+/* Get the character that a cell shows as.  */
+static char cell_output_char(cell cel)
 {
   char c = cell_char(cel);
   int style = cell_style(cel);
@@ -303,8 +400,12 @@ static void show_cell(cell cel)
         break;
     }
   }
+  return c;
+}
 
-  output_putchar(c);
+static void show_cell(cell cel)
+{
+  output_putchar(cell_output_char(cel));
 }
 #else
 static void output_putchar(char c)
@@ -369,6 +470,11 @@ static void show_line_prefix(int row, char c)
 /* Print a row to stdout.  */
 static void show_row(int r)
 {
+#ifdef AUTOFROTZ
+  /* (Showing a row changes nothing but the output.)  */
+  if (vmLink->isDiscardingOutput())
+    return;
+#endif
   if (r == -1) {
     show_line_prefix(-1, '.');
   } else {
@@ -381,8 +487,21 @@ static void show_row(int r)
     for (last = h_screen_cols - 1; last >= 0; last--)
       if (!will_print_blank(screen_data_i[last]))
 	  break;
+#ifdef AUTOFROTZ
+    {
+      /* Hand the whole row over in one go.  */
+      uchar line[256 + 1];
+      int n = 0;
+      for (c = 0; c <= last; c++)
+	line[n++] = (unsigned char) cell_output_char(screen_data_i[c]);
+      line[n++] = '\n';
+      vmLink->writeOutput(line, n);
+      return;
+    }
+#else
     for (c = 0; c <= last; c++)
       show_cell(screen_data_i[c]);
+#endif
   }
   output_putchar('\n');
 }
@@ -401,9 +520,24 @@ void dumb_show_prompt(bool show_cursor, char line_type)
 
 static void mark_all_unchanged(void)
 {
-  memset(screen_changes, 0, screen_cells);
+  int r;
+  for (r = 0; r < h_screen_rows; r++)
+    if (dirty_lo[r] < dirty_hi[r]) {
+      memset(dumb_changes_row(r) + dirty_lo[r], 0, dirty_hi[r] - dirty_lo[r]);
+      dirty_lo[r] = h_screen_cols;
+      dirty_hi[r] = 0;
+    }
 }
 
+#ifndef AUTOFROTZ
+static void mark_all_dirty(void)
+{
+  int r;
+  for (r = 0; r < h_screen_rows; r++)
+    dumb_mark_dirty(r, 0, h_screen_cols);
+}
+#endif
+
 /* Check if a cell is a blank or will display as one.
  * (Used to help decide if contents are worth printing.)  */
 static bool is_blank(cell c)
@@ -412,6 +546,31 @@ static bool is_blank(cell c)
 	  || ((cell_style(c) == PICTURE_STYLE) && !show_pictures));
 }
 
+/* Check if a row has a changed cell that is not blank.  Only the dirty
+ * part of the row is looked at, and unchanged cells are skipped eight
+ * at a time.  */
+static bool row_changed(int r)
+{
+  cell *screen_data_i = dumb_row(r);
+  char *screen_changes_i = dumb_changes_row(r);
+  int c = dirty_lo[r], end = dirty_hi[r];
+  unsigned long long flags;
+
+  while (c < end) {
+    if (c + 8 <= end) {
+      memcpy(&flags, screen_changes_i + c, 8);
+      if (flags == 0) {
+	c += 8;
+	continue;
+      }
+    }
+    if (screen_changes_i[c] && !is_blank(screen_data_i[c]))
+      return TRUE;
+    c++;
+  }
+  return FALSE;
+}
+
 /* Show the current screen contents, or what's changed since the last
  * call.
  *
@@ -419,16 +578,89 @@ static bool is_blank(cell c)
  * last nonblank character on the last line that would be shown, then
  * don't show that line (because it will be redundant with the prompt
  * line just below it).  */
+#ifdef AUTOFROTZ
+static vmlocal int captured_rows = 0;
+
+/* Check if anything has been written to a row since the screen was
+ * last shown, whatever the cells now hold: unlike row_changed, blanks
+ * count (a captured row must follow erasures) and so do cells that were
+ * changed and then changed back (since their flags are cleared again
+ * but the dirty part of the row is not).  */
+static bool row_touched(int r)
+{
+  return dirty_lo[r] < dirty_hi[r];
+}
+
+/* Copy the rows above the lower window that have changed over to the
+ * VmLink, and return how many such rows there are.  */
+static int capture_upper_window(void)
+{
+  int r, c, last, rows;
+  uchar line[256];
+  cell *screen_data_i;
+
+  rows = lower_window_top();
+  if (rows < 0)
+    rows = 0;
+  else if (rows > h_screen_rows)
+    rows = h_screen_rows;
+  if (rows != captured_rows)
+    vmLink->setUpperWindowHeight(rows);
+
+  for (r = 0; r < rows; r++) {
+    if (rows == captured_rows && !row_touched(r))
+      continue;
+    screen_data_i = dumb_row(r);
+    for (last = h_screen_cols - 1; last >= 0; last--)
+      if (!will_print_blank(screen_data_i[last]))
+	break;
+    for (c = 0; c <= last; c++)
+      line[c] = (unsigned char) cell_output_char(screen_data_i[c]);
+    vmLink->setUpperWindowRow(r, line, last + 1);
+  }
+
+  captured_rows = rows;
+  return rows;
+}
+#endif
+
+#ifdef AUTOFROTZ
+static void show_screen(bool show_cursor);
+
+/* Time the rendering for the VmLink's phase histograms and trace.  */
 void dumb_show_screen(bool show_cursor)
+{
+  vmLink->beginRendering();
+  show_screen(show_cursor);
+  vmLink->endRendering();
+}
+
+static void show_screen(bool show_cursor)
+#else
+void dumb_show_screen(bool show_cursor)
+#endif
 {
   int r, c, first, last;
+  int first_row = hide_lines;
   char changed_rows[0x100];
   cell *screen_data_i;
-  char *screen_changes_i;
+
+#ifdef AUTOFROTZ
+  /* A streamed lower window holds the cursor, but it is not on the screen */
+  if (vmLink->isStreamingOutput() && h_version != V6)
+    show_cursor = FALSE;
+
+  /* Captured rows are handed over separately rather than shown */
+  if (vmLink->isCapturingStatus() && h_version != V6) {
+    r = capture_upper_window();
+    if (r > first_row)
+      first_row = r;
+  }
+#endif
 
   /* Easy case */
   if (compression_mode == COMPRESSION_NONE) {
-    for (r = hide_lines; r < h_screen_rows; r++)
+    for (r = first_row; r < h_screen_rows; r++)
       show_row(r);
     mark_all_unchanged();
     return;
@@ -437,19 +669,12 @@ void dumb_show_screen(bool show_cursor)
   /* Check which rows changed, and where the first and last change is.  */
   first = last = -1;
   memset(changed_rows, 0, h_screen_rows);
-  screen_data_i = dumb_row(hide_lines);
-  screen_changes_i = dumb_changes_row(hide_lines);
-  for (r = hide_lines; r < h_screen_rows; r++) {
-    for (c = 0; c < h_screen_cols; c++)
-      if (screen_changes_i[c] && !is_blank(screen_data_i[c]))
-	break;
-    changed_rows[r] = (c != h_screen_cols);
+  for (r = first_row; r < h_screen_rows; r++) {
+    changed_rows[r] = row_changed(r);
     if (changed_rows[r]) {
       first = (first != -1) ? first : r;
       last = r;
     }
-    screen_data_i = dumb_row_nextrow(screen_data_i);
-    screen_changes_i = dumb_changes_row_nextrow(screen_changes_i);
   }
 
   if (first == -1)
@@ -561,6 +786,7 @@ bool dumb_output_handle_setting(const char *setting, bool show_cursor,
       return TRUE;
     for (i = 0; i < screen_cells; i++)
       screen_changes[i] = (cell_style(screen_data[i]) == PICTURE_STYLE);
+    mark_all_dirty();
     dumb_show_screen(show_cursor);
 
   } else if (!strncmp(setting, "vb", 2)) {
@@ -603,6 +829,7 @@ bool dumb_output_handle_setting(const char *setting, bool show_cursor,
     putchar('\n');
     for (i = 0; i < screen_cells; i++)
       screen_changes[i] = (cell_style(screen_data[i]) == REVERSE_STYLE);
+    mark_all_dirty();
     dumb_show_screen(show_cursor);
 
   } else if (!strcmp(setting, "set")) {
@@ -624,8 +851,59 @@ bool dumb_output_handle_setting(const char *setting, bool show_cursor,
 }
 #endif
 
+#ifdef AUTOFROTZ
+/* Report the bytes held for the screen.  */
+size_t screen_memory_usage(void)
+{
+  if (!screen_data)
+    return 0;
+  return screen_cells * (sizeof(cell) + 1) + h_screen_rows * 2 * sizeof(int);
+}
+
+/* Returns the number of unsigned chars needed to store what's on the
+ * screen (and which cells of it have changed).  */
+unsigned int dumb_output_statesize(void)
+{
+  return screen_cells * (sizeof(cell) + 1) + sizeof(cursor_row)
+    + sizeof(cursor_col) + sizeof(current_style) + sizeof(captured_rows);
+}
+
+/* Saves what's on the screen to the given buffer (of size at least
+ * dumb_output_statesize()).  */
+void dumb_output_savestate(unsigned char *b)
+{
+  memcpy(b, screen_data, screen_cells * sizeof(cell)); b += screen_cells * sizeof(cell);
+  memcpy(b, screen_changes, screen_cells); b += screen_cells;
+  core::set(b, cursor_row); b += sizeof(cursor_row);
+  core::set(b, cursor_col); b += sizeof(cursor_col);
+  core::set(b, current_style); b += sizeof(current_style);
+  core::set(b, captured_rows); b += sizeof(captured_rows);
+}
+
+/* Restores what's on the screen from the given buffer (filled with
+ * dumb_output_savestate() from this process).  */
+void dumb_output_restorestate(unsigned char *b)
+{
+  int r;
+
+  memcpy(screen_data, b, screen_cells * sizeof(cell)); b += screen_cells * sizeof(cell);
+  memcpy(screen_changes, b, screen_cells); b += screen_cells;
+  /* The changes could be anywhere now */
+  for (r = 0; r < h_screen_rows; r++) {
+    dirty_lo[r] = 0;
+    dirty_hi[r] = h_screen_cols;
+  }
+  cursor_row = core::get<decltype(cursor_row)>(b); b += sizeof(cursor_row);
+  cursor_col = core::get<decltype(cursor_col)>(b); b += sizeof(cursor_col);
+  current_style = core::get<decltype(current_style)>(b); b += sizeof(current_style);
+  captured_rows = core::get<decltype(captured_rows)>(b); b += sizeof(captured_rows);
+}
+#endif
+
 void dumb_init_output(void)
 {
+  int r;
+
   if (h_version == V3) {
     h_config |= CONFIG_SPLITSCREEN;
     h_flags &= ~OLD_SOUND_FLAG;
@@ -646,6 +924,16 @@ void dumb_init_output(void)
 
   screen_data = (cell *) malloc(screen_cells * sizeof(cell));
   screen_changes = (char *) malloc(screen_cells);
+  dirty_lo = (int *) malloc(h_screen_rows * sizeof(int));
+  dirty_hi = (int *) malloc(h_screen_rows * sizeof(int));
+  for (r = 0; r < h_screen_rows; r++) {
+    dirty_lo[r] = 0;
+    dirty_hi[r] = h_screen_cols;
+  }
   os_erase_area(1, 1, h_screen_rows, h_screen_cols);
   memset(screen_changes, 0, screen_cells);
+  for (r = 0; r < h_screen_rows; r++) {
+    dirty_lo[r] = h_screen_cols;
+    dirty_hi[r] = 0;
+  }
 }
@@ -1,18 +1,66 @@
 #include "autofrotz_vmlink.hpp"
+#include <cstdarg>
 #include <cstdio>
 #include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <functional>
+#include <map>
+#include <tuple>
+#ifdef __GLIBC__
+#include <pthread.h>
+#endif
+// from Frotz
+extern void memory_usage (size_t *story, size_t *undo);
+extern size_t screen_memory_usage ();
+extern void take_snapshot (core::string<autofrotz::vmlink::zbyte> &snapshot);
+extern bool can_resume_snapshot (const core::string<autofrotz::vmlink::zbyte> &snapshot);
+extern void apply_snapshot (const core::string<autofrotz::vmlink::zbyte> &snapshot);
+extern void set_read_set (iu64 *words);
+extern void begin_deferred_output ();
+extern void print_deferred (int kind, long value);
+extern void end_deferred_output ();
+extern vmlocal autofrotz::vmlink::zword h_globals;
 
 namespace autofrotz::vmlink {
 
 using core::u8string;
 using std::copy;
+using std::fill;
+using std::sort;
+using std::min;
+using std::greater;
+using std::tuple;
+using std::get;
+using std::pair;
+using std::make_pair;
+using std::map;
+using std::unordered_map;
+using std::max;
+using std::bit_width;
+using std::vector;
 using std::mutex;
 using std::unique_lock;
 using core::string;
 using std::exception_ptr;
+using std::chrono::steady_clock;
+using std::chrono::duration;
+using std::chrono::duration_cast;
+using std::chrono::nanoseconds;
 using std::rethrow_exception;
 using bitset::Bitset;
 using core::offset;
+using std::atomic;
+using std::ptrdiff_t;
+using std::function;
+using std::current_exception;
+using std::all_of;
+using std::popcount;
+using std::memcmp;
+using std::unique_ptr;
+using std::move;
 
 /* -----------------------------------------------------------------------------
 ----------------------------------------------------------------------------- */
@@ -20,8 +68,51 @@ DC();
 
 const u8string VmLink::EMPTY;
 
-VmLink::VmLink (const char *zcodeFileName, iu screenWidth, iu screenHeight, iu undoDepth, bool enableWordSet) :
-  isRunning(true), isDead(false), zcodeFileName(zcodeFileName), screenWidth(screenWidth), screenHeight(screenHeight), undoDepth(undoDepth), memorySize(0), dynamicMemorySize(0), dynamicMemory(nullptr), initialDynamicMemory(nullptr), wordSet(nullptr), inputI(EMPTY.end()), inputEnd(inputI), output(nullptr), saveState(nullptr), saveCount(0), restoreState(nullptr), restoreCount(0)
+// The number of instructions the interpreter runs between checks of the time
+// limit
+static const iu32 TICKS_PER_CHECK = 4096;
+
+// Stand-ins for routine addresses in the profiler's call tree
+static const iu32 TOP_LEVEL = 0xFFFFFFFE;
+static const iu32 UNKNOWN_ROUTINE = 0xFFFFFFFF;
+
+static atomic<AllocationHook> allocationHook(nullptr);
+
+static void appendUchars (u8string &r_o, const uchar *s, size_t n) {
+  // Reserve for the worst case (every character needing two bytes) up front,
+  // but still grow geometrically so that many short writes stay cheap
+  auto size = r_o.size();
+  auto capacity = r_o.capacity();
+  if (capacity - size < n * 2) {
+    r_o.reserve(max(size + n * 2, capacity * 2));
+  }
+
+  const uchar *end = s + n;
+  while (s != end) {
+    // Copy each run of ASCII characters across in one go
+    const uchar *runEnd = s;
+    while (runEnd != end && *runEnd < 128) {
+      ++runEnd;
+    }
+    if (runEnd != s) {
+      size = r_o.size();
+      r_o.resize(size + static_cast<size_t>(runEnd - s));
+      char8_t *o = r_o.data() + size;
+      for (; s != runEnd; ++s) {
+        *(o++) = static_cast<char8_t>(*s);
+      }
+    }
+    if (s != end) {
+      uchar c = *(s++);
+      DA(c < 256);
+      r_o.push_back(static_cast<char8_t>(((c >> 6) & 0b00011111) | 0b11000000));
+      r_o.push_back(static_cast<char8_t>((c & 0b00111111) | 0b10000000));
+    }
+  }
+}
+
+VmLink::VmLink (const char *zcodeFileName, iu screenWidth, iu screenHeight, iu undoDepth, bool enableWordSet, bool streamOutput, bool captureStatus) :
+  isRunning(true), isDead(false), call(nullptr), resumeSnapshot(nullptr), endSnapshot(nullptr), isResumeRejected(false), zcodeFileName(zcodeFileName), screenWidth(screenWidth), screenHeight(screenHeight), undoDepth(undoDepth), streamOutput(streamOutput), captureStatus(captureStatus), instructionBudget(0), timeLimit(steady_clock::duration::zero()), instructionsLeft(0), deadline(), tickGrant(UINT32_MAX), ticksLeft(UINT32_MAX), ticksUsed(0), outputStart(0), resumedAt(steady_clock::now()), awaitingWake(false), wokenAt(), blockedAt(), renderingAt(), phaseHistograms(), tracing(false), traceStart(), memorySize(0), dynamicMemorySize(0), dynamicMemory(nullptr), initialDynamicMemory(nullptr), wordSet(nullptr), randomLog(nullptr), heapSize(0), peakHeapSize(0), threadStackSize(0), allocationContext(nullptr), inputI(EMPTY.end()), inputEnd(inputI), output(nullptr), discardingOutput(false), silent(false), deferringOutput(false), saveState(nullptr), saveCount(0), restoreState(nullptr), restoreCount(0)
 {
   DW(, "vmlink constructed");
   if (enableWordSet) {
@@ -40,6 +131,15 @@ void VmLink::init (iu32 memorySize, iu16 dynamicMemorySize, const zbyte *dynamic
   if (wordSet.get()) {
     wordSet->ensureWidth(dynamicMemorySize);
   }
+
+  // This is the VM's thread, so find out how much stack it was given
+#ifdef __GLIBC__
+  pthread_attr_t attr;
+  if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+    pthread_attr_getstacksize(&attr, &threadStackSize);
+    pthread_attr_destroy(&attr);
+  }
+#endif
 }
 
 const char *VmLink::getZcodeFileName () const noexcept {
@@ -58,6 +158,14 @@ iu VmLink::getUndoDepth () const noexcept {
   return undoDepth;
 }
 
+bool VmLink::isStreamingOutput () const noexcept {
+  return streamOutput;
+}
+
+bool VmLink::isCapturingStatus () const noexcept {
+  return captureStatus;
+}
+
 void VmLink::markWord (zword addr) {
   Bitset *w = wordSet.get();
   if (w) {
@@ -65,6 +173,72 @@ void VmLink::markWord (zword addr) {
   }
 }
 
+void VmLink::countAllocation (ptrdiff_t bytes) noexcept {
+  heapSize += static_cast<size_t>(bytes);
+  peakHeapSize = max(peakHeapSize, heapSize);
+
+  AllocationHook hook = allocationHook.load(std::memory_order_relaxed);
+  if (hook) {
+    hook(allocationContext, bytes);
+  }
+}
+
+void VmLink::refillTicks () {
+  // The whole of the last grant has now been used up
+  if (instructionBudget != 0) {
+    instructionsLeft -= tickGrant;
+    if (instructionsLeft == 0) {
+      DW(, "instruction budget exhausted");
+      throw ActionLimitException(u8"VM exceeded its instruction budget");
+    }
+  }
+  if (timeLimit != steady_clock::duration::zero() && steady_clock::now() >= deadline) {
+    DW(, "time limit exceeded");
+    throw ActionLimitException(u8"VM exceeded its time limit");
+  }
+
+  ticksUsed += tickGrant;
+  tickGrant = UINT32_MAX;
+  if (timeLimit != steady_clock::duration::zero()) {
+    tickGrant = TICKS_PER_CHECK;
+  }
+  if (instructionBudget != 0 && instructionsLeft < tickGrant) {
+    tickGrant = static_cast<iu32>(instructionsLeft);
+  }
+  ticksLeft = tickGrant;
+}
+
+void VmLink::runCall (unique_lock<mutex> &l) {
+  // Run the call without holding the lock (so that it can use the VmLink
+  // freely) while the main thread goes on waiting
+  const function<void ()> *f = call;
+  exception_ptr e;
+  l.unlock();
+  try {
+    (*f)();
+  } catch (...) {
+    e = current_exception();
+  }
+  l.lock();
+  callException = e;
+  call = nullptr;
+  isRunning = false;
+  condVar.notify_one();
+}
+
+bool VmLink::resume () {
+  const string<zbyte> *snapshot = resumeSnapshot;
+  resumeSnapshot = nullptr;
+  if (!can_resume_snapshot(*snapshot)) {
+    // Leave the input for the main thread to drop
+    isResumeRejected = true;
+    endSnapshot = nullptr;
+    return false;
+  }
+  apply_snapshot(*snapshot);
+  return true;
+}
+
 uchar VmLink::readInput () {
   DPRE(!isDead);
   DPRE(isRunning);
@@ -73,12 +247,33 @@ uchar VmLink::readInput () {
     // There is no more input. Tell the main thread that we are done and wait
     // for more.
     DW(, "blocking for input");
+    if (endSnapshot) {
+      take_snapshot(*endSnapshot);
+      endSnapshot = nullptr;
+    }
     unique_lock<mutex> l(lock);
+    blockedAt = steady_clock::now();
+    actionStats.vmTime += blockedAt - resumedAt;
     isRunning = false;
     condVar.notify_one();
-    condVar.wait(l, [this] () {
-      return isRunning;
-    });
+    for (;;) {
+      condVar.wait(l, [this] () {
+        return isRunning;
+      });
+      if (call) {
+        runCall(l);
+      } else if (resumeSnapshot && !isDead && !resume()) {
+        isRunning = false;
+        condVar.notify_one();
+      } else {
+        break;
+      }
+    }
+    resumedAt = steady_clock::now();
+    if (awaitingWake) {
+      wokenAt = resumedAt;
+      awaitingWake = false;
+    }
 
     if (isDead) {
       // We're supposed to be dead, so oblige.
@@ -106,17 +301,81 @@ uchar VmLink::readInput () {
 void VmLink::writeOutput (uchar c) {
   DPRE(!!output);
 
-  // TODO wrapper for writing whole lines?
+  if (discardingOutput) {
+    return;
+  }
+
   DA(c < 256);
   // TODO make output be a uchar iterator
+  u8string &o = deferringOutput ? deferredText : *output;
   if (c < 128) {
-    output->push_back(static_cast<char8_t>(c));
+    o.push_back(static_cast<char8_t>(c));
+  } else {
+    o.push_back(static_cast<char8_t>(((c >> 6) & 0b00011111) | 0b11000000));
+    o.push_back(static_cast<char8_t>((c & 0b00111111) | 0b10000000));
+  }
+  if (deferringOutput) {
+    noteDeferredText();
+  }
+}
+
+void VmLink::writeOutput (const uchar *s, size_t n) {
+  DPRE(!!output);
+
+  if (discardingOutput) {
+    return;
+  }
+
+  if (deferringOutput) {
+    appendUchars(deferredText, s, n);
+    noteDeferredText();
   } else {
-    output->push_back(static_cast<char8_t>(((c >> 6) & 0b00011111) | 0b11000000));
-    output->push_back(static_cast<char8_t>((c & 0b00111111) | 0b10000000));
+    appendUchars(*output, s, n);
   }
 }
 
+void VmLink::noteDeferredText () {
+  // Text written between print operations is kept in order with them
+  if (deferredRecords.empty() || deferredRecords.back().kind != OutputRecord::TEXT) {
+    deferredRecords.push_back(OutputRecord{OutputRecord::TEXT, 0});
+  }
+  deferredRecords.back().value = static_cast<iu32>(deferredText.size());
+}
+
+void VmLink::beginStatusLine () {
+  statusLine.objectName.clear();
+}
+
+void VmLink::writeStatusName (const uchar *s, size_t n) {
+  appendUchars(statusLine.objectName, s, n);
+}
+
+void VmLink::setStatusScore (is16 score, iu16 moves) noexcept {
+  statusLine.isShown = true;
+  statusLine.isTime = false;
+  statusLine.score = score;
+  statusLine.moves = moves;
+}
+
+void VmLink::setStatusTime (iu16 hours, iu16 minutes) noexcept {
+  statusLine.isShown = true;
+  statusLine.isTime = true;
+  statusLine.hours = hours;
+  statusLine.minutes = minutes;
+}
+
+void VmLink::setUpperWindowHeight (iu height) {
+  upperWindow.resize(height);
+}
+
+void VmLink::setUpperWindowRow (iu row, const uchar *s, size_t n) {
+  DPRE(row < upperWindow.size());
+
+  u8string &o = upperWindow[row];
+  o.clear();
+  appendUchars(o, s, n);
+}
+
 ZbyteReader VmLink::createInitialDynamicMemoryReader () const {
   zbyte *m = initialDynamicMemory.get();
   return ZbyteReader(m, m + dynamicMemorySize);
@@ -157,6 +416,8 @@ void VmLink::completed (exception_ptr failureException) {
   DPRE(isRunning);
 
   unique_lock<mutex> l(lock);
+  blockedAt = steady_clock::now();
+  actionStats.vmTime += blockedAt - resumedAt;
   isRunning = false;
   isDead = true;
   this->failureException = failureException;
@@ -183,6 +444,63 @@ Bitset *VmLink::getWordSet () noexcept {
   return wordSet.get();
 }
 
+void VmLink::setReadTracking (bool enabled) {
+  DPRE(!isRunning);
+  DPRE(!isDead);
+
+  if (enabled == !!readSet) {
+    return;
+  }
+  unique_ptr<ReadSet> r(enabled ? new ReadSet() : nullptr);
+  ReadSet *p = r.get();
+  runOnVmThread([p] () {
+    if (p) {
+      p->globalsAddress = h_globals;
+    }
+    set_read_set(p ? p->addresses.getWords() : nullptr);
+  });
+  readSet = move(r);
+}
+
+ReadSet *VmLink::getReadSet () noexcept {
+  return readSet.get();
+}
+
+const ReadSet *VmLink::getReadSet () const noexcept {
+  return readSet.get();
+}
+
+void VmLink::markRandomRead () noexcept {
+  if (readSet) {
+    readSet->isRandomUsed = true;
+  }
+}
+
+void VmLink::setRandomLog (vector<iu32> *log) noexcept {
+  randomLog = log;
+}
+
+void VmLink::logRandomSeed (zword seed) {
+  // Seeds and numbers drawn are told apart by the bottom bit
+  if (randomLog) {
+    randomLog->push_back((static_cast<iu32>(seed) << 1) | 1);
+  }
+}
+
+void VmLink::logRandomNumber (zword number) {
+  if (randomLog) {
+    randomLog->push_back(static_cast<iu32>(number) << 1);
+  }
+}
+
+const StatusLine &VmLink::getStatusLine () const noexcept {
+  return statusLine;
+}
+
+const vector<u8string> &VmLink::getUpperWindow () const noexcept {
+  return upperWindow;
+}
+
 bool VmLink::isAlive () const noexcept {
   return !isDead;
 }
@@ -200,7 +518,19 @@ void VmLink::waitForInputExhaustion () {
   });
 }
 
+void VmLink::setInstructionBudget (iu64 budget) noexcept {
+  instructionBudget = budget;
+}
+
+void VmLink::setTimeLimit (steady_clock::duration limit) noexcept {
+  timeLimit = limit;
+}
+
 void VmLink::supplyInput (u8string::const_iterator inputBegin, u8string::const_iterator inputEnd) {
+  supplyInput(inputBegin, inputEnd, nullptr, nullptr);
+}
+
+void VmLink::supplyInput (u8string::const_iterator inputBegin, u8string::const_iterator inputEnd, const string<zbyte> *resumeSnapshot, string<zbyte> *r_endSnapshot) {
   DPRE(!isRunning);
 
   unique_lock<mutex> l(lock);
@@ -209,11 +539,54 @@ void VmLink::supplyInput (u8string::const_iterator inputBegin, u8string::const_i
   }
   inputI = inputBegin;
   this->inputEnd = inputEnd;
+  this->resumeSnapshot = resumeSnapshot;
+  endSnapshot = r_endSnapshot;
+  // Start the action's limits afresh (with a zero grant, so that the first
+  // instruction sets the real one up)
+  instructionsLeft = instructionBudget;
+  deadline = steady_clock::now() + timeLimit;
+  tickGrant = 0;
+  ticksLeft = 0;
+  ticksUsed = 0;
+  outputStart = output ? output->size() : 0;
+  awaitingWake = true;
+  auto start = steady_clock::now();
   isRunning = true;
   condVar.notify_one();
   condVar.wait(l, [this] () {
     return !isRunning;
   });
+  auto end = steady_clock::now();
+  this->resumeSnapshot = nullptr;
+  endSnapshot = nullptr;
+  if (isResumeRejected) {
+    isResumeRejected = false;
+    awaitingWake = false;
+    inputI = EMPTY.end();
+    this->inputEnd = inputI;
+    throw core::PlainException(u8"VM cannot resume the snapshot");
+  }
+
+  // Fill in the statistics that are cheaper to work out afterwards
+  actionStats.instructions = ticksUsed + (tickGrant - ticksLeft);
+  actionStats.outputBytes = output ? output->size() - outputStart : 0;
+  actionStats.handoffTime = (end - start) - actionStats.vmTime;
+
+  if (awaitingWake) {
+    // The VM never woke (having died in the meantime)
+    return;
+  }
+  phaseHistograms.wake.record(wokenAt - start);
+  phaseHistograms.interpretation.record(actionStats.vmTime - actionStats.renderTime);
+  phaseHistograms.rendering.record(actionStats.renderTime);
+  phaseHistograms.returning.record(end - blockedAt);
+  phaseHistograms.total.record(end - start);
+  if (tracing) {
+    traceEvents.push_back(TraceEvent{"doAction", false, start, end - start});
+    traceEvents.push_back(TraceEvent{"wake", false, start, wokenAt - start});
+    traceEvents.push_back(TraceEvent{"interpret", true, wokenAt, blockedAt - wokenAt});
+    traceEvents.push_back(TraceEvent{"return", false, blockedAt, end - blockedAt});
+  }
 }
 
 void VmLink::setOutput (u8string *output) {
@@ -222,6 +595,108 @@ void VmLink::setOutput (u8string *output) {
   this->output = output;
 }
 
+bool VmLink::isDiscardingOutput () const noexcept {
+  return discardingOutput;
+}
+
+void VmLink::setDiscardingOutput (bool discarding) noexcept {
+  discardingOutput = discarding;
+}
+
+void VmLink::setSilent (bool silent) noexcept {
+  this->silent = silent;
+}
+
+void VmLink::setDeferringOutput (bool deferring) noexcept {
+  deferringOutput = deferring;
+}
+
+iu32 VmLink::deferBytes (const zbyte *b, size_t n) {
+  iu32 offset = static_cast<iu32>(deferredBytes.size());
+  deferredBytes.append(b, n);
+  return offset;
+}
+
+size_t VmLink::getDeferredByteCount () const noexcept {
+  return deferredBytes.size();
+}
+
+const zbyte *VmLink::getDeferredBytes (iu32 offset) const noexcept {
+  return deferredBytes.data() + offset;
+}
+
+void VmLink::clearDeferredOutput () noexcept {
+  deferredRecords.clear();
+  deferredText.clear();
+  deferredBytes.clear();
+}
+
+bool VmLink::hasDeferredOperations () const noexcept {
+  // (Runs of text are kept as one record)
+  return deferredRecords.size() > 1 || (deferredRecords.size() == 1 && deferredRecords[0].kind != OutputRecord::TEXT);
+}
+
+void VmLink::replayDeferredOutput (u8string &r_output) {
+  // (On the VM's thread, which may be part way through an action)
+  u8string *o = output;
+  bool d = deferringOutput;
+  bool s = silent;
+  output = &r_output;
+  deferringOutput = false;
+  silent = false;
+  auto restore = [&] () {
+    end_deferred_output();
+    output = o;
+    deferringOutput = d;
+    silent = s;
+  };
+
+  begin_deferred_output();
+  try {
+    size_t textStart = 0;
+    for (const OutputRecord &r : deferredRecords) {
+      if (r.kind == OutputRecord::TEXT) {
+        r_output.append(deferredText, textStart, r.value - textStart);
+        textStart = r.value;
+      } else {
+        print_deferred(r.kind, r.value);
+      }
+    }
+  } catch (...) {
+    restore();
+    throw;
+  }
+  restore();
+}
+
+void VmLink::settleDeferredOutput () {
+  // The records can only be replayed by the VM's thread, so this is called
+  // before it goes
+  if (!hasDeferredOperations()) {
+    return;
+  }
+
+  u8string text;
+  replayDeferredOutput(text);
+  clearDeferredOutput();
+  deferredText = move(text);
+  noteDeferredText();
+}
+
+void VmLink::writeDeferredOutput (u8string &r_output) {
+  DPRE(!isRunning);
+
+  // Text alone needs no replaying
+  if (!hasDeferredOperations()) {
+    r_output.append(deferredText);
+    return;
+  }
+
+  runOnVmThread([this, &r_output] () {
+    replayDeferredOutput(r_output);
+  });
+}
+
 void VmLink::setSaveState (string<zbyte> *body) noexcept {
   saveState = body;
 }
@@ -247,6 +722,157 @@ void VmLink::resetRestoreCount () noexcept {
   restoreCount = 0;
 }
 
+const ActionStats &VmLink::getActionStats () const noexcept {
+  return actionStats;
+}
+
+void VmLink::resetActionStats () noexcept {
+  actionStats = ActionStats();
+}
+
+void VmLink::beginRendering () noexcept {
+  renderingAt = steady_clock::now();
+}
+
+void VmLink::endRendering () {
+  auto d = steady_clock::now() - renderingAt;
+  actionStats.renderTime += d;
+  if (tracing) {
+    traceEvents.push_back(TraceEvent{"render", true, renderingAt, d});
+  }
+}
+
+const PhaseHistograms &VmLink::getPhaseHistograms () const noexcept {
+  return phaseHistograms;
+}
+
+void VmLink::clearPhaseHistograms () noexcept {
+  phaseHistograms.clear();
+}
+
+void VmLink::setTracing (bool tracing) noexcept {
+  if (tracing && !this->tracing && traceEvents.empty()) {
+    traceStart = steady_clock::now();
+  }
+  this->tracing = tracing;
+}
+
+void VmLink::clearTrace () noexcept {
+  traceEvents.clear();
+  traceStart = steady_clock::now();
+}
+
+void VmLink::writeChromeTrace (u8string &r_out) const {
+  r_out.append(u8"{\"traceEvents\": [");
+  bool first = true;
+  for (const TraceEvent &e : traceEvents) {
+    // Times are in microseconds; the caller's thread is 1 and the VM's is 2
+    char b[192];
+    int l = snprintf(b, sizeof(b), "%s\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+      first ? "" : ",", e.name, e.onVmThread ? 2 : 1,
+      duration<double, std::micro>(e.start - traceStart).count(), duration<double, std::micro>(e.length).count());
+    DA(l >= 0 && static_cast<size_t>(l) < sizeof(b));
+    r_out.append(reinterpret_cast<const char8_t *>(b), static_cast<size_t>(l));
+    first = false;
+  }
+  r_out.append(u8"\n], \"displayTimeUnit\": \"ns\"}\n");
+}
+
+void VmLink::runOnVmThread (const function<void ()> &f) const {
+  DPRE(!isRunning);
+
+  unique_lock<mutex> l(lock);
+  if (isDead) {
+    throw core::PlainException(u8"VM is dead");
+  }
+  call = &f;
+  isRunning = true;
+  condVar.notify_one();
+  condVar.wait(l, [this] () {
+    return !isRunning;
+  });
+
+  if (callException) {
+    exception_ptr e = callException;
+    callException = nullptr;
+    rethrow_exception(e);
+  }
+}
+
+void VmLink::takeSnapshot (string<zbyte> &r_snapshot) const {
+  DPRE(!isRunning);
+  DPRE(!isDead);
+
+  runOnVmThread([&r_snapshot] () {
+    take_snapshot(r_snapshot);
+  });
+}
+
+bool VmLink::canResumeSnapshot (const string<zbyte> &snapshot) const {
+  DPRE(!isRunning);
+  DPRE(!isDead);
+
+  bool r;
+  runOnVmThread([&r, &snapshot] () {
+    r = can_resume_snapshot(snapshot);
+  });
+  return r;
+}
+
+void VmLink::applySnapshot (const string<zbyte> &snapshot) {
+  DPRE(!isRunning);
+  DPRE(!isDead);
+
+  runOnVmThread([&snapshot] () {
+    if (!can_resume_snapshot(snapshot)) {
+      throw core::PlainException(u8"VM cannot resume the snapshot");
+    }
+    apply_snapshot(snapshot);
+  });
+}
+
+void VmLink::setCapture (const StatusLine &statusLine, const vector<u8string> &upperWindow) {
+  this->statusLine = statusLine;
+  this->upperWindow = upperWindow;
+}
+
+MemoryUsage VmLink::getMemoryUsage () const {
+  DPRE(!isRunning);
+
+  MemoryUsage u;
+  // The Z-machine's own memory is gone once its thread is
+  if (!isDead) {
+    runOnVmThread([&u] () {
+      memory_usage(&u.story, &u.undo);
+      u.screen = screen_memory_usage();
+    });
+  }
+  size_t itemised = u.story + u.undo + u.screen;
+  u.otherHeap = heapSize > itemised ? heapSize - itemised : 0;
+  u.peakHeap = peakHeapSize;
+  u.initialDynamicMemory = initialDynamicMemory ? dynamicMemorySize : 0;
+  // The Bitset's own representation isn't visible, so count a bit per byte of
+  // dynamic memory
+  u.wordSet = wordSet ? sizeof(Bitset) + (dynamicMemorySize + 7) / 8 : 0;
+  u.writeSet = sizeof(AddressSet);
+  u.readSet = readSet ? sizeof(ReadSet) : 0;
+  u.threadStack = threadStackSize;
+  u.output = deferredRecords.capacity() * sizeof(OutputRecord) + deferredText.capacity() + deferredBytes.capacity();
+  u.records = profiler.getMemoryUsage() + traceEvents.capacity() * sizeof(TraceEvent) + statusLine.objectName.capacity() + upperWindow.capacity() * sizeof(u8string);
+  for (const u8string &row : upperWindow) {
+    u.records += row.capacity();
+  }
+  return u;
+}
+
+void VmLink::setAllocationContext (void *context) noexcept {
+  allocationContext = context;
+}
+
+void VmLink::setAllocationHook (AllocationHook hook) noexcept {
+  allocationHook.store(hook);
+}
+
 void VmLink::kill () {
   DPRE(!isRunning);
 
@@ -259,6 +885,334 @@ void VmLink::kill () {
   condVar.notify_one();
 }
 
+LatencyHistogram::LatencyHistogram () {
+  clear();
+}
+
+void LatencyHistogram::clear () noexcept {
+  fill(counts, counts + BUCKETS, 0);
+  count = 0;
+  total = 0;
+  max = 0;
+}
+
+void LatencyHistogram::record (steady_clock::duration d) noexcept {
+  auto ns = duration_cast<nanoseconds>(d).count();
+  iu64 v = ns < 0 ? 0 : static_cast<iu64>(ns);
+
+  iu i;
+  if (v < SUB_BUCKETS) {
+    i = static_cast<iu>(v);
+  } else {
+    iu shift = static_cast<iu>(bit_width(v)) - 5;
+    i = SUB_BUCKETS * shift + static_cast<iu>(v >> shift);
+  }
+  ++counts[min(i, BUCKETS - 1)];
+  ++count;
+  total += v;
+  if (v > max) {
+    max = v;
+  }
+}
+
+iu64 LatencyHistogram::getCount () const noexcept {
+  return count;
+}
+
+nanoseconds LatencyHistogram::getMean () const noexcept {
+  return nanoseconds(count == 0 ? 0 : static_cast<nanoseconds::rep>(total / count));
+}
+
+nanoseconds LatencyHistogram::getMax () const noexcept {
+  return nanoseconds(static_cast<nanoseconds::rep>(max));
+}
+
+nanoseconds LatencyHistogram::getPercentile (double percentile) const noexcept {
+  if (count == 0) {
+    return nanoseconds::zero();
+  }
+
+  // Find the bucket holding the value of that rank and give its upper bound
+  iu64 rank = static_cast<iu64>(percentile / 100 * static_cast<double>(count) + 0.5);
+  rank = rank == 0 ? 1 : min(rank, count);
+  iu64 seen = 0;
+  for (iu i = 0; i != BUCKETS; ++i) {
+    seen += counts[i];
+    if (seen >= rank) {
+      iu64 upper;
+      if (i < SUB_BUCKETS) {
+        upper = i;
+      } else {
+        iu shift = i / SUB_BUCKETS - 1;
+        upper = ((static_cast<iu64>(i - SUB_BUCKETS * shift) + 1) << shift) - 1;
+      }
+      return nanoseconds(static_cast<nanoseconds::rep>(min(upper, max)));
+    }
+  }
+  return getMax();
+}
+
+void PhaseHistograms::clear () noexcept {
+  wake.clear();
+  interpretation.clear();
+  rendering.clear();
+  returning.clear();
+  total.clear();
+}
+
+Profiler::Profiler () :
+  enabled(false)
+{
+  clear();
+}
+
+bool Profiler::isEnabled () const noexcept {
+  return enabled;
+}
+
+void Profiler::setEnabled (bool enabled) noexcept {
+  this->enabled = enabled;
+}
+
+size_t Profiler::getMemoryUsage () const noexcept {
+  // Each map entry costs its value and a next pointer, plus its bucket
+  return nodes.capacity() * sizeof(Node) + path.capacity() * sizeof(iu32) + children.size() * (sizeof(decltype(children)::value_type) + sizeof(void *)) + children.bucket_count() * sizeof(void *);
+}
+
+void Profiler::clear () {
+  fill(opcodeCounts, opcodeCounts + 256, 0);
+  fill(extendedOpcodeCounts, extendedOpcodeCounts + 256, 0);
+  nodes.clear();
+  nodes.push_back(Node{TOP_LEVEL, 0, 0, 0});
+  children.clear();
+  path.clear();
+  path.push_back(0);
+}
+
+void Profiler::enterRoutine (iu32 routine, iu depth) {
+  DPRE(depth > 0);
+
+  if (!enabled) {
+    return;
+  }
+  setDepth(depth - 1);
+  iu32 n = getChild(path.back(), routine);
+  ++nodes[n].calls;
+  path.push_back(n);
+}
+
+void Profiler::setDepth (iu depth) {
+  if (!enabled) {
+    return;
+  }
+  // Frames can vanish without being returned from (by throwing, restarting or
+  // restoring) and appear without being called (by restoring), in which case
+  // all that can be said about them is that they are somewhere unknown
+  path.resize(min(path.size(), static_cast<size_t>(depth) + 1));
+  while (path.size() < static_cast<size_t>(depth) + 1) {
+    path.push_back(getChild(path.back(), UNKNOWN_ROUTINE));
+  }
+}
+
+iu32 Profiler::getChild (iu32 parent, iu32 routine) {
+  iu64 key = (static_cast<iu64>(parent) << 32) | routine;
+  auto i = children.find(key);
+  if (i != children.end()) {
+    return i->second;
+  }
+
+  iu32 n = static_cast<iu32>(nodes.size());
+  nodes.push_back(Node{routine, parent, 0, 0});
+  children.emplace(key, n);
+  return n;
+}
+
+static void appendf (u8string &r_out, const char *format, ...) {
+  char b[128];
+  va_list args;
+  va_start(args, format);
+  int l = vsnprintf(b, sizeof(b), format, args);
+  va_end(args);
+  DA(l >= 0 && static_cast<size_t>(l) < sizeof(b));
+  r_out.append(reinterpret_cast<const char8_t *>(b), static_cast<size_t>(l));
+}
+
+static void appendRoutine (u8string &r_out, iu32 routine) {
+  if (routine == TOP_LEVEL) {
+    r_out.append(u8"(top)");
+  } else if (routine == UNKNOWN_ROUTINE) {
+    r_out.append(u8"?");
+  } else {
+    appendf(r_out, "0x%05lx", static_cast<unsigned long>(routine));
+  }
+}
+
+void Profiler::writeReport (u8string &r_out) const {
+  // Opcodes, by form and number
+  static const char *const FORMS[] = {"2OP", "1OP", "0OP", "VAR", "EXT"};
+  vector<tuple<iu64, iu, iu>> opcodes;
+  iu64 opcodeTotals[5][32] = {};
+  for (iu op = 0; op != 256; ++op) {
+    if (op < 0x80) {
+      opcodeTotals[0][op & 0x1f] += opcodeCounts[op];
+    } else if (op < 0xb0) {
+      opcodeTotals[1][op & 0x0f] += opcodeCounts[op];
+    } else if (op < 0xc0) {
+      if (op != 0xbe) {
+        opcodeTotals[2][op - 0xb0] += opcodeCounts[op];
+      }
+    } else if (op < 0xe0) {
+      opcodeTotals[0][op - 0xc0] += opcodeCounts[op];
+    } else {
+      opcodeTotals[3][op - 0xe0] += opcodeCounts[op];
+    }
+  }
+  for (iu form = 0; form != 5; ++form) {
+    for (iu number = 0; number != 32; ++number) {
+      iu64 count = (form == 4) ? extendedOpcodeCounts[number] : opcodeTotals[form][number];
+      if (count != 0) {
+        opcodes.emplace_back(count, form, number);
+      }
+    }
+  }
+  sort(opcodes.begin(), opcodes.end(), greater<>());
+  r_out.append(u8"opcode          count\n");
+  for (auto &o : opcodes) {
+    appendf(r_out, "%s:%-2u %14llu\n", FORMS[get<1>(o)], get<2>(o), static_cast<unsigned long long>(get<0>(o)));
+  }
+
+  // Routines, with exclusive counts taken straight from the tree and
+  // inclusive counts taken once per routine along each path (so that
+  // recursion isn't counted over and over)
+  class Totals {
+    pub iu64 calls = 0;
+    pub iu64 exclusive = 0;
+    pub iu64 inclusive = 0;
+  };
+  unordered_map<iu32, Totals> routines;
+  map<pair<iu32, iu32>, iu64> edges;
+  unordered_map<iu32, iu> onPath;
+  for (iu32 n = 0; n != nodes.size(); ++n) {
+    const Node &node = nodes[n];
+    Totals &t = routines[node.routine];
+    t.calls += node.calls;
+    t.exclusive += node.instructions;
+    if (node.calls != 0) {
+      edges[make_pair(nodes[node.parent].routine, node.routine)] += node.calls;
+    }
+
+    onPath.clear();
+    for (iu32 a = n;; a = nodes[a].parent) {
+      if (onPath[nodes[a].routine]++ == 0) {
+        routines[nodes[a].routine].inclusive += node.instructions;
+      }
+      if (a == 0) {
+        break;
+      }
+    }
+  }
+  vector<pair<iu32, Totals>> sortedRoutines(routines.begin(), routines.end());
+  sort(sortedRoutines.begin(), sortedRoutines.end(), [] (const pair<iu32, Totals> &l, const pair<iu32, Totals> &r) {
+    return l.second.inclusive > r.second.inclusive;
+  });
+  r_out.append(u8"\nroutine          calls      exclusive      inclusive\n");
+  for (auto &r : sortedRoutines) {
+    size_t start = r_out.size();
+    appendRoutine(r_out, r.first);
+    r_out.append(8 - min<size_t>(8, r_out.size() - start), u8' ');
+    appendf(r_out, "%14llu %14llu %14llu\n", static_cast<unsigned long long>(r.second.calls), static_cast<unsigned long long>(r.second.exclusive), static_cast<unsigned long long>(r.second.inclusive));
+  }
+
+  // Caller-to-callee edges
+  r_out.append(u8"\ncaller   callee            calls\n");
+  for (auto &e : edges) {
+    size_t start = r_out.size();
+    appendRoutine(r_out, e.first.first);
+    r_out.append(9 - min<size_t>(9, r_out.size() - start), u8' ');
+    start = r_out.size();
+    appendRoutine(r_out, e.first.second);
+    r_out.append(8 - min<size_t>(8, r_out.size() - start), u8' ');
+    appendf(r_out, "%14llu\n", static_cast<unsigned long long>(e.second));
+  }
+}
+
+void Profiler::writeFoldedStacks (u8string &r_out) const {
+  vector<iu32> stack;
+  for (iu32 n = 0; n != nodes.size(); ++n) {
+    if (nodes[n].instructions == 0) {
+      continue;
+    }
+
+    stack.clear();
+    for (iu32 a = n;; a = nodes[a].parent) {
+      stack.push_back(nodes[a].routine);
+      if (a == 0) {
+        break;
+      }
+    }
+    for (auto i = stack.rbegin(); i != stack.rend(); ++i) {
+      if (i != stack.rbegin()) {
+        r_out.push_back(u8';');
+      }
+      appendRoutine(r_out, *i);
+    }
+    appendf(r_out, " %llu\n", static_cast<unsigned long long>(nodes[n].instructions));
+  }
+}
+
+size_t MemoryUsage::getTotal () const noexcept {
+  return story + initialDynamicMemory + undo + screen + otherHeap + wordSet + writeSet + readSet + threadStack + output + records;
+}
+
+AddressSet::AddressSet () noexcept {
+  clear();
+}
+
+void AddressSet::clear () noexcept {
+  fill(words, words + WORDS, 0);
+}
+
+iu64 *AddressSet::getWords () noexcept {
+  return words;
+}
+
+bool AddressSet::isEmpty () const noexcept {
+  return all_of(words, words + WORDS, [] (iu64 w) {
+    return w == 0;
+  });
+}
+
+size_t AddressSet::getCount () const noexcept {
+  size_t count = 0;
+  for (iu64 w : words) {
+    count += static_cast<size_t>(popcount(w));
+  }
+  return count;
+}
+
+void ReadSet::clear () noexcept {
+  addresses.clear();
+  isRandomUsed = false;
+}
+
+bool ReadSet::isGlobalRead (zbyte global) const noexcept {
+  DPRE(global < 240);
+
+  iu32 addr = globalsAddress + 2 * static_cast<iu32>(global);
+  return addresses.contains(addr) || addresses.contains(addr + 1);
+}
+
+bool ReadSet::isUnchangedBetween (const zbyte *memory0, const zbyte *memory1, size_t size) const noexcept {
+  // Anything read beyond the memories is static, so can't have changed
+  bool unchanged = true;
+  addresses.forEachRun([&] (iu32 begin, iu32 end) {
+    if (unchanged && begin < size) {
+      unchanged = memcmp(memory0 + begin, memory1 + begin, min(static_cast<size_t>(end), size) - begin) == 0;
+    }
+  });
+  return unchanged;
+}
+
 ZbyteReader::ZbyteReader (const zbyte *begin, const zbyte *end) :
   begin(begin), end(end), i(begin)
 {
@@ -7,15 +7,24 @@
 #define AUTOFROTZ_VMLINK_ALREADYINCLUDED
 
 #include <core.hpp>
+#include <bit>
+#include <chrono>
 #include <condition_variable>
+#include <cstddef>
+#include <functional>
 #include <mutex>
+#include <unordered_map>
+#include <vector>
 #include <bitset.hpp>
 
 namespace autofrotz::vmlink {
 
 /* -----------------------------------------------------------------------------
 ----------------------------------------------------------------------------- */
-#define vmlocal /* thread_local */
+// Each VM runs on a thread of its own, so the interpreter's globals are kept
+// per thread (with __thread rather than thread_local, which would put every
+// access to an extern global through a call to its initialisation wrapper)
+#define vmlocal __thread
 
 extern DC();
 
@@ -26,46 +35,265 @@ typedef unsigned short zword;
 class ZbyteReader;
 class ZbyteWriter;
 
+class ActionLimitException : public core::PlainException {
+  pub using core::PlainException::PlainException;
+};
+
+class ActionStats {
+  pub iu64 instructions = 0;
+  pub iu64 calls = 0;
+  pub iu32 maxStackDepth = 0;
+  pub iu64 byteWrites = 0;
+  pub iu64 wordWrites = 0;
+  pub iu64 zchars = 0;
+  pub iu64 outputBytes = 0;
+  pub std::chrono::steady_clock::duration vmTime = std::chrono::steady_clock::duration::zero();
+  pub std::chrono::steady_clock::duration renderTime = std::chrono::steady_clock::duration::zero();
+  pub std::chrono::steady_clock::duration handoffTime = std::chrono::steady_clock::duration::zero();
+};
+
+class LatencyHistogram {
+  // Values below SUB_BUCKETS ns get a bucket each; above that, each power of
+  // two is split into SUB_BUCKETS buckets
+  prv static const iu SUB_BUCKETS = 16;
+  prv static const iu BUCKETS = SUB_BUCKETS * 61;
+
+  prv iu64 counts[BUCKETS];
+  prv iu64 count;
+  prv iu64 total;
+  prv iu64 max;
+
+  pub LatencyHistogram ();
+
+  pub void clear () noexcept;
+  pub void record (std::chrono::steady_clock::duration d) noexcept;
+  pub iu64 getCount () const noexcept;
+  pub std::chrono::nanoseconds getMean () const noexcept;
+  pub std::chrono::nanoseconds getMax () const noexcept;
+  pub std::chrono::nanoseconds getPercentile (double percentile) const noexcept;
+};
+
+class PhaseHistograms {
+  pub LatencyHistogram wake;
+  pub LatencyHistogram interpretation;
+  pub LatencyHistogram rendering;
+  pub LatencyHistogram returning;
+  pub LatencyHistogram total;
+
+  pub void clear () noexcept;
+};
+
+class Profiler {
+  prv class Node {
+    pub iu32 routine;
+    pub iu32 parent;
+    pub iu64 calls;
+    pub iu64 instructions;
+  };
+
+  prv bool enabled;
+  prv iu64 opcodeCounts[256];
+  prv iu64 extendedOpcodeCounts[256];
+  // The call tree (node 0 being the top level, outside of any routine), with
+  // the nodes along the current path kept per frame
+  prv std::vector<Node> nodes;
+  prv std::unordered_map<iu64, iu32> children;
+  prv std::vector<iu32> path;
+
+  pub Profiler ();
+
+  pub bool isEnabled () const noexcept;
+  pub void setEnabled (bool enabled) noexcept;
+  pub size_t getMemoryUsage () const noexcept;
+  pub void clear ();
+  pub void countOpcode (zbyte opcode) noexcept;
+  pub void countExtendedOpcode (zbyte opcode) noexcept;
+  pub void enterRoutine (iu32 routine, iu depth);
+  pub void setDepth (iu depth);
+  prv iu32 getChild (iu32 parent, iu32 routine);
+  pub void writeReport (core::u8string &r_out) const;
+  pub void writeFoldedStacks (core::u8string &r_out) const;
+};
+
+class MemoryUsage {
+  pub size_t story = 0;
+  pub size_t initialDynamicMemory = 0;
+  pub size_t undo = 0;
+  pub size_t screen = 0;
+  pub size_t otherHeap = 0;
+  pub size_t wordSet = 0;
+  pub size_t writeSet = 0;
+  pub size_t readSet = 0;
+  pub size_t threadStack = 0;
+  pub size_t output = 0;
+  pub size_t records = 0;
+  pub size_t peakHeap = 0;
+
+  pub size_t getTotal () const noexcept;
+};
+
+class AddressSet {
+  // A bit per address (and a word more, for a word written at the last
+  // address)
+  prv static const size_t WORDS = 0x10000 / 64 + 1;
+
+  prv iu64 words[WORDS];
+
+  pub AddressSet () noexcept;
+
+  pub void clear () noexcept;
+  pub iu64 *getWords () noexcept;
+  pub bool contains (iu32 addr) const noexcept;
+  pub bool isEmpty () const noexcept;
+  pub size_t getCount () const noexcept;
+  pub template<typename _F> void forEach (_F &&f) const;
+  pub template<typename _F> void forEachRun (_F &&f) const;
+};
+
+class ReadSet {
+  pub AddressSet addresses;
+  pub zword globalsAddress = 0;
+  pub bool isRandomUsed = false;
+
+  pub void clear () noexcept;
+  pub bool isGlobalRead (zbyte global) const noexcept;
+  pub bool isUnchangedBetween (const zbyte *memory0, const zbyte *memory1, size_t size) const noexcept;
+};
+
+typedef void (*AllocationHook) (void *context, std::ptrdiff_t bytes);
+
+class StatusLine {
+  pub bool isShown = false;
+  pub bool isTime = false;
+  pub core::u8string objectName;
+  pub is16 score = 0;
+  pub iu16 moves = 0;
+  pub iu16 hours = 0;
+  pub iu16 minutes = 0;
+};
+
+class OutputRecord {
+  pub static const zbyte TEXT = 0;
+
+  pub zbyte kind;
+  pub iu32 value;
+};
+
 class VmLink {
   prv static const core::u8string EMPTY;
 
   // VM state + synchronisation stuff
-  prv std::mutex lock;
-  prv std::condition_variable condVar;
-  prv volatile bool isRunning;
+  prv mutable std::mutex lock;
+  prv mutable std::condition_variable condVar;
+  prv mutable volatile bool isRunning;
   prv bool isDead;
   prv std::exception_ptr failureException;
+  prv mutable const std::function<void ()> *call;
+  prv mutable std::exception_ptr callException;
+  // Snapshots to resume from before the next input and to take once it is
+  // exhausted
+  prv const core::string<zbyte> *resumeSnapshot;
+  prv core::string<zbyte> *endSnapshot;
+  prv bool isResumeRejected;
   // VM config
   prv core::string<char> zcodeFileName;
   prv iu screenWidth;
   prv iu screenHeight;
   prv iu undoDepth;
+  prv bool streamOutput;
+  prv bool captureStatus;
+  // Action limits
+  prv iu64 instructionBudget;
+  prv std::chrono::steady_clock::duration timeLimit;
+  prv iu64 instructionsLeft;
+  prv std::chrono::steady_clock::time_point deadline;
+  prv iu32 tickGrant;
+  prv iu32 ticksLeft;
+  prv iu64 ticksUsed;
+  // Action statistics
+  prv ActionStats actionStats;
+  prv core::u8string::size_type outputStart;
+  prv std::chrono::steady_clock::time_point resumedAt;
+  // Action phase timing
+  prv bool awaitingWake;
+  prv std::chrono::steady_clock::time_point wokenAt;
+  prv std::chrono::steady_clock::time_point blockedAt;
+  prv std::chrono::steady_clock::time_point renderingAt;
+  prv PhaseHistograms phaseHistograms;
+  prv class TraceEvent {
+    pub const char *name;
+    pub bool onVmThread;
+    pub std::chrono::steady_clock::time_point start;
+    pub std::chrono::steady_clock::duration length;
+  };
+  prv bool tracing;
+  prv std::chrono::steady_clock::time_point traceStart;
+  prv std::vector<TraceEvent> traceEvents;
+  prv Profiler profiler;
   // VM properties
   prv iu32f memorySize;
   prv iu16f dynamicMemorySize;
   prv const zbyte *dynamicMemory;
   prv std::unique_ptr<zbyte []> initialDynamicMemory;
   prv std::unique_ptr<bitset::Bitset> wordSet;
+  prv AddressSet writeSet;
+  prv std::unique_ptr<ReadSet> readSet;
+  prv std::vector<iu32> *randomLog;
+  // Memory accounting
+  prv size_t heapSize;
+  prv size_t peakHeapSize;
+  prv size_t threadStackSize;
+  prv void *allocationContext;
   // I/O
   prv core::u8string::const_iterator inputI;
   prv core::u8string::const_iterator inputEnd;
   prv core::u8string *output;
+  prv bool discardingOutput;
+  prv bool silent;
+  // Print operations left for later, with the text written in the meantime
+  // (up to each TEXT record's value) and the bytes that they refer to
+  prv bool deferringOutput;
+  prv std::vector<OutputRecord> deferredRecords;
+  prv core::u8string deferredText;
+  prv core::string<zbyte> deferredBytes;
+  prv StatusLine statusLine;
+  prv std::vector<core::u8string> upperWindow;
   // Save and restore states
   prv core::string<zbyte> *saveState;
   iu saveCount;
   prv const core::string<zbyte> *restoreState;
   iu restoreCount;
 
-  pub VmLink (const char *zcodeFileName, iu screenWidth, iu screenHeight, iu undoDepth, bool enableWordSet);
+  pub VmLink (const char *zcodeFileName, iu screenWidth, iu screenHeight, iu undoDepth, bool enableWordSet, bool streamOutput, bool captureStatus);
   pub void init (iu32 memorySize, iu16 dynamicMemorySize, const zbyte *dynamicMemory);
 
   pub const char *getZcodeFileName () const noexcept;
   pub iu getScreenWidth () const noexcept;
   pub iu getScreenHeight () const noexcept;
   pub iu getUndoDepth () const noexcept;
+  pub bool isStreamingOutput () const noexcept;
+  pub bool isCapturingStatus () const noexcept;
   pub void markWord (zword addr);
+  pub void countInstruction ();
+  pub void countAllocation (std::ptrdiff_t bytes) noexcept;
+  pub void beginRendering () noexcept;
+  pub void endRendering ();
+  pub ActionStats &getActionStats () noexcept;
+  pub Profiler &getProfiler () noexcept;
+  pub const Profiler &getProfiler () const noexcept;
+  prv void refillTicks ();
+  prv void runCall (std::unique_lock<std::mutex> &l);
+  prv bool resume ();
   pub uchar readInput ();
   pub void writeOutput (uchar c);
+  pub void writeOutput (const uchar *s, size_t n);
+  prv void noteDeferredText ();
+  pub void beginStatusLine ();
+  pub void writeStatusName (const uchar *s, size_t n);
+  pub void setStatusScore (is16 score, iu16 moves) noexcept;
+  pub void setStatusTime (iu16 hours, iu16 minutes) noexcept;
+  pub void setUpperWindowHeight (iu height);
+  pub void setUpperWindowRow (iu row, const uchar *s, size_t n);
   pub ZbyteReader createInitialDynamicMemoryReader () const;
   pub bool hasSaveState () const noexcept;
   pub ZbyteWriter createSaveStateWriter ();
@@ -80,20 +308,159 @@ class VmLink {
   pub const zbyte *getDynamicMemory () const noexcept;
   pub const zbyte *getInitialDynamicMemory () const noexcept;
   pub bitset::Bitset *getWordSet () noexcept;
+  pub AddressSet &getWriteSet () noexcept;
+  pub const AddressSet &getWriteSet () const noexcept;
+  pub void setReadTracking (bool enabled);
+  pub ReadSet *getReadSet () noexcept;
+  pub const ReadSet *getReadSet () const noexcept;
+  pub void markRandomRead () noexcept;
+  pub void setRandomLog (std::vector<iu32> *log) noexcept;
+  pub void logRandomSeed (zword seed);
+  pub void logRandomNumber (zword number);
+  pub const StatusLine &getStatusLine () const noexcept;
+  pub const std::vector<core::u8string> &getUpperWindow () const noexcept;
   pub bool isAlive () const noexcept;
   pub void checkForFailure () const;
   pub void waitForInputExhaustion ();
+  pub void setInstructionBudget (iu64 budget) noexcept;
+  pub void setTimeLimit (std::chrono::steady_clock::duration limit) noexcept;
   pub void supplyInput (core::u8string::const_iterator inputBegin, core::u8string::const_iterator inputEnd);
+  pub void supplyInput (core::u8string::const_iterator inputBegin, core::u8string::const_iterator inputEnd, const core::string<zbyte> *resumeSnapshot, core::string<zbyte> *r_endSnapshot);
   pub void setOutput (core::u8string *output);
+  pub bool isDiscardingOutput () const noexcept;
+  pub void setDiscardingOutput (bool discarding) noexcept;
+  pub bool isSilent () const noexcept;
+  pub void setSilent (bool silent) noexcept;
+  pub bool isDeferringOutput () const noexcept;
+  pub void setDeferringOutput (bool deferring) noexcept;
+  pub void deferOutput (zbyte kind, iu32 value);
+  pub iu32 deferBytes (const zbyte *b, size_t n);
+  pub size_t getDeferredByteCount () const noexcept;
+  pub const zbyte *getDeferredBytes (iu32 offset) const noexcept;
+  pub void clearDeferredOutput () noexcept;
+  prv bool hasDeferredOperations () const noexcept;
+  prv void replayDeferredOutput (core::u8string &r_output);
+  pub void settleDeferredOutput ();
+  pub void writeDeferredOutput (core::u8string &r_output);
   pub void setSaveState (core::string<zbyte> *body) noexcept;
   pub iu getSaveCount () const noexcept;
   pub void resetSaveCount () noexcept;
   pub void setRestoreState (const core::string<zbyte> *body) noexcept;
   pub iu getRestoreCount () const noexcept;
   pub void resetRestoreCount () noexcept;
+  pub const ActionStats &getActionStats () const noexcept;
+  pub void resetActionStats () noexcept;
+  pub const PhaseHistograms &getPhaseHistograms () const noexcept;
+  pub void clearPhaseHistograms () noexcept;
+  pub void setTracing (bool tracing) noexcept;
+  pub void clearTrace () noexcept;
+  pub void writeChromeTrace (core::u8string &r_out) const;
+  pub void runOnVmThread (const std::function<void ()> &f) const;
+  pub void takeSnapshot (core::string<zbyte> &r_snapshot) const;
+  pub bool canResumeSnapshot (const core::string<zbyte> &snapshot) const;
+  pub void applySnapshot (const core::string<zbyte> &snapshot);
+  pub void setCapture (const StatusLine &statusLine, const std::vector<core::u8string> &upperWindow);
+  pub MemoryUsage getMemoryUsage () const;
+  pub void setAllocationContext (void *context) noexcept;
+  pub static void setAllocationHook (AllocationHook hook) noexcept;
   pub void kill ();
 };
 
+inline void VmLink::countInstruction () {
+  if (ticksLeft == 0) {
+    refillTicks();
+  }
+  --ticksLeft;
+}
+
+inline ActionStats &VmLink::getActionStats () noexcept {
+  return actionStats;
+}
+
+inline Profiler &VmLink::getProfiler () noexcept {
+  return profiler;
+}
+
+inline const Profiler &VmLink::getProfiler () const noexcept {
+  return profiler;
+}
+
+inline bool VmLink::isSilent () const noexcept {
+  return silent;
+}
+
+inline bool VmLink::isDeferringOutput () const noexcept {
+  return deferringOutput;
+}
+
+inline void VmLink::deferOutput (zbyte kind, iu32 value) {
+  deferredRecords.push_back(OutputRecord{kind, value});
+}
+
+inline AddressSet &VmLink::getWriteSet () noexcept {
+  return writeSet;
+}
+
+inline const AddressSet &VmLink::getWriteSet () const noexcept {
+  return writeSet;
+}
+
+inline bool AddressSet::contains (iu32 addr) const noexcept {
+  return (words[addr >> 6] >> (addr & 63)) & 1;
+}
+
+template<typename _F> void AddressSet::forEach (_F &&f) const {
+  for (size_t i = 0; i != WORDS; ++i) {
+    for (iu64 w = words[i]; w != 0; w &= w - 1) {
+      f(static_cast<iu32>(i * 64 + static_cast<size_t>(std::countr_zero(w))));
+    }
+  }
+}
+
+template<typename _F> void AddressSet::forEachRun (_F &&f) const {
+  // Calls f(begin, end) for each run of consecutive addresses
+  bool inRun = false;
+  iu32 begin = 0;
+  for (size_t i = 0; i != WORDS; ++i) {
+    const iu64 w = words[i];
+    if (w == (inRun ? ~static_cast<iu64>(0) : 0)) {
+      continue;
+    }
+    iu bit = 0;
+    while (bit != 64) {
+      // Look for the next bit that ends (or starts) a run
+      const iu64 rest = (inRun ? ~w : w) >> bit;
+      if (rest == 0) {
+        break;
+      }
+      bit += static_cast<iu>(std::countr_zero(rest));
+      const iu32 addr = static_cast<iu32>(i * 64 + bit);
+      if (inRun) {
+        f(begin, addr);
+      } else {
+        begin = addr;
+      }
+      inRun = !inRun;
+    }
+  }
+  if (inRun) {
+    f(begin, static_cast<iu32>(WORDS * 64));
+  }
+}
+
+inline void Profiler::countOpcode (zbyte opcode) noexcept {
+  if (enabled) {
+    ++opcodeCounts[opcode];
+    ++nodes[path.back()].instructions;
+  }
+}
+
+inline void Profiler::countExtendedOpcode (zbyte opcode) noexcept {
+  if (enabled) {
+    ++extendedOpcodeCounts[opcode];
+  }
+}
+
 class ZbyteReader {
   prv const zbyte *begin;
   prv const zbyte *end;